@@ -6,25 +6,79 @@ layout (location = 2) in vec2 texCoord;
 
 uniform mat4 uMVP;
 
+// Frames decoded here from the data as compressed in the file, see MD3Model::decodeOnGpu.
+// uFrames holds where the old and the new frame start: positions, offsets (-1 for base frames).
+uniform bool uDecodeFrames;
+uniform ivec4 uFrames;
+uniform float uLerp;
+
+uniform isamplerBuffer s_positions;     // md3XyzNormal_t
+uniform usamplerBuffer s_offsets;       // mdcXyzCompressed_t::ofsVec bytes
+uniform samplerBuffer s_normals;        // latLongNormals, then anormNormals
+
 out vec2 uv;
+out vec3 vNormal;
+
+vec3 framePosition(int positions, int offsets)
+{
+    // MD3_XYZ_SCALE
+    vec3 pos = vec3(texelFetch(s_positions, positions + gl_VertexID).xyz) * (1.0 / 64.0);
+    
+    if (offsets >= 0)
+    {
+        // (byte - MDC_MAX_OFS) * MDC_DIST_SCALE
+        pos += (vec3(texelFetch(s_offsets, offsets + gl_VertexID).xyz) - 127.0) * 0.05;
+    }
+    
+    return pos;
+}
+
+// Compressed MDC frames index the anorms after the 256 * 256 lat/long normals, see FrameKernel.h.
+vec3 frameNormal(int positions, int offsets)
+{
+    if (offsets >= 0)
+    {
+        return texelFetch(s_normals, 65536 + int(texelFetch(s_offsets, offsets + gl_VertexID).w)).xyz;
+    }
+    
+    return texelFetch(s_normals, texelFetch(s_positions, positions + gl_VertexID).w & 0xffff).xyz;
+}
 
 void main()
 {
-    gl_Position = uMVP * position;
+    vec4 pos = position;
+    vec3 n = normal;
+    
+    if (uDecodeFrames)
+    {
+        pos = vec4(mix(framePosition(uFrames.x, uFrames.y), framePosition(uFrames.z, uFrames.w), uLerp), 1.0);
+        n = mix(frameNormal(uFrames.x, uFrames.y), frameNormal(uFrames.z, uFrames.w), uLerp);
+    }
+    
+    gl_Position = uMVP * pos;
     uv = texCoord;
+    vNormal = n;
 }
 
 #shader fragment
 #version 410 core
 
 in vec2 uv;
+in vec3 vNormal;
 
 uniform sampler2D s_texture;
+uniform bool uShowNormals;
 
 //final color
 out vec4 FragColor;
 
 void main()
 {
+    if (uShowNormals)
+    {
+        FragColor = vec4(normalize(vNormal) * 0.5 + 0.5, 1.0);
+        return;
+    }
+    
     FragColor = texture(s_texture, uv);
 }
@@ -6,7 +6,12 @@ layout (location = 2) in vec4 packed2;
 layout (location = 3) in vec3 normal;
 layout (location = 4) in vec2 texCoord;
 
-uniform mat4 uBoneTransforms[128];
+// Bone palette of the surface, bound as a range of the per-frame uniform ring
+layout (std140) uniform BonePalette
+{
+    mat4 uBoneTransforms[128];
+};
+
 uniform mat4 uMVP;
 
 out vec2 uv;
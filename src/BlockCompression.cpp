@@ -0,0 +1,466 @@
+//
+//  BlockCompression.cpp
+//  wolfmv
+//
+
+#include "BlockCompression.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BC_ENCODER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+void TextureCompression::detectSupport()
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    
+    for (int i = 0; i < numExtensions; ++i)
+    {
+        auto name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        
+        if (name && (!strcmp(name, "GL_EXT_texture_compression_s3tc") || !strcmp(name, "GL_NV_texture_compression_s3tc")))
+        {
+            supported = true;
+            return;
+        }
+    }
+    
+    supported = false;
+}
+
+size_t bc1Bytes(int width, int height)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+size_t bc3Bytes(int width, int height)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 16;
+}
+
+namespace {
+    
+    struct Block
+    {
+        alignas(16) uint8_t rgba[16][4];
+    };
+    
+    void gatherBlock(const uint8_t *pixels, int width, int height, int channels, int bx, int by, Block &block)
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            const int py = std::min(by * 4 + y, height - 1);
+            
+            for (int x = 0; x < 4; ++x)
+            {
+                const int px = std::min(bx * 4 + x, width - 1);
+                const uint8_t *src = pixels + ((size_t)py * width + px) * channels;
+                uint8_t *dst = block.rgba[y * 4 + x];
+                
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                dst[3] = channels == 4 ? src[3] : 255;
+            }
+        }
+    }
+    
+    uint16_t to565(const float color[3])
+    {
+        const int r = std::clamp((int)lroundf(color[0] * 31.0f / 255.0f), 0, 31);
+        const int g = std::clamp((int)lroundf(color[1] * 63.0f / 255.0f), 0, 63);
+        const int b = std::clamp((int)lroundf(color[2] * 31.0f / 255.0f), 0, 31);
+        
+        return (uint16_t)((r << 11) | (g << 5) | b);
+    }
+    
+    void from565(uint16_t c, uint8_t rgb[3])
+    {
+        const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        
+        rgb[0] = (uint8_t)((r << 3) | (r >> 2));
+        rgb[1] = (uint8_t)((g << 2) | (g >> 4));
+        rgb[2] = (uint8_t)((b << 3) | (b >> 2));
+    }
+    
+    void bc1Palette(uint16_t c0, uint16_t c1, uint8_t palette[4][4])
+    {
+        from565(c0, palette[0]);
+        from565(c1, palette[1]);
+        
+        for (int i = 0; i < 3; ++i)
+        {
+            if (c0 > c1)
+            {
+                palette[2][i] = (uint8_t)((2 * palette[0][i] + palette[1][i] + 1) / 3);
+                palette[3][i] = (uint8_t)((palette[0][i] + 2 * palette[1][i] + 1) / 3);
+            }
+            else
+            {
+                palette[2][i] = (uint8_t)((palette[0][i] + palette[1][i]) / 2);
+                palette[3][i] = 0;
+            }
+        }
+        
+        palette[0][3] = palette[1][3] = palette[2][3] = 255;
+        palette[3][3] = c0 > c1 ? 255 : 0;
+    }
+    
+    // Nearest palette entry of every pixel, 2 bits each, alpha ignored.
+    uint32_t selectIndices(const Block &block, const uint8_t palette[4][4])
+    {
+        uint32_t indices = 0;
+        
+#ifdef BC_ENCODER_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+        __m128i colors[4];
+        
+        for (int k = 0; k < 4; ++k)
+        {
+            colors[k] = _mm_setr_epi16(palette[k][0], palette[k][1], palette[k][2], 0, palette[k][0], palette[k][1], palette[k][2], 0);
+        }
+        
+        for (int group = 0; group < 4; ++group)
+        {
+            const __m128i pixels = _mm_and_si128(_mm_load_si128((const __m128i *)block.rgba[group * 4]), rgbMask);
+            const __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+            const __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+            
+            __m128i best = _mm_set1_epi32(std::numeric_limits<int>::max());
+            __m128i bestIndex = zero;
+            
+            for (int k = 0; k < 4; ++k)
+            {
+                const __m128i dlo = _mm_sub_epi16(lo, colors[k]);
+                const __m128i dhi = _mm_sub_epi16(hi, colors[k]);
+                
+                // [r2+g2, b2, r2+g2, b2] of two pixels each, summed to one distance per pixel.
+                const __m128 slo = _mm_castsi128_ps(_mm_madd_epi16(dlo, dlo));
+                const __m128 shi = _mm_castsi128_ps(_mm_madd_epi16(dhi, dhi));
+                const __m128i dist = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(slo, shi, _MM_SHUFFLE(2, 0, 2, 0))),
+                                                   _mm_castps_si128(_mm_shuffle_ps(slo, shi, _MM_SHUFFLE(3, 1, 3, 1))));
+                
+                const __m128i closer = _mm_cmplt_epi32(dist, best);
+                best = _mm_or_si128(_mm_and_si128(closer, dist), _mm_andnot_si128(closer, best));
+                bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(k)), _mm_andnot_si128(closer, bestIndex));
+            }
+            
+            alignas(16) int32_t result[4];
+            _mm_store_si128((__m128i *)result, bestIndex);
+            
+            for (int i = 0; i < 4; ++i)
+            {
+                indices |= (uint32_t)result[i] << ((group * 4 + i) * 2);
+            }
+        }
+#else
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = std::numeric_limits<int>::max();
+            int bestIndex = 0;
+            
+            for (int k = 0; k < 4; ++k)
+            {
+                const int dr = block.rgba[i][0] - palette[k][0];
+                const int dg = block.rgba[i][1] - palette[k][1];
+                const int db = block.rgba[i][2] - palette[k][2];
+                const int dist = dr * dr + dg * dg + db * db;
+                
+                if (dist < best)
+                {
+                    best = dist;
+                    bestIndex = k;
+                }
+            }
+            
+            indices |= (uint32_t)bestIndex << (i * 2);
+        }
+#endif
+        
+        return indices;
+    }
+    
+    void encodeColorBlock(const Block &block, uint8_t *out)
+    {
+        // Principal axis of the colours by a few power iterations on the covariance.
+        float mean[3] = {};
+        
+        for (int i = 0; i < 16; ++i)
+        {
+            for (int c = 0; c < 3; ++c) mean[c] += block.rgba[i][c];
+        }
+        
+        for (int c = 0; c < 3; ++c) mean[c] /= 16.0f;
+        
+        float cov[6] = {};
+        
+        for (int i = 0; i < 16; ++i)
+        {
+            const float r = block.rgba[i][0] - mean[0];
+            const float g = block.rgba[i][1] - mean[1];
+            const float b = block.rgba[i][2] - mean[2];
+            
+            cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+            cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+        }
+        
+        float axis[3] = { 1.0f, 1.0f, 1.0f };
+        
+        for (int iteration = 0; iteration < 4; ++iteration)
+        {
+            const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+            const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+            const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+            const float length = std::max({ fabsf(x), fabsf(y), fabsf(z) });
+            
+            if (length < 1e-6f) break;
+            
+            axis[0] = x / length;
+            axis[1] = y / length;
+            axis[2] = z / length;
+        }
+        
+        // The extreme pixels along the axis are the endpoints.
+        float minDot = std::numeric_limits<float>::max(), maxDot = -minDot;
+        int minIndex = 0, maxIndex = 0;
+        
+        for (int i = 0; i < 16; ++i)
+        {
+            const float dot = block.rgba[i][0] * axis[0] + block.rgba[i][1] * axis[1] + block.rgba[i][2] * axis[2];
+            
+            if (dot < minDot) { minDot = dot; minIndex = i; }
+            if (dot > maxDot) { maxDot = dot; maxIndex = i; }
+        }
+        
+        float maxColor[3], minColor[3];
+        
+        for (int c = 0; c < 3; ++c)
+        {
+            maxColor[c] = block.rgba[maxIndex][c];
+            minColor[c] = block.rgba[minIndex][c];
+        }
+        
+        uint16_t c0 = to565(maxColor);
+        uint16_t c1 = to565(minColor);
+        uint32_t indices = 0;
+        
+        if (c0 < c1) std::swap(c0, c1);
+        
+        // A flat block: the four colour mode needs c0 > c1, index 0 is the colour anyway.
+        if (c0 != c1)
+        {
+            uint8_t palette[4][4];
+            bc1Palette(c0, c1, palette);
+            indices = selectIndices(block, palette);
+        }
+        
+        out[0] = (uint8_t)(c0 & 0xff);
+        out[1] = (uint8_t)(c0 >> 8);
+        out[2] = (uint8_t)(c1 & 0xff);
+        out[3] = (uint8_t)(c1 >> 8);
+        memcpy(out + 4, &indices, 4);
+    }
+    
+    void encodeAlphaBlock(const Block &block, uint8_t *out)
+    {
+        int a0 = 0, a1 = 255;
+        
+        for (int i = 0; i < 16; ++i)
+        {
+            a0 = std::max<int>(a0, block.rgba[i][3]);
+            a1 = std::min<int>(a1, block.rgba[i][3]);
+        }
+        
+        out[0] = (uint8_t)a0;
+        out[1] = (uint8_t)a1;
+        
+        // a0 > a1 selects the 8 level mode, equal alphas only use index 0.
+        int levels[8] = { a0, a1 };
+        
+        for (int i = 1; i < 7; ++i)
+        {
+            levels[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+        }
+        
+        uint64_t indices = 0;
+        
+        for (int i = 0; i < 16 && a0 != a1; ++i)
+        {
+            int best = 256, bestIndex = 0;
+            
+            for (int k = 0; k < 8; ++k)
+            {
+                const int dist = abs(block.rgba[i][3] - levels[k]);
+                
+                if (dist < best)
+                {
+                    best = dist;
+                    bestIndex = k;
+                }
+            }
+            
+            indices |= (uint64_t)bestIndex << (i * 3);
+        }
+        
+        for (int i = 0; i < 6; ++i)
+        {
+            out[2 + i] = (uint8_t)(indices >> (i * 8));
+        }
+    }
+    
+    void decodeColorBlock(const uint8_t *in, uint8_t rgba[16][4])
+    {
+        const uint16_t c0 = (uint16_t)(in[0] | (in[1] << 8));
+        const uint16_t c1 = (uint16_t)(in[2] | (in[3] << 8));
+        uint32_t indices;
+        memcpy(&indices, in + 4, 4);
+        
+        uint8_t palette[4][4];
+        bc1Palette(c0, c1, palette);
+        
+        for (int i = 0; i < 16; ++i)
+        {
+            memcpy(rgba[i], palette[(indices >> (i * 2)) & 3], 4);
+        }
+    }
+    
+    void decodeAlphaBlock(const uint8_t *in, uint8_t rgba[16][4])
+    {
+        const int a0 = in[0], a1 = in[1];
+        int levels[8] = { a0, a1 };
+        
+        for (int i = 1; i < 7; ++i)
+        {
+            levels[i + 1] = a0 > a1 ? ((7 - i) * a0 + i * a1) / 7 : 0;
+        }
+        
+        if (a0 <= a1)
+        {
+            for (int i = 1; i < 5; ++i) levels[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+            
+            levels[6] = 0;
+            levels[7] = 255;
+        }
+        
+        uint64_t indices = 0;
+        
+        for (int i = 0; i < 6; ++i)
+        {
+            indices |= (uint64_t)in[2 + i] << (i * 8);
+        }
+        
+        for (int i = 0; i < 16; ++i)
+        {
+            rgba[i][3] = (uint8_t)levels[(indices >> (i * 3)) & 7];
+        }
+    }
+    
+    void scatterBlock(const uint8_t rgba[16][4], int width, int height, int channels, int bx, int by, uint8_t *pixels)
+    {
+        for (int y = 0; y < 4 && by * 4 + y < height; ++y)
+        {
+            for (int x = 0; x < 4 && bx * 4 + x < width; ++x)
+            {
+                memcpy(pixels + ((size_t)(by * 4 + y) * width + bx * 4 + x) * channels, rgba[y * 4 + x], channels);
+            }
+        }
+    }
+}
+
+void encodeBC1(const uint8_t *pixels, int width, int height, int channels, uint8_t *blocks, int firstRow, int numRows)
+{
+    const int blocksX = (width + 3) / 4;
+    Block block;
+    
+    for (int by = firstRow; by < firstRow + numRows; ++by)
+    {
+        for (int bx = 0; bx < blocksX; ++bx)
+        {
+            gatherBlock(pixels, width, height, channels, bx, by, block);
+            encodeColorBlock(block, blocks + ((size_t)by * blocksX + bx) * 8);
+        }
+    }
+}
+
+void encodeBC3(const uint8_t *pixels, int width, int height, uint8_t *blocks, int firstRow, int numRows)
+{
+    const int blocksX = (width + 3) / 4;
+    Block block;
+    
+    for (int by = firstRow; by < firstRow + numRows; ++by)
+    {
+        for (int bx = 0; bx < blocksX; ++bx)
+        {
+            gatherBlock(pixels, width, height, 4, bx, by, block);
+            
+            uint8_t *out = blocks + ((size_t)by * blocksX + bx) * 16;
+            encodeAlphaBlock(block, out);
+            encodeColorBlock(block, out + 8);
+        }
+    }
+}
+
+void decodeBC1(const uint8_t *blocks, int width, int height, int channels, uint8_t *pixels)
+{
+    const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    uint8_t rgba[16][4];
+    
+    for (int by = 0; by < blocksY; ++by)
+    {
+        for (int bx = 0; bx < blocksX; ++bx)
+        {
+            decodeColorBlock(blocks + ((size_t)by * blocksX + bx) * 8, rgba);
+            scatterBlock(rgba, width, height, channels, bx, by, pixels);
+        }
+    }
+}
+
+void decodeBC3(const uint8_t *blocks, int width, int height, int channels, uint8_t *pixels)
+{
+    const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    uint8_t rgba[16][4];
+    
+    for (int by = 0; by < blocksY; ++by)
+    {
+        for (int bx = 0; bx < blocksX; ++bx)
+        {
+            const uint8_t *in = blocks + ((size_t)by * blocksX + bx) * 16;
+            decodeColorBlock(in + 8, rgba);
+            decodeAlphaBlock(in, rgba);
+            scatterBlock(rgba, width, height, channels, bx, by, pixels);
+        }
+    }
+}
+
+float psnr(const uint8_t *a, const uint8_t *b, size_t count)
+{
+    double error = 0;
+    
+    for (size_t i = 0; i < count; ++i)
+    {
+        const double d = (double)a[i] - b[i];
+        error += d * d;
+    }
+    
+    if (error == 0 || count == 0) return std::numeric_limits<float>::infinity();
+    
+    return (float)(10.0 * log10(255.0 * 255.0 / (error / count)));
+}
+
+const char *blockEncoderName()
+{
+#ifdef BC_ENCODER_SSE2
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,45 @@
+//
+//  BlockCompression.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// BC1 (DXT1) and BC3 (DXT5) encoding of RGB and RGBA pixels on the CPU.
+// Colour endpoints come from the principal axis of the block, every pixel
+// then takes the nearest of the four palette colours, which is the part
+// done four pixels at a time with SSE2 where available. BC3 adds the 8
+// level alpha block. Images are padded to whole blocks by repeating the
+// last row and column.
+
+struct TextureCompression
+{
+    /// Compress textures at load and in the cooker. Read by the decoding threads, set from the UI.
+    static inline std::atomic<bool> enabled = true;
+    
+    /// The GL context takes S3TC formats, set on the main thread at startup.
+    /// Without it compressed textures are decoded back on the CPU before the upload.
+    static inline bool supported = false;
+    
+    static void detectSupport();
+};
+
+size_t bc1Bytes(int width, int height);
+size_t bc3Bytes(int width, int height);
+
+/// Encode the block rows [firstRow, firstRow + numRows) of an image with 3 or 4 channels.
+void encodeBC1(const uint8_t *pixels, int width, int height, int channels, uint8_t *blocks, int firstRow, int numRows);
+void encodeBC3(const uint8_t *pixels, int width, int height, uint8_t *blocks, int firstRow, int numRows);
+
+/// Decode back to pixels with 3 or 4 channels.
+void decodeBC1(const uint8_t *blocks, int width, int height, int channels, uint8_t *pixels);
+void decodeBC3(const uint8_t *blocks, int width, int height, int channels, uint8_t *pixels);
+
+/// Peak signal to noise ratio of two images in dB, infinity when they are equal.
+float psnr(const uint8_t *a, const uint8_t *b, size_t count);
+
+const char *blockEncoderName();
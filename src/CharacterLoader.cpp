@@ -0,0 +1,112 @@
+//
+//  CharacterLoader.cpp
+//  wolfmv
+//
+
+#include "CharacterLoader.h"
+
+#include "WolfCharacter.h"
+#include "WolfAnim.h"
+#include "MainQueue.h"
+
+#include <chrono>
+#include <thread>
+
+void CharacterLoader::load(const std::string& folder, const std::string& skinName, Callback onLoaded)
+{
+    cancel();
+    
+    auto job = std::make_shared<Job>();
+    job->name = skinName;
+    job_ = job;
+    
+    std::thread([job, folder, skinName, onLoaded]() {
+        
+        auto animations = std::make_shared<std::vector<AnimationEntry>>();
+        auto character = std::make_shared<WolfCharacter>();
+        std::string error;
+        
+        const bool loaded = character->load(folder, skinName, *animations, error, [job](float progress) {
+            job->progress = progress * 0.5f;
+            return !job->cancelled;
+        });
+        
+        // Even a cancelled or failed character goes to the main thread, GL objects can't be released
+        // here. It is moved in, so the last reference never stays behind on this thread.
+        if (!loaded)
+        {
+            if (!error.empty()) printf("%s\n", error.c_str());
+            
+            MainQueue::instance().async([job, character = std::move(character), error]() {
+                job->error = error;
+                job->done = true;
+            });
+            
+            return;
+        }
+        
+        MainQueue::instance().async([job, character = std::move(character), animations = std::move(animations), onLoaded]() {
+            upload(job, character, animations, 0, onLoaded);
+        });
+        
+    }).detach();
+}
+
+void CharacterLoader::upload(std::shared_ptr<Job> job, std::shared_ptr<WolfCharacter> character,
+                             std::shared_ptr<std::vector<AnimationEntry>> animations, int step, Callback onLoaded)
+{
+    if (job->cancelled) return;
+    
+    auto start = std::chrono::steady_clock::now();
+    const int numSteps = character->numUploadSteps();
+    
+    while (step < numSteps)
+    {
+        character->uploadStep(step++);
+        job->progress = 0.5f + 0.5f * step / numSteps;
+        
+        if (std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() > uploadBudgetMs) break;
+    }
+    
+    if (step < numSteps)
+    {
+        // The rest goes to the next frames.
+        MainQueue::instance().async([job, character, animations, step, onLoaded]() {
+            upload(job, character, animations, step, onLoaded);
+        });
+        
+        return;
+    }
+    
+    job->done = true;
+    onLoaded(character, std::move(*animations));
+}
+
+void CharacterLoader::cancel()
+{
+    if (job_) job_->cancelled = true;
+    
+    job_ = nullptr;
+}
+
+bool CharacterLoader::isLoading() const
+{
+    return job_ && !job_->done;
+}
+
+float CharacterLoader::progress() const
+{
+    return job_ ? job_->progress.load() : 0.0f;
+}
+
+const std::string& CharacterLoader::error() const
+{
+    static const std::string empty;
+    return job_ && job_->done ? job_->error : empty;
+}
+
+const std::string& CharacterLoader::name() const
+{
+    static const std::string empty;
+    return job_ ? job_->name : empty;
+}
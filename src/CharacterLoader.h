@@ -0,0 +1,57 @@
+//
+//  CharacterLoader.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct WolfCharacter;
+struct AnimationEntry;
+
+// Loads a character without blocking the UI. Files, parsing, vertices and
+// texture pixels are handled on a worker thread, then the GL objects are
+// created on the main thread through MainQueue, a few at a time so a frame
+// never spends more than uploadBudgetMs on them. Starting a new load
+// cancels the one in flight, the callback only gets complete characters.
+// A load that fails never reaches the callback, error() says why.
+
+class CharacterLoader
+{
+public:
+    using Callback = std::function<void (std::shared_ptr<WolfCharacter>, std::vector<AnimationEntry>)>;
+    
+    void load(const std::string& folder, const std::string& skinName, Callback onLoaded);
+    void cancel();
+    
+    bool isLoading() const;
+    
+    /// From 0 to 1, the first half is the worker, the second one the upload.
+    float progress() const;
+    const std::string& name() const;
+    
+    /// Why the last load failed, empty while it runs or when it succeeded.
+    const std::string& error() const;
+    
+    static inline float uploadBudgetMs = 4;
+    
+private:
+    struct Job
+    {
+        std::string name;
+        std::string error;
+        std::atomic<bool> cancelled = false;
+        std::atomic<bool> done = false;
+        std::atomic<float> progress = 0;
+    };
+    
+    static void upload(std::shared_ptr<Job> job, std::shared_ptr<WolfCharacter> character,
+                       std::shared_ptr<std::vector<AnimationEntry>> animations, int step, Callback onLoaded);
+    
+    std::shared_ptr<Job> job_;
+};
@@ -0,0 +1,174 @@
+//
+//  CookedCache.cpp
+//  wolfmv
+//
+
+#include "CookedCache.h"
+#include "ThreadPool.h"
+#include "Utils.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+void CookedWriter::add(uint32_t id, const void *data, size_t size)
+{
+    auto bytes = (const uint8_t *)data;
+    sections_.emplace_back(id, std::vector<uint8_t>(bytes, bytes + size));
+}
+
+const CookedFile::Section* CookedFile::find(uint32_t id) const
+{
+    auto header = file.at<CookedCache::Header>(0);
+    
+    if (!header) return nullptr;
+    
+    for (const Section &section : file.span<Section>(sizeof(CookedCache::Header), header->numSections))
+    {
+        if (section.id == id) return &section;
+    }
+    
+    return nullptr;
+}
+
+std::string CookedCache::path(const std::string& source)
+{
+    // One cooked file per source, the name comes from the canonical path.
+    const std::string canonical = FileSystem::instance().canonicalPath(source);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.cooked", (unsigned long long)hashBytes((const uint8_t *)canonical.data(), canonical.size()));
+    
+    return (fs::path(directory) / name).string();
+}
+
+CookedFile CookedCache::open(const std::string& source, const FileData &sourceData, uint32_t kind, Key &key)
+{
+    key = Key();
+    
+    if (!enabled || sourceData.empty()) return CookedFile();
+    
+    key.path = path(source);
+    key.kind = kind;
+    key.sourceHash = hashBytes(sourceData.data(), sourceData.size());
+    key.sourceSize = sourceData.size();
+    
+    std::error_code ec;
+    
+    if (!fs::is_regular_file(key.path, ec))
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.missing++;
+        return CookedFile();
+    }
+    
+    CookedFile cooked;
+    cooked.file = FileSystem::instance().read(key.path);
+    
+    auto header = cooked.file.at<Header>(0);
+    
+    const bool upToDate = !rebuild && header && header->ident == COOKED_IDENT && header->version == kVersion && header->kind == kind &&
+                          header->sourceHash == key.sourceHash && header->sourceSize == key.sourceSize &&
+                          (int)cooked.file.span<CookedFile::Section>(sizeof(Header), header->numSections).size() == (int)header->numSections;
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    if (!upToDate)
+    {
+        if (!rebuild) printf("Cooked %s of %s is stale, rebuilding\n", key.path.c_str(), source.c_str());
+        stats_.stale++;
+        return CookedFile();
+    }
+    
+    stats_.hits++;
+    return cooked;
+}
+
+void CookedCache::store(const Key &key, CookedWriter writer)
+{
+    if (!enabled || key.path.empty()) return;
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pendingWrites_++;
+    }
+    
+    ThreadPool::instance().async([this, key, writer = std::move(writer)]() {
+        
+        Header header;
+        header.ident = COOKED_IDENT;
+        header.version = kVersion;
+        header.kind = key.kind;
+        header.numSections = (uint32_t)writer.sections_.size();
+        header.sourceHash = key.sourceHash;
+        header.sourceSize = key.sourceSize;
+        
+        auto align = [](uint64_t offset) { return (offset + COOKED_ALIGN - 1) & ~(uint64_t)(COOKED_ALIGN - 1); };
+        
+        std::vector<CookedFile::Section> table;
+        uint64_t offset = align(sizeof(Header) + writer.sections_.size() * sizeof(CookedFile::Section));
+        
+        for (const auto& [id, data] : writer.sections_)
+        {
+            table.push_back({ id, 0, offset, data.size() });
+            offset = align(offset + data.size());
+        }
+        
+        std::vector<uint8_t> blob(offset);
+        memcpy(blob.data(), &header, sizeof(header));
+        memcpy(blob.data() + sizeof(header), table.data(), table.size() * sizeof(CookedFile::Section));
+        
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            memcpy(blob.data() + table[i].offset, writer.sections_[i].second.data(), table[i].size);
+        }
+        
+        // Written aside and renamed, a reader never sees half a file.
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        
+        // Two loads of the same source may write at once, each gets its own temporary file.
+        static std::atomic<uint32_t> tempFiles{0};
+        const std::string temp = key.path + "." + std::to_string(tempFiles++) + ".tmp";
+        FILE *fp = fopen(temp.c_str(), "wb");
+        bool ok = fp && fwrite(blob.data(), 1, blob.size(), fp) == blob.size();
+        
+        if (fp) fclose(fp);
+        
+        if (ok)
+        {
+            fs::rename(temp, key.path, ec);
+            ok = !ec;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        if (ok)
+        {
+            stats_.written++;
+            stats_.bytesWritten += blob.size();
+        }
+        else
+        {
+            printf("Unable to write cooked %s\n", key.path.c_str());
+            fs::remove(temp, ec);
+            stats_.failed++;
+        }
+        
+        if (--pendingWrites_ == 0) writesDone_.notify_all();
+    });
+}
+
+void CookedCache::waitForWrites()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    writesDone_.wait(lock, [this]() { return pendingWrites_ == 0; });
+}
+
+CookedCache::Stats CookedCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
@@ -0,0 +1,172 @@
+//
+//  CookedCache.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "FileSystem.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+// Models converted to what the renderer uses, stored next to the viewer in
+// CookedCache::directory. A cooked file is a header and a table of sections,
+// each aligned to 16 bytes, so loading one is a single mapping: vertex and
+// index blobs go to glBufferData and the pose tables are read in place.
+//
+//   header   magic, cooker version, kind, source hash and size
+//   table    section id, offset, size
+//   data     sections
+//
+// An entry is up to date when the source hash and size and the cooker
+// version all match. Anything else is stale: the model is loaded from the
+// source and cooked again in the background.
+
+#define COOKED_IDENT (('C'<<24)+('M'<<16)+('M'<<8)+'W')
+#define COOKED_ALIGN 16
+
+/// Where the data of a surface is in the vertex, index and bone sections.
+struct CookedSurface
+{
+    char name[64];
+    uint32_t firstVertex;
+    uint32_t numVertices;
+    uint32_t firstIndex;
+    uint32_t numIndices;
+    uint32_t firstBone;
+    uint32_t numBones;
+};
+
+/// Builds the sections of a cooked file in memory.
+class CookedWriter
+{
+public:
+    void add(uint32_t id, const void *data, size_t size);
+    
+    template<typename T>
+    void add(uint32_t id, std::span<const T> data)
+    {
+        add(id, data.data(), data.size_bytes());
+    }
+    
+    template<typename T>
+    void add(uint32_t id, const std::vector<T> &data)
+    {
+        add(id, data.data(), data.size() * sizeof(T));
+    }
+    
+private:
+    friend class CookedCache;
+    
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> sections_;
+};
+
+/// A mapped cooked file.
+struct CookedFile
+{
+    FileData file;
+    
+    bool empty() const { return file.empty(); }
+    
+    /// The section as an array of T, empty if it's missing or the size doesn't fit.
+    template<typename T>
+    std::span<const T> section(uint32_t id) const
+    {
+        const Section *s = find(id);
+        
+        if (!s || s->size % sizeof(T) != 0) return {};
+        
+        return file.span<T>((int64_t)s->offset, (int64_t)(s->size / sizeof(T)));
+    }
+    
+    struct Section
+    {
+        uint32_t id;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
+    };
+    
+private:
+    const Section *find(uint32_t id) const;
+};
+
+class CookedCache
+{
+public:
+    static CookedCache& instance()
+    {
+        static CookedCache cache;
+        return cache;
+    }
+    
+    /// Bumped whenever the layout of any cooked kind changes, all the old entries go stale.
+    static constexpr uint32_t kVersion = 6;
+    
+    /// Read by the loading threads, set from the UI.
+    static inline std::atomic<bool> enabled = true;
+    
+    /// Treat every entry as stale and cook it again.
+    static inline std::atomic<bool> rebuild = false;
+    
+    static inline std::string directory = "cache";
+    
+    /// Which cooked file belongs to a source, filled by open and used by store.
+    struct Key
+    {
+        std::string path;
+        uint32_t kind = 0;
+        uint64_t sourceHash = 0;
+        uint64_t sourceSize = 0;
+    };
+    
+    /// Where the cooked file of `source` is, whether it exists or not.
+    static std::string path(const std::string& source);
+    
+    /// The cooked data of `source` if it's up to date, empty otherwise.
+    CookedFile open(const std::string& source, const FileData &sourceData, uint32_t kind, Key &key);
+    
+    /// Write the cooked file on the thread pool, replacing the old one.
+    void store(const Key &key, CookedWriter writer);
+    
+    /// Block until every stored file is written.
+    void waitForWrites();
+    
+    struct Stats
+    {
+        int hits = 0;
+        int stale = 0;
+        int missing = 0;
+        int written = 0;
+        int failed = 0;
+        size_t bytesWritten = 0;
+    };
+    
+    Stats stats() const;
+    
+private:
+    CookedCache() = default;
+    
+    struct Header
+    {
+        uint32_t ident;
+        uint32_t version;
+        uint32_t kind;
+        uint32_t numSections;
+        uint64_t sourceHash;
+        uint64_t sourceSize;
+    };
+    
+    friend struct CookedFile;
+    
+    mutable std::mutex mutex_;
+    std::condition_variable writesDone_;
+    int pendingWrites_ = 0;
+    Stats stats_;
+};
@@ -0,0 +1,188 @@
+//
+//  Cooker.cpp
+//  wolfmv
+//
+
+#include "Cooker.h"
+
+#include "BlockCompression.h"
+#include "CookedCache.h"
+#include "FileSystem.h"
+#include "ThreadPool.h"
+#include "MDSModel.h"
+#include "MD3Model.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+namespace {
+    
+    enum class AssetKind { Mds, Mdc, Texture, Count };
+    
+    struct Asset
+    {
+        std::string filename;
+        AssetKind kind;
+        size_t sourceBytes = 0;
+        size_t cookedBytes = 0;
+        float ms[2] = {};    // converted from the source, then from the cooked file
+        bool ok = false;
+        TextureDecodeStats::Texture texture = {};
+    };
+    
+    bool loadAsset(Asset &asset)
+    {
+        switch (asset.kind)
+        {
+            case AssetKind::Mds:
+            {
+                MDSModel model;
+                model.load(asset.filename);
+                return model.loaded();
+            }
+            case AssetKind::Mdc:
+            {
+                MD3Model model;
+                model.load(asset.filename);
+                return model.loaded();
+            }
+            default:
+            {
+                TextureImage image;
+                return decodeTexture(asset.filename, image, &asset.texture);
+            }
+        }
+    }
+}
+
+int cookAssets(const std::string& baseDir)
+{
+    FileSystem::instance().mount(baseDir);
+    
+    std::vector<Asset> assets;
+    
+    for (const auto& filename : FileSystem::instance().files())
+    {
+        std::string lower = filename;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        
+        if (lower.ends_with(".mds"))
+            assets.push_back({ .filename = filename, .kind = AssetKind::Mds });
+        else if (lower.ends_with(".mdc"))
+            assets.push_back({ .filename = filename, .kind = AssetKind::Mdc });
+        else if (lower.ends_with(".tga") || lower.ends_with(".jpg"))
+            assets.push_back({ .filename = filename, .kind = AssetKind::Texture });
+    }
+    
+    printf("Cooking %zu assets of %s into %s on %d threads\n", assets.size(), baseDir.c_str(),
+           CookedCache::directory.c_str(), ThreadPool::instance().numThreads());
+    
+    float wallMs[2] = {};
+    
+    // Everything is converted from the source and cooked, then loaded again from the cooked files.
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        CookedCache::rebuild = pass == 0;
+        
+        auto start = std::chrono::steady_clock::now();
+        
+        ThreadPool::instance().parallelFor((int)assets.size(), [&](int i) {
+            Asset &asset = assets[i];
+            
+            auto assetStart = std::chrono::steady_clock::now();
+            const bool ok = loadAsset(asset);
+            asset.ms[pass] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - assetStart).count();
+            
+            if (pass == 0)
+            {
+                asset.ok = ok;
+                asset.sourceBytes = FileSystem::instance().read(asset.filename).size();
+            }
+        });
+        
+        if (pass == 0)
+        {
+            CookedCache::instance().waitForWrites();
+            
+            for (Asset &asset : assets)
+            {
+                std::error_code ec;
+                const auto size = std::filesystem::file_size(CookedCache::path(asset.filename), ec);
+                asset.cookedBytes = ec ? 0 : (size_t)size;
+            }
+        }
+        
+        wallMs[pass] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    CookedCache::rebuild = false;
+    
+    const char *kindNames[] = { "mds", "mdc", "textures" };
+    int failedAssets = 0;
+    long long savedBytes = 0;
+    
+    for (int kind = 0; kind < (int)AssetKind::Count; ++kind)
+    {
+        int count = 0, failed = 0;
+        size_t sourceBytes = 0, cookedBytes = 0;
+        float ms[2] = {};
+        
+        for (const Asset &asset : assets)
+        {
+            if ((int)asset.kind != kind) continue;
+            
+            count++;
+            failed += asset.ok ? 0 : 1;
+            sourceBytes += asset.sourceBytes;
+            cookedBytes += asset.cookedBytes;
+            ms[0] += asset.ms[0];
+            ms[1] += asset.ms[1];
+        }
+        
+        if (count == 0) continue;
+        
+        failedAssets += failed;
+        savedBytes += (long long)sourceBytes - (long long)cookedBytes;
+        
+        // Negative savings are files that grow when cooked, e.g. JPG textures with their mips.
+        printf("%s: %d files (%d failed), %zu KB source, %zu KB cooked, saved %lld KB, converted in %.1f ms, from cooked %.1f ms, saved %.1f ms\n",
+               kindNames[kind], count, failed, sourceBytes / 1024, cookedBytes / 1024, ((long long)sourceBytes - (long long)cookedBytes) / 1024,
+               ms[0], ms[1], ms[0] - ms[1]);
+    }
+    
+    if (TextureCompression::enabled)
+    {
+        size_t bytes = 0, uncompressedBytes = 0;
+        const Asset *worst = nullptr;
+        
+        // The stats of the second pass come from the cooked files.
+        for (const Asset &asset : assets)
+        {
+            if (asset.kind != AssetKind::Texture || !asset.ok) continue;
+            
+            bytes += asset.texture.bytes;
+            uncompressedBytes += asset.texture.uncompressedBytes;
+            
+            if (!worst || asset.texture.psnr < worst->texture.psnr) worst = &asset;
+        }
+        
+        if (worst)
+        {
+            printf("Texture memory: %zu KB block compressed (%s), %zu KB uncompressed, lowest PSNR %.1f dB in %s\n", bytes / 1024,
+                   blockEncoderName(), uncompressedBytes / 1024, worst->texture.psnr, worst->filename.c_str());
+        }
+    }
+    
+    const CookedCache::Stats stats = CookedCache::instance().stats();
+    
+    printf("Wrote %d cooked files (%d failed), saved %lld KB over the sources\n", stats.written, stats.failed, savedBytes / 1024);
+    printf("Wall time: cooking %.1f ms, loading cooked %.1f ms\n", wallMs[0], wallMs[1]);
+    
+    if (failedAssets > 0) printf("%d assets failed to load\n", failedAssets);
+    
+    return failedAssets == 0 && stats.failed == 0 ? 0 : 1;
+}
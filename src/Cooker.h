@@ -0,0 +1,12 @@
+//
+//  Cooker.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <string>
+
+/// `wolfmv --cook <dir>`: cook every model and texture under the directory and in its paks
+/// on all the cores, then report the bytes written and the load time saved. Needs no window.
+int cookAssets(const std::string& baseDir);
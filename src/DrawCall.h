@@ -32,18 +32,31 @@ struct DrawCall
 {
     std::string name;
     
-    uint32_t vbo;
-    uint32_t numVertices;
-    void* verticesPtr;
+    uint32_t vbo = 0;
+    uint32_t numVertices = 0;
+    void* verticesPtr = nullptr;
     
-    uint32_t ibo;
-    uint32_t numIndices;
-    void* indicesPtr;
+    uint32_t ibo = 0;
+    uint32_t numIndices = 0;
+    void* indicesPtr = nullptr;
     
-    uint32_t vao;
+    uint32_t vao = 0;
 
-    std::vector<uint16_t> tib;
-    std::vector<Vertex2> tvb;
+    /// Where the surface starts in vertex and index data shared by the model.
+    uint32_t firstVertex = 0;
+    uint32_t firstIndex = 0;
+    
+    /// Skeleton bones used by the surface. Vertex bone indices point into this list.
+    std::vector<int> bones;
+    
+    /// Index ranges of the levels of detail, relative to firstIndex. Level 0 is the full mesh.
+    struct Lod
+    {
+        uint32_t firstIndex;
+        uint32_t numIndices;
+    };
+    
+    std::vector<Lod> lods;
 };
 
 typedef std::vector<DrawCall> DrawCallList;
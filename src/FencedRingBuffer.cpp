@@ -0,0 +1,98 @@
+//
+//  FencedRingBuffer.cpp
+//  wolfmv
+//
+
+#include "FencedRingBuffer.h"
+
+#include <glad/glad.h>
+#include <cstring>
+
+FencedRingBuffer::~FencedRingBuffer()
+{
+    for (auto& fence : fences_)
+    {
+        if (fence) glDeleteSync(fence);
+    }
+    
+    glDeleteBuffers(1, &buffer_);
+}
+
+void FencedRingBuffer::init(size_t segmentSize, size_t alignment, size_t tailSize)
+{
+    alignment_ = alignment;
+    tailSize_ = tailSize;
+    
+    glGenBuffers(1, &buffer_);
+    resize(segmentSize);
+}
+
+void FencedRingBuffer::resize(size_t segmentSize)
+{
+    // The storage is orphaned, so pending fences guard nothing anymore.
+    for (auto& fence : fences_)
+    {
+        if (fence) glDeleteSync(fence);
+        fence = nullptr;
+    }
+    
+    segmentSize_ = (segmentSize + alignment_ - 1) & ~(alignment_ - 1);
+    
+    glBindBuffer(target_, buffer_);
+    glBufferData(target_, segmentSize_ * kNumSegments + tailSize_, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(target_, 0);
+}
+
+void FencedRingBuffer::beginFrame()
+{
+    segment_ = (segment_ + 1) % kNumSegments;
+    staging_.clear();
+}
+
+size_t FencedRingBuffer::allocateBytes(size_t size, size_t alignment)
+{
+    size_t offset = (staging_.size() + alignment - 1) & ~(alignment - 1);
+    staging_.resize(offset + size);
+    
+    return offset;
+}
+
+void FencedRingBuffer::upload()
+{
+    if (staging_.empty()) return;
+    
+    if (staging_.size() > segmentSize_)
+    {
+        resize(staging_.size() * 2);
+    }
+    
+    GLsync &fence = fences_[segment_];
+    
+    if (fence)
+    {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+    
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    
+    glBindBuffer(target_, buffer_);
+    
+    const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+    void *ptr = glMapBufferRange(target_, segmentOffset(), staging_.size(), access);
+    
+    if (ptr)
+    {
+        memcpy(ptr, staging_.data(), staging_.size());
+        glUnmapBuffer(target_);
+    }
+    
+    glBindBuffer(target_, 0);
+}
+
+void FencedRingBuffer::endFrame()
+{
+    if (staging_.empty()) return;
+    
+    fences_[segment_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
@@ -0,0 +1,65 @@
+//
+//  FencedRingBuffer.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+typedef struct __GLsync *GLsync;
+
+// Triple-buffered GL buffer streamed from the CPU, shared by the uniform and
+// vertex rings. Data is staged while the frame is prepared, then copied into
+// the segment of the current frame with a single upload. Each segment is
+// guarded by a fence, so the CPU never overwrites data the GPU still reads.
+
+class FencedRingBuffer
+{
+public:
+    static constexpr int kNumSegments = 3;
+    
+    FencedRingBuffer(const FencedRingBuffer&) = delete;
+    FencedRingBuffer& operator =(const FencedRingBuffer&) = delete;
+    
+    void beginFrame();
+    
+    /// Copy everything staged this frame into the GPU buffer.
+    void upload();
+    
+    /// Fence the current segment once all of its draws are submitted.
+    void endFrame();
+    
+    unsigned int buffer() const { return buffer_; }
+    size_t bytesUploaded() const { return staging_.size(); }
+    
+protected:
+    explicit FencedRingBuffer(unsigned int target) : target_(target) {}
+    ~FencedRingBuffer();
+    
+    /// Segments are rounded up to `alignment`, a power of two. `tailSize` bytes
+    /// after the last segment let ranges be bound past the end of what is staged.
+    void init(size_t segmentSize, size_t alignment, size_t tailSize = 0);
+    
+    /// Reserve `size` bytes in the staging area at `alignment`, returns the offset.
+    size_t allocateBytes(size_t size, size_t alignment);
+    
+    /// Where the segment of the current frame starts in the buffer.
+    size_t segmentOffset() const { return segmentSize_ * segment_; }
+    
+    std::vector<uint8_t> staging_;
+    
+private:
+    void resize(size_t segmentSize);
+    
+    unsigned int target_;
+    unsigned int buffer_ = 0;
+    size_t segmentSize_ = 0;
+    size_t alignment_ = 1;
+    size_t tailSize_ = 0;
+    int segment_ = 0;
+    
+    GLsync fences_[kNumSegments] = { nullptr };
+};
@@ -0,0 +1,430 @@
+//
+//  FileSystem.cpp
+//  wolfmv
+//
+
+#include "FileSystem.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <cstring>
+#include <set>
+
+#include "../deps/stb_image.h"
+
+namespace fs = std::filesystem;
+
+#define ZIP_END_OF_CENTRAL_DIR_SIG 0x06054b50
+#define ZIP_CENTRAL_DIR_SIG 0x02014b50
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+
+#define ZIP_END_OF_CENTRAL_DIR_SIZE 22
+#define ZIP_CENTRAL_DIR_SIZE 46
+#define ZIP_LOCAL_HEADER_SIZE 30
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+// Zip records are packed little endian.
+static uint16_t readU16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t readU32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int FileSystem::mount(const std::string& baseDir)
+{
+    std::vector<std::string> filenames;
+    std::error_code ec;
+
+    for (const auto& entry : fs::directory_iterator(baseDir, ec))
+    {
+        std::string ext = entry.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        if (entry.is_regular_file() && ext == ".pk3")
+        {
+            filenames.push_back(entry.path().string());
+        }
+    }
+
+    // The game sorts the paks by name and the last one wins.
+    std::sort(filenames.begin(), filenames.end());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    baseDir_ = baseDir;
+    paks_.clear();
+    index_.clear();
+    cache_.clear();
+    cacheIndex_.clear();
+    stats_ = CacheStats();
+
+    for (const auto& filename : filenames)
+    {
+        addPak(filename);
+    }
+
+    printf("Mounted %s: %zu paks, %zu files\n", baseDir.c_str(), paks_.size(), index_.size());
+
+    return (int)paks_.size();
+}
+
+bool FileSystem::addPak(const std::string& filename)
+{
+    auto file = std::make_shared<MappedFile>();
+
+    if (!file->open(filename) || file->size() < ZIP_END_OF_CENTRAL_DIR_SIZE)
+    {
+        return false;
+    }
+
+    const uint8_t *data = file->data();
+    const size_t size = file->size();
+
+    // The end of central directory record is followed by a comment of up to 64 KB.
+    const uint8_t *end = nullptr;
+    const size_t searchStart = size > 0xffff + ZIP_END_OF_CENTRAL_DIR_SIZE ? size - 0xffff - ZIP_END_OF_CENTRAL_DIR_SIZE : 0;
+
+    for (size_t i = size - ZIP_END_OF_CENTRAL_DIR_SIZE + 1; i-- > searchStart;)
+    {
+        if (readU32(data + i) == ZIP_END_OF_CENTRAL_DIR_SIG)
+        {
+            end = data + i;
+            break;
+        }
+    }
+
+    if (!end)
+    {
+        printf("%s: not a zip file\n", filename.c_str());
+        return false;
+    }
+
+    const int numEntries = readU16(end + 10);
+    const size_t dirSize = readU32(end + 12);
+    const size_t dirOffset = readU32(end + 16);
+
+    if (dirOffset > size || dirSize > size - dirOffset)
+    {
+        printf("%s: central directory out of file bounds\n", filename.c_str());
+        return false;
+    }
+
+    const int pakIndex = (int)paks_.size();
+    const uint8_t *p = data + dirOffset;
+    const uint8_t *dirEnd = p + dirSize;
+
+    for (int i = 0; i < numEntries; i++)
+    {
+        if (p + ZIP_CENTRAL_DIR_SIZE > dirEnd || readU32(p) != ZIP_CENTRAL_DIR_SIG)
+        {
+            printf("%s: broken central directory\n", filename.c_str());
+            break;
+        }
+
+        Entry entry;
+        entry.pak = pakIndex;
+        entry.method = readU16(p + 10);
+        entry.compressedSize = readU32(p + 20);
+        entry.size = readU32(p + 24);
+        entry.localHeaderOffset = readU32(p + 42);
+
+        const int nameLength = readU16(p + 28);
+        const int extraLength = readU16(p + 30);
+        const int commentLength = readU16(p + 32);
+
+        if (p + ZIP_CENTRAL_DIR_SIZE + nameLength > dirEnd) break;
+
+        std::string name((const char *)p + ZIP_CENTRAL_DIR_SIZE, nameLength);
+
+        // Directories have their own entries, list() derives them from the files.
+        if (!name.empty() && name.back() != '/')
+        {
+            index_[normalize(name)] = entry;
+        }
+
+        p += ZIP_CENTRAL_DIR_SIZE + nameLength + extraLength + commentLength;
+    }
+
+    paks_.push_back({ filename, std::move(file) });
+
+    return true;
+}
+
+std::string FileSystem::normalize(const std::string& path) const
+{
+    std::string result = path;
+    std::replace(result.begin(), result.end(), '\\', '/');
+
+    // Full paths into the base directory are looked up like the relative ones.
+    if (!baseDir_.empty())
+    {
+        std::string base = baseDir_;
+        std::replace(base.begin(), base.end(), '\\', '/');
+
+        if (!base.ends_with('/')) base += '/';
+
+        if (result.starts_with(base)) result = result.substr(base.size());
+    }
+
+    while (result.starts_with("./")) result = result.substr(2);
+    while (result.starts_with("/")) result = result.substr(1);
+
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+
+    return result;
+}
+
+std::string FileSystem::canonicalPath(const std::string& path) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return normalize(path);
+}
+
+const FileSystem::Entry* FileSystem::find(const std::string& path) const
+{
+    auto it = index_.find(normalize(path));
+    return it != index_.end() ? &it->second : nullptr;
+}
+
+bool FileSystem::exists(const std::string& path) const
+{
+    std::error_code ec;
+
+    if (fs::is_regular_file(path, ec)) return true;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (find(path)) return true;
+
+    return !baseDir_.empty() && fs::is_regular_file(fs::path(baseDir_) / path, ec);
+}
+
+FileData FileSystem::read(const std::string& path)
+{
+    auto readLoose = [](const fs::path& filename)
+    {
+        FileData result;
+        auto file = std::make_shared<MappedFile>();
+
+        if (file->open(filename.string()))
+        {
+            result.bytes = std::span<const uint8_t>(file->data(), file->size());
+            result.mapped = file->isMapped();
+            result.owner = std::move(file);
+        }
+
+        return result;
+    };
+
+    std::error_code ec;
+
+    if (fs::is_regular_file(path, ec))
+    {
+        return readLoose(path);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    const std::string key = normalize(path);
+    auto it = index_.find(key);
+
+    if (it != index_.end())
+    {
+        return readEntry(key, it->second, lock);
+    }
+
+    if (!baseDir_.empty() && fs::is_regular_file(fs::path(baseDir_) / path, ec))
+    {
+        lock.unlock();
+        return readLoose(fs::path(baseDir_) / path);
+    }
+
+    printf("unable to open %s\n", path.c_str());
+
+    return FileData();
+}
+
+// Called with the mutex locked by `lock`.
+FileData FileSystem::readEntry(const std::string& key, const Entry entry, std::unique_lock<std::mutex>& lock)
+{
+    const std::shared_ptr<MappedFile> file = paks_[entry.pak].file;
+    const std::string pakName = paks_[entry.pak].filename;
+    FileData result;
+
+    const uint8_t *local = file->data() + entry.localHeaderOffset;
+
+    if ((size_t)entry.localHeaderOffset + ZIP_LOCAL_HEADER_SIZE > file->size() || readU32(local) != ZIP_LOCAL_HEADER_SIG)
+    {
+        printf("%s: broken local header of %s\n", pakName.c_str(), key.c_str());
+        return result;
+    }
+
+    const size_t dataOffset = (size_t)entry.localHeaderOffset + ZIP_LOCAL_HEADER_SIZE + readU16(local + 26) + readU16(local + 28);
+
+    if (dataOffset > file->size() || entry.compressedSize > file->size() - dataOffset)
+    {
+        printf("%s: %s is out of file bounds\n", pakName.c_str(), key.c_str());
+        return result;
+    }
+
+    const uint8_t *compressed = file->data() + dataOffset;
+
+    if (entry.method == ZIP_METHOD_STORED)
+    {
+        result.bytes = std::span<const uint8_t>(compressed, std::min(entry.size, entry.compressedSize));
+        result.owner = file;
+        result.mapped = file->isMapped();
+        return result;
+    }
+
+    if (entry.method != ZIP_METHOD_DEFLATED)
+    {
+        printf("%s: unsupported compression method %d of %s\n", pakName.c_str(), entry.method, key.c_str());
+        return result;
+    }
+
+    auto cached = cacheIndex_.find(key);
+
+    if (cached != cacheIndex_.end())
+    {
+        cache_.splice(cache_.begin(), cache_, cached->second);
+        stats_.hits++;
+
+        result.owner = cached->second->data;
+        result.bytes = *cached->second->data;
+        return result;
+    }
+
+    stats_.misses++;
+
+    // The pak stays mapped while `file` holds it, inflate without holding the lock.
+    lock.unlock();
+
+    // stb_image's inflate wants a few bytes of look ahead past the end of the stream, it never
+    // uses them. The central directory always follows the entry, so they are in the mapping.
+    const size_t lookAhead = std::min<size_t>(8, file->size() - dataOffset - entry.compressedSize);
+
+    auto inflated = std::make_shared<std::vector<uint8_t>>(entry.size);
+    const int length = stbi_zlib_decode_noheader_buffer((char *)inflated->data(), (int)entry.size, (const char *)compressed, (int)(entry.compressedSize + lookAhead));
+
+    lock.lock();
+
+    if (length != (int)entry.size)
+    {
+        printf("%s: failed to inflate %s\n", pakName.c_str(), key.c_str());
+        return result;
+    }
+
+    // Another thread may have inflated it meanwhile.
+    if (!cacheIndex_.contains(key))
+    {
+        cache_.push_front({ key, inflated });
+        cacheIndex_[key] = cache_.begin();
+        stats_.bytes += inflated->size();
+
+        // Evicted files stay alive as long as somebody holds them.
+        while (stats_.bytes > cacheBudget && cache_.size() > 1)
+        {
+            stats_.bytes -= cache_.back().data->size();
+            cacheIndex_.erase(cache_.back().key);
+            cache_.pop_back();
+        }
+    }
+
+    result.owner = inflated;
+    result.bytes = *inflated;
+    return result;
+}
+
+std::vector<std::string> FileSystem::list(const std::string& dir) const
+{
+    std::set<std::string> names;
+    std::error_code ec;
+
+    auto addDirectory = [&](const fs::path& path)
+    {
+        for (const auto& entry : fs::directory_iterator(path, ec))
+        {
+            names.insert(entry.path().filename().string());
+        }
+    };
+
+    addDirectory(dir);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!baseDir_.empty() && fs::path(dir).is_relative())
+    {
+        addDirectory(fs::path(baseDir_) / dir);
+    }
+
+    std::string prefix = normalize(dir);
+
+    if (!prefix.empty() && !prefix.ends_with('/')) prefix += '/';
+
+    for (const auto& [name, entry] : index_)
+    {
+        if (!name.starts_with(prefix)) continue;
+
+        const size_t slash = name.find('/', prefix.size());
+        names.insert(name.substr(prefix.size(), slash == std::string::npos ? std::string::npos : slash - prefix.size()));
+    }
+
+    return std::vector<std::string>(names.begin(), names.end());
+}
+
+std::vector<std::string> FileSystem::files() const
+{
+    std::set<std::string> names;
+    std::error_code ec;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (baseDir_.empty()) return {};
+
+    for (const auto& entry : fs::recursive_directory_iterator(baseDir_, ec))
+    {
+        if (entry.is_regular_file())
+        {
+            names.insert(fs::relative(entry.path(), baseDir_, ec).generic_string());
+        }
+    }
+
+    for (const auto& [name, entry] : index_)
+    {
+        names.insert(name);
+    }
+
+    return std::vector<std::string>(names.begin(), names.end());
+}
+
+std::string FileSystem::baseDir() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return baseDir_;
+}
+
+int FileSystem::numPaks() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)paks_.size();
+}
+
+size_t FileSystem::numEntries() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.size();
+}
+
+FileSystem::CacheStats FileSystem::cacheStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
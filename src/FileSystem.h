@@ -0,0 +1,139 @@
+//
+//  FileSystem.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class MappedFile;
+
+/// Contents of a file. The owner keeps the bytes alive: a file mapping for loose files
+/// and stored pk3 entries, or an inflated buffer shared with the cache.
+struct FileData
+{
+    std::span<const uint8_t> bytes;
+    std::shared_ptr<const void> owner;
+
+    /// Served straight from a mapping, without a copy.
+    bool mapped = false;
+
+    const uint8_t* data() const { return bytes.data(); }
+    size_t size() const { return bytes.size(); }
+    bool empty() const { return bytes.empty(); }
+
+    /// `count` objects of T at `offset`, empty if they don't fit in the file.
+    template<typename T>
+    std::span<const T> span(int64_t offset, int64_t count = 1) const
+    {
+        if (offset < 0 || count < 0 || (uint64_t)offset > bytes.size() || (uint64_t)count > (bytes.size() - offset) / sizeof(T))
+        {
+            return {};
+        }
+
+        return std::span<const T>((const T *)(bytes.data() + offset), (size_t)count);
+    }
+
+    /// A single T at `offset`, nullptr if it doesn't fit in the file.
+    template<typename T>
+    const T* at(int64_t offset) const
+    {
+        auto s = span<T>(offset);
+        return s.empty() ? nullptr : s.data();
+    }
+};
+
+// Loose files and the pk3 archives of a base directory behind one namespace.
+// Paths that exist on disk are read as is. Everything else is looked up in a
+// single index of the central directories of all mounted paks, a later pak
+// overrides an earlier one like in the game. Deflated entries are inflated on
+// demand and kept in a cache bounded by cacheBudget.
+
+class FileSystem
+{
+public:
+    static FileSystem& instance()
+    {
+        static FileSystem fs;
+        return fs;
+    }
+
+    /// Open every pk3 in `baseDir`, replaces what was mounted before. Returns the number of paks.
+    int mount(const std::string& baseDir);
+
+    bool exists(const std::string& path) const;
+    FileData read(const std::string& path);
+
+    /// Names of the files and directories right under `dir`, on disk and in the paks.
+    std::vector<std::string> list(const std::string& dir) const;
+
+    /// Every file under the base directory and in the paks, relative to the base directory.
+    std::vector<std::string> files() const;
+
+    /// The name a file has in the index: lower case, forward slashes, relative to the base directory.
+    std::string canonicalPath(const std::string& path) const;
+
+    std::string baseDir() const;
+    int numPaks() const;
+    size_t numEntries() const;
+
+    static inline size_t cacheBudget = 32 * 1024 * 1024;
+
+    struct CacheStats
+    {
+        int hits = 0;
+        int misses = 0;
+        size_t bytes = 0;
+    };
+
+    CacheStats cacheStats() const;
+
+private:
+    FileSystem() = default;
+
+    struct Pak
+    {
+        std::string filename;
+        std::shared_ptr<MappedFile> file;
+    };
+
+    struct Entry
+    {
+        int pak;
+        uint32_t localHeaderOffset;
+        uint32_t compressedSize;
+        uint32_t size;
+        uint16_t method;
+    };
+
+    bool addPak(const std::string& filename);
+    const Entry* find(const std::string& path) const;
+    FileData readEntry(const std::string& key, const Entry entry, std::unique_lock<std::mutex>& lock);
+
+    /// Lower case and forward slashes, relative to the base directory.
+    std::string normalize(const std::string& path) const;
+
+    std::string baseDir_;
+    std::vector<Pak> paks_;
+    std::unordered_map<std::string, Entry> index_;
+
+    struct CacheItem
+    {
+        std::string key;
+        std::shared_ptr<std::vector<uint8_t>> data;
+    };
+
+    mutable std::mutex mutex_;
+    std::list<CacheItem> cache_;   // most recently used first
+    std::unordered_map<std::string, std::list<CacheItem>::iterator> cacheIndex_;
+    CacheStats stats_;
+};
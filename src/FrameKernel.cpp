@@ -0,0 +1,233 @@
+//
+//  FrameKernel.cpp
+//  wolfmv
+//
+
+#include "FrameKernel.h"
+
+#include <cmath>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FRAME_KERNEL_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define NUM_LAT_LONG_NORMALS (256 * 256)
+#define NUM_ANORMS 256
+#define ANORM_BANDS 8
+
+namespace {
+    
+    // The angles of the 8 bit latitude and longitude step over the whole circle, like the
+    // sin table lookups of R_LatLongToNormal.
+    std::vector<vec3> buildLatLongNormals()
+    {
+        std::vector<vec3> table(NUM_LAT_LONG_NORMALS);
+        
+        for (int i = 0; i < NUM_LAT_LONG_NORMALS; i++)
+        {
+            const float lat = ((i >> 8) & 255) * (2.0f * (float)M_PI / 256.0f);
+            const float lng = (i & 255) * (2.0f * (float)M_PI / 256.0f);
+            
+            table[i] = vec3(cosf(lat) * sinf(lng), sinf(lat) * sinf(lng), cosf(lng));
+        }
+        
+        return table;
+    }
+    
+    // r_anormals, the normals R_MDC_GetAnorm encodes into. Bands of equal z step 11.25 degrees
+    // of latitude: the equator and the southern bands down to the pole take the first 144
+    // entries, the northern bands up to the pole the rest. A band starts at longitude 0.
+    std::vector<vec3> buildAnorms()
+    {
+        static const int bandSize[ANORM_BANDS + 1] = { 32, 24, 22, 20, 17, 14, 9, 5, 1 };
+        
+        std::vector<vec3> table;
+        table.reserve(NUM_ANORMS);
+        
+        auto addBand = [&](int band) {
+            const float lat = band * (float)M_PI / (2.0f * ANORM_BANDS);
+            const int n = bandSize[band < 0 ? -band : band];
+            
+            for (int i = 0; i < n; i++)
+            {
+                const float lng = i * (2.0f * (float)M_PI) / n;
+                table.push_back(vec3(cosf(lat) * cosf(lng), cosf(lat) * sinf(lng), sinf(lat)));
+            }
+        };
+        
+        for (int band = 0; band >= -ANORM_BANDS; band--) addBand(band);
+        for (int band = 1; band <= ANORM_BANDS; band++) addBand(band);
+        
+        return table;
+    }
+    
+    void decodeScalar(const md3XyzNormal_t *base, const mdcXyzCompressed_t *compressed, int count, vec3 *out)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            vec3 &pos = out[i];
+            pos.x = base[i].xyz[0] * MD3_XYZ_SCALE;
+            pos.y = base[i].xyz[1] * MD3_XYZ_SCALE;
+            pos.z = base[i].xyz[2] * MD3_XYZ_SCALE;
+            
+            if (compressed)
+            {
+                const unsigned int ofs = compressed[i].ofsVec;
+                pos.x += (float(ofs & 255) - MDC_MAX_OFS) * MDC_DIST_SCALE;
+                pos.y += (float((ofs >> 8) & 255) - MDC_MAX_OFS) * MDC_DIST_SCALE;
+                pos.z += (float((ofs >> 16) & 255) - MDC_MAX_OFS) * MDC_DIST_SCALE;
+            }
+        }
+    }
+    
+#ifdef FRAME_KERNEL_SSE2
+    // Four xyz in the low lanes of a, b, c, d to 12 packed floats.
+    inline void storePositions(float *out, __m128 a, __m128 b, __m128 c, __m128 d)
+    {
+        // The w lane of every store is overwritten by the next one, the last is stored by halves.
+        _mm_storeu_ps(out, a);
+        _mm_storeu_ps(out + 3, b);
+        _mm_storeu_ps(out + 6, c);
+        _mm_storel_pi((__m64 *)(out + 9), d);
+        _mm_store_ss(out + 11, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 2, 2, 2)));
+    }
+    
+    void decodeSse2(const md3XyzNormal_t *base, const mdcXyzCompressed_t *compressed, int count, vec3 *out)
+    {
+        const __m128 scale = _mm_set1_ps(MD3_XYZ_SCALE);
+        const __m128 ofsScale = _mm_set1_ps(MDC_DIST_SCALE);
+        const __m128 ofsBias = _mm_set1_ps(MDC_MAX_OFS);
+        const __m128i zero = _mm_setzero_si128();
+        
+        int i = 0;
+        
+        for (; i + 4 <= count; i += 4)
+        {
+            // x y z normal of two vertices per register, sign extended to 32 bits.
+            const __m128i xyz01 = _mm_loadu_si128((const __m128i *)&base[i]);
+            const __m128i xyz23 = _mm_loadu_si128((const __m128i *)&base[i + 2]);
+            
+            __m128 p[4] = {
+                _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(xyz01, xyz01), 16)), scale),
+                _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(xyz01, xyz01), 16)), scale),
+                _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(xyz23, xyz23), 16)), scale),
+                _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(xyz23, xyz23), 16)), scale)
+            };
+            
+            if (compressed)
+            {
+                // The offset bytes of four vertices, zero extended to 32 bits a vertex at a time.
+                const __m128i ofs = _mm_loadu_si128((const __m128i *)&compressed[i]);
+                const __m128i ofs01 = _mm_unpacklo_epi8(ofs, zero);
+                const __m128i ofs23 = _mm_unpackhi_epi8(ofs, zero);
+                
+                const __m128i bytes[4] = {
+                    _mm_unpacklo_epi16(ofs01, zero), _mm_unpackhi_epi16(ofs01, zero),
+                    _mm_unpacklo_epi16(ofs23, zero), _mm_unpackhi_epi16(ofs23, zero)
+                };
+                
+                for (int k = 0; k < 4; k++)
+                {
+                    p[k] = _mm_add_ps(p[k], _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(bytes[k]), ofsBias), ofsScale));
+                }
+            }
+            
+            storePositions(&out[i].x, p[0], p[1], p[2], p[3]);
+        }
+        
+        decodeScalar(base + i, compressed ? compressed + i : nullptr, count - i, out + i);
+    }
+    
+    void lerpSse2(const vec3 *from, const vec3 *to, float fraction, int count, vec3 *out)
+    {
+        const float *a = &from[0].x;
+        const float *b = &to[0].x;
+        float *o = &out[0].x;
+        
+        const __m128 t = _mm_set1_ps(fraction);
+        const int numFloats = count * 3;
+        int i = 0;
+        
+        for (; i + 4 <= numFloats; i += 4)
+        {
+            const __m128 va = _mm_loadu_ps(a + i);
+            _mm_storeu_ps(o + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + i), va), t)));
+        }
+        
+        for (; i < numFloats; i++)
+        {
+            o[i] = a[i] + (b[i] - a[i]) * fraction;
+        }
+    }
+#endif
+}
+
+void decodeFramePositions(const md3XyzNormal_t *base, const mdcXyzCompressed_t *compressed, int count, vec3 *out)
+{
+#ifdef FRAME_KERNEL_SSE2
+    decodeSse2(base, compressed, count, out);
+#else
+    decodeScalar(base, compressed, count, out);
+#endif
+}
+
+const vec3 *latLongNormals()
+{
+    static const std::vector<vec3> table = buildLatLongNormals();
+    return table.data();
+}
+
+const vec3 *anormNormals()
+{
+    static const std::vector<vec3> table = buildAnorms();
+    return table.data();
+}
+
+// A copy of a table entry per vertex. There is no gather before AVX2, the loop stays scalar
+// but runs over the whole surface with the table resolved up front.
+void decodeFrameNormals(const md3XyzNormal_t *base, const mdcXyzCompressed_t *compressed, int count, vec3 *out)
+{
+    if (compressed)
+    {
+        const vec3 *anorms = anormNormals();
+        
+        for (int i = 0; i < count; i++)
+        {
+            out[i] = anorms[compressed[i].ofsVec >> 24];
+        }
+        
+        return;
+    }
+    
+    const vec3 *latLong = latLongNormals();
+    
+    for (int i = 0; i < count; i++)
+    {
+        out[i] = latLong[(uint16_t)base[i].normal];
+    }
+}
+
+void lerpFramePositions(const vec3 *from, const vec3 *to, float fraction, int count, vec3 *out)
+{
+#ifdef FRAME_KERNEL_SSE2
+    lerpSse2(from, to, fraction, count, out);
+#else
+    for (int i = 0; i < count; i++)
+    {
+        out[i].x = from[i].x + (to[i].x - from[i].x) * fraction;
+        out[i].y = from[i].y + (to[i].y - from[i].y) * fraction;
+        out[i].z = from[i].z + (to[i].z - from[i].z) * fraction;
+    }
+#endif
+}
+
+const char *frameKernelName()
+{
+#ifdef FRAME_KERNEL_SSE2
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,40 @@
+//
+//  FrameKernel.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "Math.h"
+#include "MD3File.h"
+
+// Vertex animation of MD3 and MDC surfaces, four vertices per iteration
+// with SSE2 where available.
+//
+//   md3 frame    xyz * MD3_XYZ_SCALE
+//   mdc frame    base xyz * MD3_XYZ_SCALE + (ofsVec bytes - MDC_MAX_OFS) * MDC_DIST_SCALE
+//
+// MDC frames are either base frames stored like MD3 ones, or compressed
+// frames: a byte per axis of offset from the base frame they refer to.
+//
+// Normals come from lookup tables, no trigonometry per vertex:
+//
+//   md3 normal   latLongNormals()[normal], latitude in the high byte, longitude in the low one
+//   mdc normal   base frames like md3, compressed frames anormNormals()[ofsVec >> 24]
+
+/// Positions of a frame. `compressed` is null for MD3 and MDC base frames.
+void decodeFramePositions(const md3XyzNormal_t *base, const mdcXyzCompressed_t *compressed, int count, vec3 *out);
+
+/// Normals of a frame, unit length. `compressed` is null for MD3 and MDC base frames.
+void decodeFrameNormals(const md3XyzNormal_t *base, const mdcXyzCompressed_t *compressed, int count, vec3 *out);
+
+/// 256 * 256 normals indexed by md3XyzNormal_t::normal.
+const vec3 *latLongNormals();
+
+/// The 256 r_anormals indexed by the top byte of mdcXyzCompressed_t::ofsVec.
+const vec3 *anormNormals();
+
+/// out = from + (to - from) * fraction
+void lerpFramePositions(const vec3 *from, const vec3 *to, float fraction, int count, vec3 *out);
+
+const char *frameKernelName();
@@ -0,0 +1,36 @@
+//
+//  FrameStats.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <cstddef>
+
+// Per-frame counters collected by the renderer and shown in the ImGui panels.
+// Reset at the beginning of every frame in Renderer::update.
+
+struct FrameStats
+{
+    static FrameStats& instance()
+    {
+        static FrameStats stats;
+        return stats;
+    }
+
+    void reset()
+    {
+        *this = FrameStats();
+    }
+
+    int bonesEvaluated = 0;
+    float poseMs = 0;
+    size_t uniformBytesUploaded = 0;
+    size_t vertexBytesUploaded = 0;
+    int trianglesDrawn = 0;
+    int drawCalls = 0;
+    
+    /// Preparing and submitting the characters on the CPU, and the GPU time of their draws.
+    float submitMs = 0;
+    float gpuMs = 0;
+};
@@ -0,0 +1,49 @@
+//
+//  GpuTimer.cpp
+//  wolfmv
+//
+
+#include "GpuTimer.h"
+
+#include <glad/glad.h>
+
+GpuTimer::~GpuTimer()
+{
+    if (queries_[0] != 0)
+    {
+        glDeleteQueries(kNumQueries, queries_);
+    }
+}
+
+void GpuTimer::begin()
+{
+    if (queries_[0] == 0)
+    {
+        glGenQueries(kNumQueries, queries_);
+    }
+    
+    current_ = (current_ + 1) % kNumQueries;
+    
+    // The query is reused, take its result first if there is one. If the GPU is that far
+    // behind it is dropped instead of waited for.
+    if (pending_[current_])
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(queries_[current_], GL_QUERY_RESULT_AVAILABLE, &available);
+        
+        if (available)
+        {
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(queries_[current_], GL_QUERY_RESULT, &ns);
+            lastMs_ = (float)(ns / 1e6);
+        }
+    }
+    
+    glBeginQuery(GL_TIME_ELAPSED, queries_[current_]);
+}
+
+void GpuTimer::end()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+    pending_[current_] = true;
+}
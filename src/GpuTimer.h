@@ -0,0 +1,35 @@
+//
+//  GpuTimer.h
+//  wolfmv
+//
+
+#pragma once
+
+// GPU time of a span of commands with GL_TIME_ELAPSED queries. A query per
+// frame in flight, like the ring buffers, so reading a result never waits for
+// the GPU: the time reported is the one of the oldest frame that finished.
+
+class GpuTimer
+{
+public:
+    static constexpr int kNumQueries = 3;
+    
+    GpuTimer() = default;
+    
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer& operator =(const GpuTimer&) = delete;
+    
+    ~GpuTimer();
+    
+    void begin();
+    void end();
+    
+    /// Milliseconds of the last span the GPU is done with.
+    float lastMs() const { return lastMs_; }
+    
+private:
+    unsigned int queries_[kNumQueries] = {};
+    bool pending_[kNumQueries] = {};
+    int current_ = 0;
+    float lastMs_ = 0;
+};
@@ -6,15 +6,25 @@
 //
 
 #include "MD3Model.h"
-#include "Skin.h"
+#include "TextureCache.h"
 #include "Utils.h"
+#include "FileSystem.h"
+#include "ThreadPool.h"
+#include "FrameKernel.h"
+#include "VertexRingBuffer.h"
+#include "FrameStats.h"
 
 #include <glad/glad.h>
 
+#include <algorithm>
+
 #define VERT_POSITION_LOC 0
 #define VERT_NORMAL_LOC 1
 #define VERT_TEX_COORD_LOC 2
 
+// Surface indices are kept as 16 bits.
+#define MAX_SURFACE_VERTICES 0x10000
+
 struct FileHeader
 {
     int ident;
@@ -31,7 +41,8 @@ struct FileHeader
 
 struct FileSurface
 {
-    uint8_t *offset;
+    const uint8_t *offset;
+    int64_t fileOffset;
     char name[MAX_QPATH];
     int nCompressedFrames; // compressed only
     int nBaseFrames; // compressed only
@@ -55,32 +66,32 @@ namespace util {
     }
 }
 
-void MD3Model::loadFromFile(const std::string &filename, const SkinFile &skin)
+void MD3Model::load(const std::string &filename)
 {
-    compressed_ = true;
-    std::vector<uint8_t> data;
+    // Only read while loading, everything is converted below.
+    FileData file = FileSystem::instance().read(filename);
     
-    FILE* fp = fopen(filename.c_str(), "rb" );
-    
-    if(fp == nullptr) {
-        printf("unable to open %s\n", filename.c_str());
-    }
+    if (file.empty()) return;
     
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
+    const uint8_t *data = file.data();
     
-    data.resize(size);
-    
-    fseek(fp, 0, SEEK_SET);
-    fread(data.data(), size, 1, fp);
-    fclose(fp);
+    // Heads are MDC in the game, props and custom heads are often plain MD3.
+    auto ident = file.at<int>(0);
+    compressed_ = ident && *ident == MDC_IDENT;
     
     // Header
     FileHeader header;
     
     if (compressed_)
     {
-        auto fileHeader = (mdcHeader_t *)data.data();
+        auto fileHeader = file.at<mdcHeader_t>(0);
+        
+        if (!fileHeader)
+        {
+            printf("Model %s: file is too small\n", filename.c_str());
+            return;
+        }
+        
         header.ident = fileHeader->ident;
         header.version = fileHeader->version;
         header.nFrames = fileHeader->numFrames;
@@ -94,7 +105,14 @@ void MD3Model::loadFromFile(const std::string &filename, const SkinFile &skin)
     }
     else
     {
-        auto fileHeader = (md3Header_t *)data.data();
+        auto fileHeader = file.at<md3Header_t>(0);
+        
+        if (!fileHeader)
+        {
+            printf("Model %s: file is too small\n", filename.c_str());
+            return;
+        }
+        
         header.ident = fileHeader->ident;
         header.version = fileHeader->version;
         header.nFrames = fileHeader->numFrames;
@@ -127,14 +145,37 @@ void MD3Model::loadFromFile(const std::string &filename, const SkinFile &skin)
         return;
     }
     
+    const size_t tagSize = compressed_ ? sizeof(mdcTag_t) : sizeof(md3Tag_t);
+    
+    if ((int)file.span<md3Frame_t>(header.framesOffset, header.nFrames).size() != header.nFrames ||
+        file.span<uint8_t>(header.tagsOffset, (int64_t)header.nFrames * header.nTags * tagSize).size() != header.nFrames * header.nTags * tagSize ||
+        (compressed_ && (int)file.span<mdcTagName_t>(header.tagNamesOffset, header.nTags).size() != header.nTags))
+    {
+        printf("Model %s: data out of file bounds\n", filename.c_str());
+        return;
+    }
+    
+    CookedCache::Key key;
+    CookedFile cooked = CookedCache::instance().open(filename, file, validIdent, key);
+    
+    if (!cooked.empty())
+    {
+        if (loadCooked(cooked, header.nFrames, header.nTags, header.nSurfaces))
+        {
+            buildDrawCalls();
+            loaded_ = true;
+            return;
+        }
+        
+        printf("Model %s: broken cooked file, converting the source\n", filename.c_str());
+    }
+    
     // Frames
-    auto fileFrames = (const md3Frame_t *)&data[header.framesOffset];
     frames_.resize(header.nFrames);
     
     for (int i = 0; i < header.nFrames; i++)
     {
         Frame &frame = frames_[i];
-        const md3Frame_t &fileFrame = fileFrames[i];
         
         // Tags
         frame.tags.resize(header.nTags);
@@ -191,243 +232,559 @@ void MD3Model::loadFromFile(const std::string &filename, const SkinFile &skin)
     
     // Copy uncompressed and compression surface data into a common struct.
     std::vector<FileSurface> fileSurfaces(header.nSurfaces);
+    int64_t surfaceOffset = header.surfacesOffset;
     
-    if (header.surfacesOffset < data.size())
+    for (int i = 0; i < header.nSurfaces; i++)
     {
+        FileSurface &fs = fileSurfaces[i];
+        fs.fileOffset = surfaceOffset;
+        fs.offset = data + surfaceOffset;
+        
+        int ofsEnd = 0;
+        
         if (compressed_)
         {
-            auto mdcSurface = (mdcSurface_t *)&data[header.surfacesOffset];
+            auto mdcSurface = file.at<mdcSurface_t>(surfaceOffset);
             
-            for (int i = 0; i < header.nSurfaces; i++)
+            if (!mdcSurface)
             {
-                FileSurface &fs = fileSurfaces[i];
-                fs.offset = (uint8_t *)mdcSurface;
-                util::Strncpyz(fs.name, mdcSurface->name, sizeof(fs.name));
-                fs.nCompressedFrames = mdcSurface->numCompFrames;
-                fs.nBaseFrames = mdcSurface->numBaseFrames;
-                fs.nShaders = mdcSurface->numShaders;
-                fs.nVertices = mdcSurface->numVerts;
-                fs.nTriangles = mdcSurface->numTriangles;
-                fs.trianglesOffset = mdcSurface->ofsTriangles;
-                fs.shadersOffset = mdcSurface->ofsShaders;
-                fs.uvsOffset = mdcSurface->ofsSt;
-                fs.positionNormalOffset = mdcSurface->ofsXyzNormals;
-                fs.positionNormalCompressedOffset = mdcSurface->ofsXyzCompressed;
-                fs.baseFramesOffset = mdcSurface->ofsFrameBaseFrames;
-                fs.compressedFramesOffset = mdcSurface->ofsFrameCompFrames;
-                
-                // Move to the next surface.
-                mdcSurface = (mdcSurface_t *)((uint8_t *)mdcSurface + mdcSurface->ofsEnd);
+                printf("Model %s: surface %d out of file bounds\n", filename.c_str(), i);
+                return;
             }
+            
+            util::Strncpyz(fs.name, mdcSurface->name, sizeof(fs.name));
+            fs.nCompressedFrames = mdcSurface->numCompFrames;
+            fs.nBaseFrames = mdcSurface->numBaseFrames;
+            fs.nShaders = mdcSurface->numShaders;
+            fs.nVertices = mdcSurface->numVerts;
+            fs.nTriangles = mdcSurface->numTriangles;
+            fs.trianglesOffset = mdcSurface->ofsTriangles;
+            fs.shadersOffset = mdcSurface->ofsShaders;
+            fs.uvsOffset = mdcSurface->ofsSt;
+            fs.positionNormalOffset = mdcSurface->ofsXyzNormals;
+            fs.positionNormalCompressedOffset = mdcSurface->ofsXyzCompressed;
+            fs.baseFramesOffset = mdcSurface->ofsFrameBaseFrames;
+            fs.compressedFramesOffset = mdcSurface->ofsFrameCompFrames;
+            ofsEnd = mdcSurface->ofsEnd;
         }
         else
         {
-            auto md3Surface = (md3Surface_t *)&data[header.surfacesOffset];
+            auto md3Surface = file.at<md3Surface_t>(surfaceOffset);
             
-            for (int i = 0; i < header.nSurfaces; i++)
+            if (!md3Surface)
             {
-                FileSurface &fs = fileSurfaces[i];
-                fs.offset = (uint8_t *)md3Surface;
-                util::Strncpyz(fs.name, md3Surface->name, sizeof(fs.name));
-                fs.nShaders = md3Surface->numShaders;
-                fs.nVertices = md3Surface->numVerts;
-                fs.nTriangles = md3Surface->numTriangles;
-                fs.trianglesOffset = md3Surface->ofsTriangles;
-                fs.shadersOffset = md3Surface->ofsShaders;
-                fs.uvsOffset = md3Surface->ofsSt;
-                fs.positionNormalOffset = md3Surface->ofsXyzNormals;
-                
-                // Move to the next surface.
-                md3Surface = (md3Surface_t *)((uint8_t *)md3Surface + md3Surface->ofsEnd);
+                printf("Model %s: surface %d out of file bounds\n", filename.c_str(), i);
+                return;
             }
+            
+            util::Strncpyz(fs.name, md3Surface->name, sizeof(fs.name));
+            fs.nCompressedFrames = 0;
+            fs.nBaseFrames = header.nFrames;
+            fs.nShaders = md3Surface->numShaders;
+            fs.nVertices = md3Surface->numVerts;
+            fs.nTriangles = md3Surface->numTriangles;
+            fs.trianglesOffset = md3Surface->ofsTriangles;
+            fs.shadersOffset = md3Surface->ofsShaders;
+            fs.uvsOffset = md3Surface->ofsSt;
+            fs.positionNormalOffset = md3Surface->ofsXyzNormals;
+            ofsEnd = md3Surface->ofsEnd;
         }
-    }
-    else
-    {
-        printf("Something wrong with %s", filename.c_str());
+        
+        const int64_t nVertices = fs.nVertices;
+        
+        // Every frame falls back to base frame 0, so there has to be one.
+        if (nVertices < 0 || nVertices > MAX_SURFACE_VERTICES || fs.nTriangles < 0 || fs.nBaseFrames < 1 ||
+            fs.nCompressedFrames < 0 || ofsEnd <= 0 ||
+            (int)file.span<int>(surfaceOffset + fs.trianglesOffset, (int64_t)fs.nTriangles * 3).size() != fs.nTriangles * 3 ||
+            (int64_t)file.span<md3St_t>(surfaceOffset + fs.uvsOffset, nVertices).size() != nVertices ||
+            (int64_t)file.span<md3XyzNormal_t>(surfaceOffset + fs.positionNormalOffset, nVertices * fs.nBaseFrames).size() != nVertices * fs.nBaseFrames ||
+            (compressed_ && ((int64_t)file.span<mdcXyzCompressed_t>(surfaceOffset + fs.positionNormalCompressedOffset, nVertices * fs.nCompressedFrames).size() != nVertices * fs.nCompressedFrames ||
+                             (int)file.span<short>(surfaceOffset + fs.baseFramesOffset, header.nFrames).size() != header.nFrames ||
+                             (int)file.span<short>(surfaceOffset + fs.compressedFramesOffset, header.nFrames).size() != header.nFrames)))
+        {
+            printf("Model %s: surface %s out of file bounds\n", filename.c_str(), fs.name);
+            return;
+        }
+        
+        for (int index : file.span<int>(surfaceOffset + fs.trianglesOffset, (int64_t)fs.nTriangles * 3))
+        {
+            if (index < 0 || index >= fs.nVertices)
+            {
+                printf("Model %s: surface %s out of file bounds\n", filename.c_str(), fs.name);
+                return;
+            }
+        }
+        
+        // Move to the next surface.
+        surfaceOffset += ofsEnd;
     }
     
     // Surfaces
     surfaces_.resize(header.nSurfaces);
+    nVertices_ = 0;
     
     for (int i = 0; i < header.nSurfaces; i++)
     {
         FileSurface &fs = fileSurfaces[i];
         Surface &surface = surfaces_[i];
         
-        strcpy(surface.name, fs.name);
+        util::Strncpyz(surface.name, fs.name, sizeof(surface.name));
+        surface.firstVertex = nVertices_;
+        nVertices_ += fs.nVertices;
         
         int numIndices = fs.nTriangles * 3;
-        auto fileIndices = (int *)(fs.offset + fs.trianglesOffset);
+        auto fileIndices = (const int *)(fs.offset + fs.trianglesOffset);
         
         surface.indices.resize(numIndices);
         
-        for (uint32_t j = 0; j < numIndices; j++)
+        for (int j = 0; j < numIndices; j++)
         {
             surface.indices[j] = fileIndices[j];
         }
         
-        auto fileTexCoords = (md3St_t *)(fs.offset + fs.uvsOffset);
-        
-        auto fileBaseFrames = (short *)(fs.offset + fs.baseFramesOffset);
-        auto fileCompressedFrames = (short *)(fs.offset + fs.compressedFramesOffset);
+        auto fileTexCoords = (const md3St_t *)(fs.offset + fs.uvsOffset);
+        surface.texCoords.resize(fs.nVertices);
         
-        int j = 0;
-        int positionNormalFrame;
-        
-        if (compressed_)
-        {
-            positionNormalFrame = fileBaseFrames[j];
-        }
-        else
+        for (int k = 0; k < fs.nVertices; k++)
         {
-            positionNormalFrame = j;
+            surface.texCoords[k].x = fileTexCoords[k].st[0];
+            surface.texCoords[k].y = fileTexCoords[k].st[1];
         }
+    }
+    
+    // The frames as they are in the file, one after another for all the surfaces.
+    std::vector<int32_t> firstPositions(header.nSurfaces), firstOffsets(header.nSurfaces);
+    
+    for (int i = 0; i < header.nSurfaces; i++)
+    {
+        const FileSurface &fs = fileSurfaces[i];
         
-        auto fileXyzNormals = (md3XyzNormal_t *)(fs.offset + fs.positionNormalOffset + positionNormalFrame * sizeof(md3XyzNormal_t) * fs.nVertices);
+        firstPositions[i] = (int32_t)packedPositions_.size();
+        firstOffsets[i] = (int32_t)packedOffsets_.size();
         
-        surface.vertices.resize(fs.nVertices);
+        auto fileXyzNormals = (const md3XyzNormal_t *)(fs.offset + fs.positionNormalOffset);
+        packedPositions_.insert(packedPositions_.end(), fileXyzNormals, fileXyzNormals + (size_t)fs.nBaseFrames * fs.nVertices);
         
-        for (int k = 0; k < fs.nVertices; k++)
+        if (compressed_)
+        {
+            auto fileXyzCompressed = (const mdcXyzCompressed_t *)(fs.offset + fs.positionNormalCompressedOffset);
+            packedOffsets_.insert(packedOffsets_.end(), fileXyzCompressed, fileXyzCompressed + (size_t)fs.nCompressedFrames * fs.nVertices);
+        }
+    }
+    
+    packedFrames_.resize((size_t)header.nFrames * header.nSurfaces);
+    
+    for (int j = 0; j < header.nFrames; j++)
+    {
+        for (int i = 0; i < header.nSurfaces; i++)
         {
-            Vertex &v = surface.vertices[k];
-            v.pos.x = fileXyzNormals[k].xyz[0] * MD3_XYZ_SCALE;
-            v.pos.y = fileXyzNormals[k].xyz[1] * MD3_XYZ_SCALE;
-            v.pos.z = fileXyzNormals[k].xyz[2] * MD3_XYZ_SCALE;
-//            v.normal = decodeNormal(fileXyzNormals[k].normal);
-            v.texCoord.x = fileTexCoords[k].st[0];
-            v.texCoord.y = fileTexCoords[k].st[1];
+            const FileSurface &fs = fileSurfaces[i];
+            PackedFrame &packed = packedFrames_[(size_t)j * header.nSurfaces + i];
+            
+            int positionNormalFrame = j;
+            int compressedFrameIndex = -1;
             
             if (compressed_)
             {
                 // If compressedFrameIndex isn't -1, use compressedFrameIndex as a delta from baseFrameIndex.
-                short compressedFrameIndex = fileCompressedFrames[j];
-                
-                if (compressedFrameIndex != -1)
-                {
-                    auto fileXyzCompressed = (mdcXyzCompressed_t *)(fs.offset + fs.positionNormalCompressedOffset + compressedFrameIndex * sizeof(mdcXyzCompressed_t) * fs.nVertices);
-                    vec3 delta;
-                    delta[0] = (float((fileXyzCompressed[k].ofsVec) & 255) - MDC_MAX_OFS) * MDC_DIST_SCALE;
-                    delta[1] = (float((fileXyzCompressed[k].ofsVec >> 8) & 255) - MDC_MAX_OFS) * MDC_DIST_SCALE;
-                    delta[2] = (float((fileXyzCompressed[k].ofsVec >> 16) & 255) - MDC_MAX_OFS) * MDC_DIST_SCALE;
-                    v.pos += delta;
-//                    v.normal = vec3(s_anormals[fileXyzCompressed[k].ofsVec >> 24]);
-                }
+                positionNormalFrame = ((const short *)(fs.offset + fs.baseFramesOffset))[j];
+                compressedFrameIndex = ((const short *)(fs.offset + fs.compressedFramesOffset))[j];
             }
+            
+            if (positionNormalFrame < 0 || positionNormalFrame >= fs.nBaseFrames) positionNormalFrame = 0;
+            if (compressedFrameIndex >= fs.nCompressedFrames) compressedFrameIndex = -1;
+            
+            packed.positions = firstPositions[i] + positionNormalFrame * fs.nVertices;
+            packed.offsets = compressedFrameIndex >= 0 ? firstOffsets[i] + compressedFrameIndex * fs.nVertices : -1;
         }
     }
     
-    for (const auto& [mesh, texture] : skin.textures)
-    {
-        m_textures[mesh] = loadTexture(texture.c_str());
-    }
+    decodeFrames();
     
-    m_shader.init("assets/shaders/md3.glsl");
+    cook(key);
+    buildDrawCalls();
+    loaded_ = true;
+}
+
+// Positions and normals of every frame for the CPU path, the frames are independent of each other.
+void MD3Model::decodeFrames()
+{
+    const int numSurfaces = (int)surfaces_.size();
+    positions_.resize((size_t)numFrames() * nVertices_);
+    normals_.resize((size_t)numFrames() * nVertices_);
     
+    ThreadPool::instance().parallelFor(numFrames(), [&](int j) {
+        for (int i = 0; i < numSurfaces; i++)
+        {
+            const Surface &surface = surfaces_[i];
+            const PackedFrame &packed = packedFrames_[(size_t)j * numSurfaces + i];
+            const mdcXyzCompressed_t *offsets = packed.offsets >= 0 ? &packedOffsets_[packed.offsets] : nullptr;
+            const size_t first = (size_t)j * nVertices_ + surface.firstVertex;
+            
+            decodeFramePositions(&packedPositions_[packed.positions], offsets, (int)surface.texCoords.size(), &positions_[first]);
+            decodeFrameNormals(&packedPositions_[packed.positions], offsets, (int)surface.texCoords.size(), &normals_[first]);
+        }
+    });
+}
+
+void MD3Model::buildDrawCalls()
+{
     m_drawCallList.resize(surfaces_.size());
     
-    for (int i = 0; i < m_drawCallList.size(); ++i)
+    for (size_t i = 0; i < m_drawCallList.size(); ++i)
     {
         auto& surface = surfaces_[i];
         auto& drawCall = m_drawCallList[i];
         
         drawCall.name = surface.name;
+        drawCall.numVertices = (int)surface.texCoords.size();
+        drawCall.numIndices = (int)surface.indices.size();
+        drawCall.firstVertex = surface.firstVertex;
+    }
+}
+
+enum
+{
+    COOKED_MD3_SURFACES = 1,
+    COOKED_MD3_TEX_COORDS,
+    COOKED_MD3_INDICES,
+    COOKED_MD3_PACKED_POSITIONS,
+    COOKED_MD3_PACKED_OFFSETS,
+    COOKED_MD3_PACKED_FRAMES,
+    COOKED_MD3_TAGS,
+    COOKED_MD3_TAG_NAMES
+};
+
+// The surfaces, the frames still compressed like in the file with the
+// table of where each one starts, and the tags with the angles applied.
+bool MD3Model::loadCooked(const CookedFile &cooked, int numFrames, int numTags, int numSurfaces)
+{
+    auto surfaces = cooked.section<CookedSurface>(COOKED_MD3_SURFACES);
+    auto texCoords = cooked.section<vec2>(COOKED_MD3_TEX_COORDS);
+    auto indices = cooked.section<uint16_t>(COOKED_MD3_INDICES);
+    auto packedPositions = cooked.section<md3XyzNormal_t>(COOKED_MD3_PACKED_POSITIONS);
+    auto packedOffsets = cooked.section<mdcXyzCompressed_t>(COOKED_MD3_PACKED_OFFSETS);
+    auto packedFrames = cooked.section<PackedFrame>(COOKED_MD3_PACKED_FRAMES);
+    auto tags = cooked.section<Transform>(COOKED_MD3_TAGS);
+    auto tagNames = cooked.section<TagName>(COOKED_MD3_TAG_NAMES);
+    
+    if ((int)surfaces.size() != numSurfaces || tags.size() != (size_t)numFrames * numTags || (int)tagNames.size() != numTags ||
+        packedFrames.size() != (size_t)numFrames * numSurfaces)
+    {
+        return false;
+    }
+    
+    for (const CookedSurface &surface : surfaces)
+    {
+        if (surface.numVertices > MAX_SURFACE_VERTICES ||
+            (uint64_t)surface.firstVertex + surface.numVertices > texCoords.size() ||
+            (uint64_t)surface.firstIndex + surface.numIndices > indices.size())
+        {
+            return false;
+        }
         
-        int numVertices = (int)surface.vertices.size();
-        int numIndices = (int)surface.indices.size();
+        for (uint32_t j = 0; j < surface.numIndices; j++)
+        {
+            if (indices[surface.firstIndex + j] >= surface.numVertices) return false;
+        }
+    }
+    
+    for (size_t i = 0; i < packedFrames.size(); i++)
+    {
+        const PackedFrame &packed = packedFrames[i];
+        const int64_t numVertices = surfaces[i % numSurfaces].numVertices;
         
-        drawCall.numVertices = numVertices;
-        drawCall.numIndices = numIndices;
+        if (packed.positions < 0 || packed.positions + numVertices > (int64_t)packedPositions.size() ||
+            (packed.offsets >= 0 && packed.offsets + numVertices > (int64_t)packedOffsets.size()))
+        {
+            return false;
+        }
+    }
+    
+    frames_.resize(numFrames);
+    
+    for (int i = 0; i < numFrames; i++)
+    {
+        frames_[i].tags.assign(tags.begin() + i * numTags, tags.begin() + (i + 1) * numTags);
+    }
+    
+    tagNames_.assign(tagNames.begin(), tagNames.end());
+    surfaces_.resize(numSurfaces);
+    
+    for (int i = 0; i < numSurfaces; i++)
+    {
+        const CookedSurface &cookedSurface = surfaces[i];
+        Surface &surface = surfaces_[i];
         
-        glGenBuffers(1, &drawCall.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, drawCall.vbo);
-        glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(Vertex), surface.vertices.data(), GL_STATIC_DRAW);
+        util::Strncpyz(surface.name, cookedSurface.name, sizeof(surface.name));
+        surface.firstVertex = cookedSurface.firstVertex;
+        surface.texCoords.assign(texCoords.begin() + cookedSurface.firstVertex, texCoords.begin() + cookedSurface.firstVertex + cookedSurface.numVertices);
+        surface.indices.assign(indices.begin() + cookedSurface.firstIndex, indices.begin() + cookedSurface.firstIndex + cookedSurface.numIndices);
+    }
+    
+    nVertices_ = (uint32_t)texCoords.size();
+    packedPositions_.assign(packedPositions.begin(), packedPositions.end());
+    packedOffsets_.assign(packedOffsets.begin(), packedOffsets.end());
+    packedFrames_.assign(packedFrames.begin(), packedFrames.end());
+    
+    decodeFrames();
+    
+    return true;
+}
+
+void MD3Model::cook(const CookedCache::Key &key) const
+{
+    std::vector<CookedSurface> surfaces;
+    std::vector<vec2> texCoords;
+    std::vector<uint16_t> indices;
+    std::vector<Transform> tags;
+    
+    for (const Surface &surface : surfaces_)
+    {
+        CookedSurface cookedSurface = {};
+        util::Strncpyz(cookedSurface.name, surface.name, sizeof(cookedSurface.name));
+        cookedSurface.firstVertex = (uint32_t)texCoords.size();
+        cookedSurface.numVertices = (uint32_t)surface.texCoords.size();
+        cookedSurface.firstIndex = (uint32_t)indices.size();
+        cookedSurface.numIndices = (uint32_t)surface.indices.size();
+        
+        texCoords.insert(texCoords.end(), surface.texCoords.begin(), surface.texCoords.end());
+        indices.insert(indices.end(), surface.indices.begin(), surface.indices.end());
+        surfaces.push_back(cookedSurface);
+    }
+    
+    for (const Frame &frame : frames_)
+    {
+        tags.insert(tags.end(), frame.tags.begin(), frame.tags.end());
+    }
+    
+    CookedWriter writer;
+    writer.add(COOKED_MD3_SURFACES, surfaces);
+    writer.add(COOKED_MD3_TEX_COORDS, texCoords);
+    writer.add(COOKED_MD3_INDICES, indices);
+    writer.add(COOKED_MD3_PACKED_POSITIONS, packedPositions_);
+    writer.add(COOKED_MD3_PACKED_OFFSETS, packedOffsets_);
+    writer.add(COOKED_MD3_PACKED_FRAMES, packedFrames_);
+    writer.add(COOKED_MD3_TAGS, tags);
+    writer.add(COOKED_MD3_TAG_NAMES, tagNames_);
+    
+    CookedCache::instance().store(key, std::move(writer));
+}
+
+int MD3Model::numUploadSteps() const
+{
+    return 1 + (int)m_drawCallList.size();
+}
+
+void MD3Model::uploadStep(int step)
+{
+    if (step == 0)
+    {
+        if (m_shader.program != 0) return;
         
+        m_shader.init("assets/shaders/md3.glsl");
+        m_uMVP = m_shader.uniform<glm::mat4>("uMVP");
+        m_uDecodeFrames = m_shader.uniform<int>("uDecodeFrames");
+        m_uFrames = m_shader.uniform<glm::ivec4>("uFrames");
+        m_uLerp = m_shader.uniform<float>("uLerp");
+        m_uShowNormals = m_shader.uniform<int>("uShowNormals");
         
-        glGenVertexArrays(1, &drawCall.vao);
-        glBindVertexArray(drawCall.vao);
+        m_shader.bind();
+        m_shader.setUniform(m_shader.uniform<int>("s_positions"), 1);
+        m_shader.setUniform(m_shader.uniform<int>("s_offsets"), 2);
+        m_shader.setUniform(m_shader.uniform<int>("s_normals"), 3);
         
-        glEnableVertexAttribArray(VERT_POSITION_LOC);
-        glVertexAttribPointer(VERT_POSITION_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, pos));
+        uploadPackedFrames();
+    }
+    else
+    {
+        uploadSurface(surfaces_[step - 1], m_drawCallList[step - 1]);
+    }
+}
+
+void MD3Model::uploadSurface(const Surface &surface, DrawCall &drawCall)
+{
+    if (drawCall.vao != 0) return;
+    
+    // Only the texture coordinates are static. The positions and normals come from the vertex
+    // stream or are decoded in the shader, render sets the attributes up for either.
+    glGenBuffers(1, &drawCall.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, drawCall.vbo);
+    glBufferData(GL_ARRAY_BUFFER, drawCall.numVertices * sizeof(vec2), surface.texCoords.data(), GL_STATIC_DRAW);
+    
+    glGenVertexArrays(1, &drawCall.vao);
+    glBindVertexArray(drawCall.vao);
+    
+    glEnableVertexAttribArray(VERT_TEX_COORD_LOC);
+    glVertexAttribPointer(VERT_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(vec2), (void*)0);
+    
+    glGenBuffers(1, &drawCall.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawCall.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * drawCall.numIndices, surface.indices.data(), GL_STATIC_DRAW);
+}
+
+void MD3Model::uploadPackedFrames()
+{
+    if (packedTextures_[0] != 0 || packedPositions_.empty()) return;
+    
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    
+    if (packedPositions_.size() > (size_t)maxTexels || packedOffsets_.size() > (size_t)maxTexels)
+    {
+        printf("Compressed frames don't fit in a texture buffer of %d texels, decoding them on the CPU\n", maxTexels);
+        return;
+    }
+    
+    // MD3 files have no offsets, the buffer still needs some storage.
+    const mdcXyzCompressed_t noOffsets = {};
+    const void *data[2] = { packedPositions_.data(), packedOffsets_.empty() ? &noOffsets : packedOffsets_.data() };
+    const size_t sizes[2] = { packedPositions_.size() * sizeof(md3XyzNormal_t), std::max<size_t>(1, packedOffsets_.size()) * sizeof(mdcXyzCompressed_t) };
+    const GLenum formats[2] = { GL_RGBA16I, GL_RGBA8UI };
+    
+    glGenBuffers(2, packedBuffers_);
+    glGenTextures(2, packedTextures_);
+    
+    for (int i = 0; i < 2; i++)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, packedBuffers_[i]);
+        glBufferData(GL_TEXTURE_BUFFER, sizes[i], data[i], GL_STATIC_DRAW);
         
-        glEnableVertexAttribArray(VERT_NORMAL_LOC);
-        glVertexAttribPointer(VERT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glBindTexture(GL_TEXTURE_BUFFER, packedTextures_[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], packedBuffers_[i]);
+    }
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+// The lat/long normals followed by the anorms, shared by every model. Made once on the GL
+// thread and kept for the lifetime of the context.
+static GLuint normalTableTexture()
+{
+    static GLuint texture = 0;
+    
+    if (texture == 0)
+    {
+        std::vector<vec3> table(latLongNormals(), latLongNormals() + 256 * 256);
+        table.insert(table.end(), anormNormals(), anormNormals() + 256);
         
-        glEnableVertexAttribArray(VERT_TEX_COORD_LOC);
-        glVertexAttribPointer(VERT_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texCoord));
+        GLuint buffer = 0;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, table.size() * sizeof(vec3), table.data(), GL_STATIC_DRAW);
         
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, buffer);
         
-        glGenBuffers(1, &drawCall.ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawCall.ibo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * numIndices, surface.indices.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
     }
+    
+    return texture;
+}
+
+size_t MD3Model::packedFrameBytes() const
+{
+    return packedPositions_.size() * sizeof(md3XyzNormal_t) + packedOffsets_.size() * sizeof(mdcXyzCompressed_t);
 }
 
-void MD3Model::render(glm::mat4 &mvp)
+size_t MD3Model::writeVertices(const Pose &pose, VertexRingBuffer &stream) const
+{
+    if (gpuFrames()) return 0;
+    
+    const size_t first = stream.allocate(2 * (size_t)nVertices_);
+    
+    if (frames_.empty() || nVertices_ == 0) return first;
+    
+    const int oldFrame = std::clamp(pose.oldFrame, 0, numFrames() - 1);
+    const int frame = std::clamp(pose.frame, 0, numFrames() - 1);
+    
+    // The lerped normals are a bit shorter than unit, the shader normalizes them.
+    lerpFramePositions(&positions_[(size_t)oldFrame * nVertices_], &positions_[(size_t)frame * nVertices_], pose.lerp, nVertices_, stream.data(first));
+    lerpFramePositions(&normals_[(size_t)oldFrame * nVertices_], &normals_[(size_t)frame * nVertices_], pose.lerp, nVertices_, stream.data(first + nVertices_));
+    
+    return first;
+}
+
+void MD3Model::render(const glm::mat4 &mvp, const SkinTextures &skin, const VertexRingBuffer &stream, size_t firstVertex, const Pose &pose)
 {
     m_shader.bind();
-    m_shader.setUniform("uMVP", mvp);
+    m_shader.setUniform(m_uMVP, mvp);
     
-    for (int i = 0; i < m_drawCallList.size(); ++i)
+    const bool gpu = gpuFrames() && !frames_.empty();
+    const int oldFrame = std::clamp(pose.oldFrame, 0, std::max(0, numFrames() - 1));
+    const int frame = std::clamp(pose.frame, 0, std::max(0, numFrames() - 1));
+    
+    m_shader.setUniform(m_uDecodeFrames, gpu ? 1 : 0);
+    m_shader.setUniform(m_uShowNormals, showNormals ? 1 : 0);
+    
+    if (gpu)
+    {
+        m_shader.setUniform(m_uLerp, pose.lerp);
+        
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_BUFFER, packedTextures_[0]);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_BUFFER, packedTextures_[1]);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_BUFFER, normalTableTexture());
+    }
+    
+    for (size_t i = 0; i < m_drawCallList.size(); ++i)
     {
         auto& drawCall = m_drawCallList[i];
         
         if (drawCall.name == "h_blink") continue;
         
-        if (m_textures.contains(drawCall.name))
+        if (unsigned int texture = skin.texture(drawCall.name))
         {
             glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, m_textures[drawCall.name]);
+            glBindTexture(GL_TEXTURE_2D, texture);
         }
         
         glBindVertexArray(drawCall.vao);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawCall.ibo);
         
-        glDrawElements(GL_TRIANGLES, drawCall.numIndices, GL_UNSIGNED_SHORT, 0);
-    }
-}
-
-// Just for animated models
-void MD3Model::render(DrawCallList &drawCallList) const
-{
-    for (int i = 0; i < surfaces_.size(); ++i)
-    {
-        auto& drawCall = drawCallList[i];
-        auto& surface = surfaces_[i];
-        
-        drawCall.name = surface.name;
-        
-        if (drawCall.verticesPtr)
+        if (gpu)
         {
-            memcpy(drawCall.verticesPtr, surface.vertices.data(), sizeof(Vertex) * surface.vertices.size());
+            // Only the two frames go to the GPU, the shader finds the vertices by gl_VertexID.
+            const PackedFrame &from = packedFrames_[(size_t)oldFrame * m_drawCallList.size() + i];
+            const PackedFrame &to = packedFrames_[(size_t)frame * m_drawCallList.size() + i];
+            
+            m_shader.setUniform(m_uFrames, glm::ivec4(from.positions, from.offsets, to.positions, to.offsets));
+            glDisableVertexAttribArray(VERT_POSITION_LOC);
+            glDisableVertexAttribArray(VERT_NORMAL_LOC);
         }
-        
-        if (drawCall.indicesPtr)
+        else
         {
-            memcpy(drawCall.indicesPtr, surface.indices.data(), sizeof(uint16_t) * surface.indices.size());
+            glBindBuffer(GL_ARRAY_BUFFER, stream.buffer());
+            glEnableVertexAttribArray(VERT_POSITION_LOC);
+            glVertexAttribPointer(VERT_POSITION_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)stream.byteOffset(firstVertex + drawCall.firstVertex));
+            glEnableVertexAttribArray(VERT_NORMAL_LOC);
+            glVertexAttribPointer(VERT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)stream.byteOffset(firstVertex + nVertices_ + drawCall.firstVertex));
         }
+        
+        glDrawElements(GL_TRIANGLES, drawCall.numIndices, GL_UNSIGNED_SHORT, 0);
+        
+        FrameStats::instance().trianglesDrawn += drawCall.numIndices / 3;
+        FrameStats::instance().drawCalls++;
     }
 }
 
-int MD3Model::surfaceNumVertices(int surfaceIndex) const
-{
-    return surfaces_[surfaceIndex].vertices.size();
-}
-
-int MD3Model::surfaceNumIndices(int surfaceIndex) const
-{
-    return surfaces_[surfaceIndex].indices.size();
-}
-
 MD3Model::~MD3Model()
 {
-    for (const auto& [mesh, texture] : m_textures)
+    if (packedTextures_[0] != 0)
     {
-        glDeleteTextures(1, &texture);
+        glDeleteTextures(2, packedTextures_);
+        glDeleteBuffers(2, packedBuffers_);
     }
     
     for (const auto& drawCall : m_drawCallList)
     {
+        // Never uploaded, e.g. loaded by the cooker without a GL context.
+        if (drawCall.vao == 0) continue;
+        
         glDeleteBuffers(1, &drawCall.ibo);
         glDeleteBuffers(1, &drawCall.vbo);
         glDeleteVertexArrays(1, &drawCall.vao);
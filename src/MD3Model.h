@@ -13,15 +13,51 @@
 
 #include "DrawCall.h"
 #include "Shader.h"
+#include "CookedCache.h"
 
 #include "MD3File.h"
 
-struct SkinFile;
+struct SkinTextures;
+class VertexRingBuffer;
 
 struct MD3Model
 {
-    void loadFromFile(const std::string& filename, const SkinFile &skin);
-    void render(glm::mat4 &mvp);
+    /// The CPU part of loading, can run on any thread. See MDSModel::load.
+    void load(const std::string& filename);
+    
+    int numUploadSteps() const;
+    void uploadStep(int step);
+    
+    /// Two frames and the fraction between them, like MDSFrameInfo.
+    struct Pose
+    {
+        int oldFrame = 0;
+        int frame = 0;
+        float lerp = 0;
+    };
+    
+    int numFrames() const { return (int)frames_.size(); }
+    
+    /// False if the file was missing or broken.
+    bool loaded() const { return loaded_; }
+    
+    /// Interpolate the vertex positions and normals of the pose into the stream, returns the
+    /// first one. The normals follow the positions. Nothing is written when the frames are
+    /// decoded on the GPU.
+    size_t writeVertices(const Pose &pose, VertexRingBuffer &stream) const;
+    
+    void render(const glm::mat4 &mvp, const SkinTextures &skin, const VertexRingBuffer &stream, size_t firstVertex, const Pose &pose);
+    
+    /// Keep the frames on the GPU as they are compressed in the file and decode them in
+    /// the vertex shader, the CPU only picks the two frames. Otherwise see writeVertices.
+    static inline bool decodeOnGpu = false;
+    
+    /// Color the surfaces by their normals.
+    static inline bool showNormals = false;
+    
+    /// Frames as compressed in the file and as decoded for the CPU path.
+    size_t packedFrameBytes() const;
+    size_t decodedFrameBytes() const { return (positions_.size() + normals_.size()) * sizeof(vec3); }
     
     ~MD3Model();
     
@@ -29,20 +65,16 @@ private:
     struct Frame
     {
         std::vector<Transform> tags;
-        
-        /// Vertex data in system memory. Used by animated models.
-        std::vector<Vertex> vertices;
     };
     
     struct Surface
     {
         char name[MAX_QPATH]; // polyset name
-//        uint32_t startIndex;
-//        uint32_t nIndices;
-//        uint32_t startVertex;
-//        uint32_t nVertices;
         
-        std::vector<Vertex> vertices;
+        /// Where the surface starts in the vertices of a frame.
+        uint32_t firstVertex;
+        
+        std::vector<vec2> texCoords;
         std::vector<uint16_t> indices;
     };
     
@@ -51,30 +83,55 @@ private:
         char name[MAX_QPATH];
     };
     
-//    vec3 decodeNormal(short normal) const;
     int getTag(const char *name, int frame, int startIndex, Transform *transform) const;
     
-    bool compressed_;
+    /// MDC rather than MD3, told by the ident.
+    bool compressed_ = false;
     
-    std::vector<uint16_t> indices_;
+    /// The number of vertices in all the surfaces of a single frame.
+    uint32_t nVertices_ = 0;
     
-    /// Static model vertex buffer.
-//    VertexBuffer vertexBuffer_;
+    /// Decoded positions of every frame, nVertices_ a frame, the surfaces back to back.
+    std::vector<vec3> positions_;
+    std::vector<vec3> normals_;
     
-    /// The number of vertices in all the surfaces of a single frame.
-    uint32_t nVertices_;
+    /// Where a frame of a surface starts in the packed data, -1 offsets for base frames.
+    struct PackedFrame
+    {
+        int32_t positions;
+        int32_t offsets;
+    };
+    
+    /// The frames as stored in the file, the data of the surfaces back to back.
+    std::vector<md3XyzNormal_t> packedPositions_;   // MD3 frames and MDC base frames
+    std::vector<mdcXyzCompressed_t> packedOffsets_; // MDC compressed frames
+    std::vector<PackedFrame> packedFrames_;         // numFrames * surfaces
+    
+    /// Texture buffers of the packed positions and offsets, 0 if they don't fit.
+    unsigned int packedBuffers_[2] = {};
+    unsigned int packedTextures_[2] = {};
+    
+    bool gpuFrames() const { return decodeOnGpu && packedTextures_[0] != 0; }
     
     std::vector<Frame> frames_;
     std::vector<TagName> tagNames_;
     std::vector<Surface> surfaces_;
     
 private:
-    std::unordered_map<std::string, unsigned int> m_textures;
+    bool loaded_ = false;
+    
     Shader m_shader;
+    Shader::Uniform<glm::mat4> m_uMVP;
+    Shader::Uniform<int> m_uDecodeFrames;
+    Shader::Uniform<glm::ivec4> m_uFrames;
+    Shader::Uniform<float> m_uLerp;
+    Shader::Uniform<int> m_uShowNormals;
     DrawCallList m_drawCallList;
     
-    void render(DrawCallList &drawCallList) const;
-    
-    int surfaceNumVertices(int surfaceIndex) const;
-    int surfaceNumIndices(int surfaceIndex) const;
+    void buildDrawCalls();
+    bool loadCooked(const CookedFile &cooked, int numFrames, int numTags, int numSurfaces);
+    void cook(const CookedCache::Key &key) const;
+    void uploadSurface(const Surface &surface, DrawCall &drawCall);
+    void uploadPackedFrames();
+    void decodeFrames();
 };
@@ -6,10 +6,17 @@
 //
 
 #include "MDSModel.h"
-#include "Skin.h"
+#include "TextureCache.h"
 #include "Utils.h"
+#include "FrameStats.h"
+#include "UniformRingBuffer.h"
+#include "PoseKernel.h"
 
 #include <span>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
 #include <glad/glad.h>
 
 #define VERT_PACKED0_LOC 0
@@ -18,25 +25,25 @@
 #define VERT_NORMAL_LOC 3
 #define VERT_TEX_COORD_LOC 4
 
-void MDSModel::loadFromFile(const std::string &filename, const SkinFile &skin)
-{
-    FILE* fp = fopen(filename.c_str(), "rb" );
+#define BONE_PALETTE_BINDING 0
 
-    if(fp == nullptr) {
-        printf("unable to open %s\n", filename.c_str());
-    }
-    
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
+void MDSModel::load(const std::string &filename)
+{
+    auto start = std::chrono::steady_clock::now();
+    const size_t residentBefore = residentMemoryBytes();
     
-    data_.resize(size);
+    file_ = FileSystem::instance().read(filename);
     
-    fseek(fp, 0, SEEK_SET);
-    fread(data_.data(), size, 1, fp);
-    fclose(fp);
+    if (file_.empty()) return;
     
     // Header
-    header_ = (mdsHeader_t *)data_.data();
+    header_ = file_.at<mdsHeader_t>(0);
+    
+    if (!header_)
+    {
+        printf("Model %s: file is too small\n", filename.c_str());
+        return;
+    }
     
     if (header_->ident != MDS_IDENT)
     {
@@ -56,30 +63,93 @@ void MDSModel::loadFromFile(const std::string &filename, const SkinFile &skin)
         return;
     }
     
-    boneInfo_ = (mdsBoneInfo_t *)(data_.data() + header_->ofsBones);
+    if (header_->numBones < 1 || header_->numBones > MDS_MAX_BONES)
+    {
+        printf("Model %s: bad number of bones (%i)\n", filename.c_str(), header_->numBones);
+        return;
+    }
+    
+    // Everything below points straight into the mapping.
+    const size_t frameSize = sizeof(mdsFrame_t) - sizeof(mdsBoneFrameCompressed_t) + header_->numBones * sizeof(mdsBoneFrameCompressed_t);
+    auto boneInfo = file_.span<mdsBoneInfo_t>(header_->ofsBones, header_->numBones);
+    auto frames = file_.span<uint8_t>(header_->ofsFrames, (int64_t)header_->numFrames * frameSize);
+    auto tags = file_.span<mdsTag_t>(header_->ofsTags, header_->numTags);
+    
+    if ((int)boneInfo.size() != header_->numBones || frames.size() != header_->numFrames * frameSize || (int)tags.size() != header_->numTags || !surfacesInBounds())
+    {
+        printf("Model %s: data out of file bounds\n", filename.c_str());
+        header_ = nullptr;
+        return;
+    }
+    
+    // Bone indices get used to index arrays of numBones, the root parent is -1.
+    auto validBone = [&](int bone) { return bone >= 0 && bone < header_->numBones; };
+    bool bonesValid = true;
+    
+    for (const mdsBoneInfo_t &bi : boneInfo)
+    {
+        if (bi.parent != -1 && !validBone(bi.parent)) bonesValid = false;
+    }
+    
+    for (const mdsTag_t &tag : tags)
+    {
+        if (!validBone(tag.boneIndex)) bonesValid = false;
+    }
+    
+    if (!bonesValid)
+    {
+        printf("Model %s: bad bone index\n", filename.c_str());
+        header_ = nullptr;
+        return;
+    }
+    
+    boneInfo_ = boneInfo.data();
+    tags_ = tags.data();
     frames_.resize(header_->numFrames);
     
     for (size_t i = 0; i < frames_.size(); i++)
     {
-        const size_t frameSize = sizeof(mdsFrame_t) - sizeof(mdsBoneFrameCompressed_t) + header_->numBones * sizeof(mdsBoneFrameCompressed_t);
-        frames_[i] = (mdsFrame_t *)(data_.data() + header_->ofsFrames + i * frameSize);
+        frames_[i] = (const mdsFrame_t *)(frames.data() + i * frameSize);
     }
     
-    tags_ = (mdsTag_t *)(data_.data() + header_->ofsTags);
+    buildBoneHierarchy();
+    
+    CookedCache::Key key;
+    cooked_ = CookedCache::instance().open(filename, file_, MDS_IDENT, key);
+    
+    if (!cooked_.empty() && !loadCooked(cooked_))
+    {
+        printf("Model %s: broken cooked file, converting the source\n", filename.c_str());
+        cooked_ = CookedFile();
+    }
     
-    for (const auto& [mesh, texture] : skin.textures)
+    if (cooked_.empty())
     {
-        m_textures[mesh] = loadTexture(texture.c_str());
+        buildPoseTable();
+        buildSurfaces();
+        cook(key);
     }
     
-    m_shader.init("assets/shaders/mds.glsl");
+    loaded_ = true;
+    loadMs_ = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    const size_t residentAfter = residentMemoryBytes();
+    loadResidentBytes_ = residentAfter > residentBefore ? residentAfter - residentBefore : 0;
     
-    auto header = (mdsHeader_t *)data_.data();
-    auto surface = (mdsSurface_t *)(data_.data() + header->ofsSurfaces);
+    printf("Model %s: %zu KB %s%s, loaded in %.2f ms, RSS +%zu KB\n", filename.c_str(), file_.size() / 1024,
+           file_.mapped ? "mapped" : "read", cooked_.empty() ? "" : ", cooked", loadMs_, loadResidentBytes_ / 1024);
+}
+
+// Repack the variable length vertices into Vertex2, all the surfaces into one array.
+void MDSModel::buildSurfaces()
+{
+    vertices_.clear();
+    indices_.clear();
+    
+    auto surface = (const mdsSurface_t *)(file_.data() + header_->ofsSurfaces);
     
-    m_drawCallList.resize(header->numSurfaces);
+    m_drawCallList.resize(header_->numSurfaces);
     
-    for (int s = 0; s < header->numSurfaces; s++)
+    for (int s = 0; s < header_->numSurfaces; s++)
     {
         int numVertices = surface->numVerts;
         int numIndices = surface->numTriangles * 3;
@@ -89,19 +159,37 @@ void MDSModel::loadFromFile(const std::string &filename, const SkinFile &skin)
         drawCall.numVertices = numVertices;
         drawCall.numIndices = numIndices;
 
-        drawCall.tib.resize(numIndices);
-        drawCall.tvb.resize(numVertices);
+        drawCall.firstVertex = (uint32_t)vertices_.size();
+        drawCall.firstIndex = (uint32_t)indices_.size();
         
-        auto indices = (uint16_t *)drawCall.tib.data();
-        auto vertices = (Vertex2 *)drawCall.tvb.data();
-        auto mdsIndices = (const int *)((uint8_t *)surface + surface->ofsTriangles);
+        vertices_.resize(vertices_.size() + numVertices);
+        indices_.resize(indices_.size() + numIndices);
+        
+        auto indices = indices_.data() + drawCall.firstIndex;
+        auto vertices = vertices_.data() + drawCall.firstVertex;
+        auto mdsIndices = (const int *)((const uint8_t *)surface + surface->ofsTriangles);
         
         for (int i = 0; i < numIndices; i++)
         {
             indices[i] = mdsIndices[i];
         }
         
-        auto mdsVertex = (const mdsVertex_t *)((uint8_t *)surface + surface->ofsVerts);
+        // Remap the vertex bone indices into a palette local to this surface,
+        // so only the referenced bones have to be uploaded at render time.
+        auto boneRefs = (const int *)((const uint8_t *)surface + surface->ofsBoneReferences);
+        int paletteIndex[MDS_MAX_BONES];
+        
+        std::fill(std::begin(paletteIndex), std::end(paletteIndex), -1);
+        
+        for (int i = 0; i < surface->numBoneReferences; i++)
+        {
+            if (paletteIndex[boneRefs[i]] != -1) continue;
+            
+            paletteIndex[boneRefs[i]] = (int)drawCall.bones.size();
+            drawCall.bones.push_back(boneRefs[i]);
+        }
+        
+        auto mdsVertex = (const mdsVertex_t *)((const uint8_t *)surface + surface->ofsVerts);
         
         for (int i = 0; i < numVertices; i++)
         {
@@ -110,7 +198,15 @@ void MDSModel::loadFromFile(const std::string &filename, const SkinFile &skin)
             for (int j = 0; j < mdsVertex->numWeights; j++)
             {
                 const mdsWeight_t &weight = mdsVertex->weights[j];
-                float w = float(weight.boneIndex) + weight.boneWeight * 0.5;
+                
+                // Shouldn't happen, but don't trust the bone references blindly.
+                if (paletteIndex[weight.boneIndex] == -1)
+                {
+                    paletteIndex[weight.boneIndex] = (int)drawCall.bones.size();
+                    drawCall.bones.push_back(weight.boneIndex);
+                }
+                
+                float w = float(paletteIndex[weight.boneIndex]) + weight.boneWeight * 0.5;
                 auto packed = vec4(weight.offset.x, weight.offset.y, weight.offset.z, w);
                 
                 if (j == 0)
@@ -131,95 +227,494 @@ void MDSModel::loadFromFile(const std::string &filename, const SkinFile &skin)
             v.texCoord = mdsVertex->texCoords;
             
             // Move to the next vertex.
-            mdsVertex = (mdsVertex_t *)&mdsVertex->weights[mdsVertex->numWeights];
+            mdsVertex = (const mdsVertex_t *)&mdsVertex->weights[mdsVertex->numWeights];
         }
         
-
+        buildLods(surface, drawCall);
         
-        glGenBuffers(1, &drawCall.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, drawCall.vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex2) * numVertices, drawCall.tvb.data(), GL_STATIC_DRAW);
+        // Move to the next surface.
+        surface = (const mdsSurface_t *)((const uint8_t *)surface + surface->ofsEnd);
+    }
+    
+    vertexData_ = vertices_;
+    indexData_ = indices_;
+}
+
+// Vertices past the render count of a level are collapsed into the ones kept, like
+// RB_SurfaceAnim does every frame, and the triangles that degenerate are dropped.
+// The levels follow the full mesh in the index data of the surface.
+void MDSModel::buildLods(const mdsSurface_t *surface, DrawCall &drawCall)
+{
+    const int numVertices = surface->numVerts;
+    const int numIndices = surface->numTriangles * 3;
+    const int64_t collapseMapSize = numVertices * (int64_t)sizeof(int);
+    
+    drawCall.lods.assign(1, { 0, (uint32_t)numIndices });
+    
+    // Without a usable collapse map every level is the full mesh.
+    const bool hasCollapseMap = surface->ofsCollapseMap >= 0 && surface->ofsCollapseMap + collapseMapSize <= surface->ofsEnd;
+    
+    auto collapseMap = (const int *)((const uint8_t *)surface + surface->ofsCollapseMap);
+    auto mdsIndices = (const int *)((const uint8_t *)surface + surface->ofsTriangles);
+    std::vector<int> collapsed(numVertices);
+    
+    for (int lod = 1; lod < kNumLods; lod++)
+    {
+        // minLod can be past numVerts, and std::clamp needs lo <= hi.
+        const int minCount = std::min(std::max(1, surface->minLod), numVertices);
+        const int renderCount = std::clamp((int)(numVertices * kLodFractions[lod]), minCount, numVertices);
+        bool valid = hasCollapseMap && renderCount < numVertices;
         
-        glGenVertexArrays(1, &drawCall.vao);
-        glBindVertexArray(drawCall.vao);
+        // Collapsed vertices always point at one with a lower index, don't trust the file blindly.
+        for (int i = 0; valid && i < numVertices; i++)
+        {
+            int p = i;
+            
+            while (p >= renderCount)
+            {
+                const int next = collapseMap[p];
+                
+                if (next < 0 || next >= p)
+                {
+                    valid = false;
+                    break;
+                }
+                
+                p = next;
+            }
+            
+            collapsed[i] = p;
+        }
         
-        glEnableVertexAttribArray(VERT_PACKED0_LOC);
-        glVertexAttribPointer(VERT_PACKED0_LOC, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, packed0));
-
-        glEnableVertexAttribArray(VERT_PACKED1_LOC);
-        glVertexAttribPointer(VERT_PACKED1_LOC, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, packed1));
+        if (!valid)
+        {
+            drawCall.lods.push_back(drawCall.lods.back());
+            continue;
+        }
         
-        glEnableVertexAttribArray(VERT_PACKED2_LOC);
-        glVertexAttribPointer(VERT_PACKED2_LOC, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, packed2));
+        const uint32_t first = (uint32_t)(indices_.size() - drawCall.firstIndex);
         
-        glEnableVertexAttribArray(VERT_NORMAL_LOC);
-        glVertexAttribPointer(VERT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, normal));
+        for (int i = 0; i < numIndices; i += 3)
+        {
+            const int p0 = collapsed[mdsIndices[i]];
+            const int p1 = collapsed[mdsIndices[i + 1]];
+            const int p2 = collapsed[mdsIndices[i + 2]];
+            
+            if (p0 == p1 || p1 == p2 || p2 == p0) continue;
+            
+            indices_.push_back(p0);
+            indices_.push_back(p1);
+            indices_.push_back(p2);
+        }
         
-        glEnableVertexAttribArray(VERT_TEX_COORD_LOC);
-        glVertexAttribPointer(VERT_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, texCoord));
+        drawCall.lods.push_back({ first, (uint32_t)(indices_.size() - drawCall.firstIndex) - first });
+    }
+    
+    // The index buffer of the surface holds all the levels.
+    drawCall.numIndices = (uint32_t)(indices_.size() - drawCall.firstIndex);
+}
 
-        
-        glGenBuffers(1, &drawCall.ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawCall.ibo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * numIndices, drawCall.tib.data(), GL_STATIC_DRAW);
+float MDSModel::lodFraction(float projectedRadius) const
+{
+    // An object at or behind the camera, e.g. a view weapon, gets the full mesh.
+    float flod = projectedRadius > 0 ? projectedRadius * lodScale * header_->lodScale : 1.0f;
+    flod -= 0.25f * lodBias + header_->lodBias;
+    
+    return std::clamp(flod, 0.0f, 1.0f);
+}
 
-        // Move to the next surface.
-        surface = (mdsSurface_t *)((uint8_t *)surface + surface->ofsEnd);
+int MDSModel::lodLevel(float projectedRadius) const
+{
+    if (!useLods) return 0;
+    
+    const float fraction = lodFraction(projectedRadius);
+    int lod = 0;
+    
+    while (lod + 1 < kNumLods && kLodFractions[lod + 1] >= fraction)
+    {
+        lod++;
     }
+    
+    return lod;
 }
 
-void MDSModel::render(const glm::mat4 &mvp, const MDSFrameInfo &entity)
+void MDSModel::frameBounds(int frame, vec3 &origin, float &radius) const
 {
-    m_shader.bind();
-    m_shader.setUniform("uMVP", mvp);
+    const mdsFrame_t *f = frames_[std::clamp(frame, 0, (int)frames_.size() - 1)];
+    origin = f->localOrigin;
+    radius = f->radius;
+}
+
+int MDSModel::numLodTriangles(int lod) const
+{
+    int numTriangles = 0;
     
-    auto header = (mdsHeader_t *)data_.data();
-    auto surface = (mdsSurface_t *)(data_.data() + header->ofsSurfaces);
+    for (const DrawCall &drawCall : m_drawCallList)
+    {
+        numTriangles += drawCall.lods[std::clamp(lod, 0, (int)drawCall.lods.size() - 1)].numIndices / 3;
+    }
     
-    for (int i = 0; i < m_drawCallList.size(); ++i)
+    return numTriangles;
+}
+
+int MDSModel::numUploadSteps() const
+{
+    return 1 + (int)m_drawCallList.size();
+}
+
+void MDSModel::uploadStep(int step)
+{
+    // A model shared by several characters is uploaded once, whoever gets to a step first.
+    if (step == 0)
     {
-        Skeleton skeleton = calculateSkeleton(entity, (int *)((uint8_t *)surface + surface->ofsBoneReferences), surface->numBoneReferences);
+        if (m_shader.program != 0) return;
         
-        // Move to the next surface.
-        surface = (mdsSurface_t *)((uint8_t *)surface + surface->ofsEnd);
+        m_shader.init("assets/shaders/mds.glsl");
+        m_shader.bindUniformBlock("BonePalette", BONE_PALETTE_BINDING);
+        m_uMVP = m_shader.uniform<glm::mat4>("uMVP");
+    }
+    else
+    {
+        uploadSurface(m_drawCallList[step - 1]);
+    }
+}
+
+void MDSModel::uploadSurface(DrawCall &drawCall)
+{
+    if (drawCall.vao != 0) return;
+    
+    glGenBuffers(1, &drawCall.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, drawCall.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex2) * drawCall.numVertices, vertexData_.data() + drawCall.firstVertex, GL_STATIC_DRAW);
+    
+    glGenVertexArrays(1, &drawCall.vao);
+    glBindVertexArray(drawCall.vao);
+    
+    glEnableVertexAttribArray(VERT_PACKED0_LOC);
+    glVertexAttribPointer(VERT_PACKED0_LOC, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, packed0));
+
+    glEnableVertexAttribArray(VERT_PACKED1_LOC);
+    glVertexAttribPointer(VERT_PACKED1_LOC, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, packed1));
+    
+    glEnableVertexAttribArray(VERT_PACKED2_LOC);
+    glVertexAttribPointer(VERT_PACKED2_LOC, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, packed2));
+    
+    glEnableVertexAttribArray(VERT_NORMAL_LOC);
+    glVertexAttribPointer(VERT_NORMAL_LOC, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, normal));
+    
+    glEnableVertexAttribArray(VERT_TEX_COORD_LOC);
+    glVertexAttribPointer(VERT_TEX_COORD_LOC, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex2), (void*)offsetof(Vertex2, texCoord));
+
+    
+    glGenBuffers(1, &drawCall.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawCall.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * drawCall.numIndices, indexData_.data() + drawCall.firstIndex, GL_STATIC_DRAW);
+}
+
+bool MDSModel::surfacesInBounds() const
+{
+    int64_t offset = header_->ofsSurfaces;
+    
+    for (int i = 0; i < header_->numSurfaces; i++)
+    {
+        auto surface = file_.at<mdsSurface_t>(offset);
+        
+        if (!surface || surface->ofsEnd <= 0 || file_.span<uint8_t>(offset, surface->ofsEnd).empty())
+            return false;
+        
+        // The lumps of a surface must stay inside of it.
+        auto inSurface = [&](int64_t ofs, int64_t size)
+        {
+            return ofs >= 0 && size >= 0 && ofs + size <= surface->ofsEnd;
+        };
+        
+        if (surface->numVerts < 0 ||
+            !inSurface(surface->ofsTriangles, surface->numTriangles * 3 * (int64_t)sizeof(int)) ||
+            !inSurface(surface->ofsBoneReferences, surface->numBoneReferences * (int64_t)sizeof(int)))
+            return false;
+        
+        // Triangles index the vertices of the surface, through 16 bit indices.
+        if (surface->numVerts > 0x10000) return false;
+        
+        auto triangles = (const int *)((const uint8_t *)surface + surface->ofsTriangles);
+        
+        for (int j = 0; j < surface->numTriangles * 3; j++)
+        {
+            if (triangles[j] < 0 || triangles[j] >= surface->numVerts) return false;
+        }
+        
+        auto boneRefs = (const int *)((const uint8_t *)surface + surface->ofsBoneReferences);
         
-        for (int i = 0; i < MDS_MAX_BONES; ++i)
+        for (int j = 0; j < surface->numBoneReferences; j++)
         {
-            m_transforms[i][0][0] = skeleton.bones[i].rotation[0][0];
-            m_transforms[i][1][0] = skeleton.bones[i].rotation[1][0];
-            m_transforms[i][2][0] = skeleton.bones[i].rotation[2][0];
-            m_transforms[i][3][0] = 0;
+            if (boneRefs[j] < 0 || boneRefs[j] >= header_->numBones) return false;
+        }
+        
+        // The vertices are variable sized, walk them one by one. Vertex2 only
+        // packs three weights, so more than that is a broken model as well.
+        int64_t ofsVertex = surface->ofsVerts;
+        
+        for (int j = 0; j < surface->numVerts; j++)
+        {
+            const int64_t headerSize = sizeof(mdsVertex_t) - sizeof(mdsWeight_t);
+            
+            if (!inSurface(ofsVertex, headerSize)) return false;
+            
+            auto vertex = (const mdsVertex_t *)((const uint8_t *)surface + ofsVertex);
+            
+            if (vertex->numWeights < 1 || vertex->numWeights > 3) return false;
+            
+            const int64_t vertexSize = headerSize + vertex->numWeights * (int64_t)sizeof(mdsWeight_t);
             
-            m_transforms[i][0][1] = skeleton.bones[i].rotation[0][1];
-            m_transforms[i][1][1] = skeleton.bones[i].rotation[1][1];
-            m_transforms[i][2][1] = skeleton.bones[i].rotation[2][1];
-            m_transforms[i][3][1] = 0;
+            if (!inSurface(ofsVertex, vertexSize)) return false;
+            
+            for (int k = 0; k < vertex->numWeights; k++)
+            {
+                if (vertex->weights[k].boneIndex < 0 || vertex->weights[k].boneIndex >= header_->numBones) return false;
+            }
+            
+            ofsVertex += vertexSize;
+        }
+        
+        offset += surface->ofsEnd;
+    }
+    
+    return true;
+}
+
+void MDSModel::buildBoneHierarchy()
+{
+    const int numBones = header_->numBones;
+    
+    // Depth of every bone in the hierarchy.
+    int boneDepth[MDS_MAX_BONES];
+    int maxDepth = 0;
+    
+    for (int i = 0; i < numBones; i++)
+    {
+        boneDepth[i] = 0;
+        
+        for (int parent = boneInfo_[i].parent; parent >= 0 && boneDepth[i] < numBones; parent = boneInfo_[parent].parent)
+        {
+            boneDepth[i]++;
+        }
+        
+        maxDepth = std::max(maxDepth, boneDepth[i]);
+    }
+    
+    // Evaluation order: level by level, so parents always come before children
+    // and the bones of one level are contiguous for the batched kernel.
+    boneLists_.clear();
+    levelStarts_.clear();
+    
+    // Within a level the bones are sorted by evaluator class, so they form long runs.
+    for (int depth = 0; depth <= maxDepth; depth++)
+    {
+        levelStarts_.push_back((int)boneLists_.size());
+        
+        for (int evaluator = (int)BoneClass::Root; evaluator <= (int)BoneClass::PartialTorso; evaluator++)
+        {
+            for (int i = 0; i < numBones; i++)
+            {
+                if (boneDepth[i] == depth && (int)evaluatorClass(i) == evaluator) boneLists_.push_back(i);
+            }
+        }
+    }
+    
+    levelStarts_.push_back((int)boneLists_.size());
+    boneBuckets_.clear();
+    
+    auto addBuckets = [&](BoneRange &range)
+    {
+        range.firstBucket = (int)boneBuckets_.size();
+        
+        for (int i = range.first; i < range.first + range.count; i++)
+        {
+            const BoneClass evaluator = evaluatorClass(boneLists_[i]);
             
-            m_transforms[i][0][2] = skeleton.bones[i].rotation[0][2];
-            m_transforms[i][1][2] = skeleton.bones[i].rotation[1][2];
-            m_transforms[i][2][2] = skeleton.bones[i].rotation[2][2];
-            m_transforms[i][3][2] = 0;
+            if (boneBuckets_.size() > (size_t)range.firstBucket && boneBuckets_.back().evaluator == evaluator)
+                boneBuckets_.back().count++;
+            else
+                boneBuckets_.push_back({ evaluator, i, 1 });
+        }
+        
+        range.numBuckets = (int)boneBuckets_.size() - range.firstBucket;
+    };
+    
+    allBones_ = { 0, numBones };
+    addBuckets(allBones_);
+    
+    for (int i = 0; i < numBones; i++)
+    {
+        const mdsBoneInfo_t &bi = boneInfo_[i];
+        
+        if (bi.flags & BONEFLAG_TAG)
+            boneClasses_[i] = BoneClass::Tag;
+        else if (bi.parent < 0)
+            boneClasses_[i] = BoneClass::Root;
+        else if (bi.torsoWeight == 1.0f)
+            boneClasses_[i] = BoneClass::FullTorso;
+        else if (bi.torsoWeight)
+            boneClasses_[i] = BoneClass::PartialTorso;
+        else
+            boneClasses_[i] = BoneClass::Legs;
+    }
+    
+    // The bones needed for a set of bones: themselves and all their ancestors, in evaluation order.
+    auto addSubset = [&](const int *bones, int count)
+    {
+        bool needed[MDS_MAX_BONES] = { false };
+        
+        for (int i = 0; i < count; i++)
+        {
+            for (int bone = bones[i]; bone >= 0 && !needed[bone]; bone = boneInfo_[bone].parent)
+            {
+                needed[bone] = true;
+            }
+        }
         
-            m_transforms[i][0][3] = skeleton.bones[i].translation.x;
-            m_transforms[i][1][3] = skeleton.bones[i].translation.y;
-            m_transforms[i][2][3] = skeleton.bones[i].translation.z;
-            m_transforms[i][3][3] = 1;
+        BoneRange range = { (int)boneLists_.size(), 0 };
+        
+        for (int i = 0; i < numBones; i++)
+        {
+            if (needed[boneLists_[i]]) boneLists_.push_back(boneLists_[i]);
         }
         
-        m_shader.setUniform("uBoneTransforms", m_transforms);
+        range.count = (int)boneLists_.size() - range.first;
+        addBuckets(range);
+        return range;
+    };
+    
+    surfaceBones_.clear();
+    tagBones_.clear();
+    
+    auto surface = (const mdsSurface_t *)(file_.data() + header_->ofsSurfaces);
+    
+    for (int i = 0; i < header_->numSurfaces; i++)
+    {
+        surfaceBones_.push_back(addSubset((const int *)((const uint8_t *)surface + surface->ofsBoneReferences), surface->numBoneReferences));
+        surface = (const mdsSurface_t *)((const uint8_t *)surface + surface->ofsEnd);
+    }
+    
+    for (int i = 0; i < header_->numTags; i++)
+    {
+        tagBones_.push_back(addSubset(&tags_[i].boneIndex, 1));
+    }
+}
+
+MDSModel::BoneClass MDSModel::evaluatorClass(int boneIndex) const
+{
+    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
+    
+    if (bi.parent < 0)
+        return BoneClass::Root;
+    else if (bi.torsoWeight == 1.0f)
+        return BoneClass::FullTorso;
+    else if (bi.torsoWeight)
+        return BoneClass::PartialTorso;
+    else
+        return BoneClass::Legs;
+}
+
+MDSModel::BoneRange MDSModel::tagBones(const char *name) const
+{
+    for (int i = 0; i < header_->numTags; i++)
+    {
+        if (!strcmp(tags_[i].name, name)) return tagBones_[i];
+    }
+    
+    return BoneRange();
+}
+
+void MDSModel::calculatePose(const MDSFrameInfo &entity, Skeleton &skeleton) const
+{
+    calculatePose(entity, allBones_, skeleton);
+}
+
+void MDSModel::calculatePose(const MDSFrameInfo &entity, const BoneRange &bones, Skeleton &skeleton) const
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    calculateSkeleton(entity, bones, skeleton, poseEvalMode, anglePrecision);
+    
+    FrameStats &stats = FrameStats::instance();
+    stats.bonesEvaluated += skeleton.numBonesEvaluated;
+    stats.poseMs += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void MDSModel::writeBonePalettes(const Skeleton &skeleton, UniformRingBuffer &ring, std::vector<size_t> &offsets) const
+{
+    // The pose is shared by all surfaces, so every bone is converted only once. The model is
+    // shared by the characters, the matrices live on the stack of the call.
+    glm::mat4 transforms[MDS_MAX_BONES];
+    
+    for (int i = 0; i < header_->numBones; ++i)
+    {
+        transforms[i][0][0] = skeleton.bones[i].rotation[0][0];
+        transforms[i][1][0] = skeleton.bones[i].rotation[1][0];
+        transforms[i][2][0] = skeleton.bones[i].rotation[2][0];
+        transforms[i][3][0] = 0;
+        
+        transforms[i][0][1] = skeleton.bones[i].rotation[0][1];
+        transforms[i][1][1] = skeleton.bones[i].rotation[1][1];
+        transforms[i][2][1] = skeleton.bones[i].rotation[2][1];
+        transforms[i][3][1] = 0;
+        
+        transforms[i][0][2] = skeleton.bones[i].rotation[0][2];
+        transforms[i][1][2] = skeleton.bones[i].rotation[1][2];
+        transforms[i][2][2] = skeleton.bones[i].rotation[2][2];
+        transforms[i][3][2] = 0;
+    
+        transforms[i][0][3] = skeleton.bones[i].translation.x;
+        transforms[i][1][3] = skeleton.bones[i].translation.y;
+        transforms[i][2][3] = skeleton.bones[i].translation.z;
+        transforms[i][3][3] = 1;
+    }
+    
+    offsets.resize(m_drawCallList.size());
+    
+    for (size_t i = 0; i < m_drawCallList.size(); ++i)
+    {
+        auto& drawCall = m_drawCallList[i];
+        
+        // Stage just the bones referenced by the surface.
+        offsets[i] = ring.allocate(sizeof(glm::mat4) * drawCall.bones.size());
+        auto palette = (glm::mat4 *)ring.data(offsets[i]);
         
+        for (size_t j = 0; j < drawCall.bones.size(); ++j)
+        {
+            palette[j] = transforms[drawCall.bones[j]];
+        }
+    }
+}
+
+void MDSModel::render(const glm::mat4 &mvp, const SkinTextures &skin, const UniformRingBuffer &ring, const std::vector<size_t> &offsets, int lod)
+{
+    m_shader.bind();
+    m_shader.setUniform(m_uMVP, mvp);
+    
+    for (size_t i = 0; i < m_drawCallList.size(); ++i)
+    {
         auto& drawCall = m_drawCallList[i];
         
-        if (m_textures.contains(drawCall.name))
+        if (drawCall.bones.empty()) continue;
+        
+        ring.bindRange(BONE_PALETTE_BINDING, offsets[i]);
+        
+        if (unsigned int texture = skin.texture(drawCall.name))
         {
             glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, m_textures[drawCall.name]);
+            glBindTexture(GL_TEXTURE_2D, texture);
         }
         
         glBindVertexArray(drawCall.vao);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, drawCall.ibo);
         
-        glDrawElements(GL_TRIANGLES, drawCall.numIndices, GL_UNSIGNED_SHORT, 0);
+        const DrawCall::Lod &range = drawCall.lods[std::clamp(lod, 0, (int)drawCall.lods.size() - 1)];
+        glDrawElements(GL_TRIANGLES, range.numIndices, GL_UNSIGNED_SHORT, (void*)(range.firstIndex * sizeof(uint16_t)));
+        
+        FrameStats::instance().trianglesDrawn += range.numIndices / 3;
+        FrameStats::instance().drawCalls++;
     }
 }
 
@@ -270,275 +765,858 @@ static float AngleNormalize180(float angle) {
     return angle;
 }
 
-MDSModel::Bone MDSModel::calculateBoneRaw(const MDSFrameInfo &entity, int boneIndex, const Skeleton &skeleton) const
+MDSModel::DecodedBone MDSModel::decodeBone(const mdsBoneFrameCompressed_t &compressedBone)
 {
-    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
-    bool isTorso = false, fullTorso = false;
-    const mdsBoneFrameCompressed_t *compressedTorsoBone = nullptr;
+    DecodedBone bone;
     
-    if (bi.torsoWeight)
-    {
-        compressedTorsoBone = &skeleton.torsoFrame->bones[boneIndex];
-        isTorso = true;
-        
+    for (int i = 0; i < 3; i++)
+        bone.angles[i] = SHORT2ANGLE(compressedBone.angles[i]);
+    
+    vec3 angles;
+    angles[0] = SHORT2ANGLE(compressedBone.ofsAngles[0]);
+    angles[1] = SHORT2ANGLE(compressedBone.ofsAngles[1]);
+    angles[2] = 0;
+    angles.toAngleVectors(&bone.offsetDir);
+    
+    return bone;
+}
+
+MDSModel::DecodedBone MDSModel::decodedBone(int frame, int boneIndex) const
+{
+    assert(frame >= 0 && frame < (int)frames_.size());
+    
+    if (poseTable_.resident)
+    {
+        const size_t index = (size_t)frame * header_->numBones + boneIndex;
+        return DecodedBone{ poseTable_.angles[index], poseTable_.offsetDirs[index] };
+    }
+    
+    // Too long to keep decoded, fall back to the file data.
+    return decodeBone(frames_[frame]->bones[boneIndex]);
+}
+
+quat MDSModel::decodedRotation(int frame, int boneIndex) const
+{
+    assert(frame >= 0 && frame < (int)frames_.size());
+    
+    if (poseTable_.resident)
+    {
+        return poseTable_.rotations[(size_t)frame * header_->numBones + boneIndex];
+    }
+    
+    return quat::fromMat3(mat3(decodeBone(frames_[frame]->bones[boneIndex]).angles));
+}
+
+const vec3 &MDSModel::parentOffset(int frame) const
+{
+    return poseTable_.resident ? poseTable_.parentOffsets[frame] : frames_[frame]->parentOffset;
+}
+
+void MDSModel::buildPoseTable()
+{
+    const size_t numFrameBones = frames_.size() * header_->numBones;
+    const size_t bytes = numFrameBones * (sizeof(vec3) * 2 + sizeof(quat)) + frames_.size() * sizeof(vec3);
+    
+    poseTable_ = PoseTable();
+    poseTable_.bytes = bytes;
+    
+    if (bytes > poseTableBudget)
+    {
+        printf("Pose table of %zu KB is over budget, bones will be decoded on demand\n", bytes / 1024);
+        return;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    struct Decoded
+    {
+        std::vector<vec3> angles;
+        std::vector<quat> rotations;
+        std::vector<vec3> offsetDirs;
+        std::vector<vec3> parentOffsets;
+    };
+    
+    auto decoded = std::make_shared<Decoded>();
+    decoded->angles.resize(numFrameBones);
+    decoded->rotations.resize(numFrameBones);
+    decoded->offsetDirs.resize(numFrameBones);
+    decoded->parentOffsets.resize(frames_.size());
+    
+    for (size_t i = 0; i < frames_.size(); i++)
+    {
+        decoded->parentOffsets[i] = frames_[i]->parentOffset;
+        
+        for (int j = 0; j < header_->numBones; j++)
+        {
+            const DecodedBone bone = decodeBone(frames_[i]->bones[j]);
+            decoded->angles[i * header_->numBones + j] = bone.angles;
+            decoded->rotations[i * header_->numBones + j] = quat::fromMat3(mat3(bone.angles));
+            decoded->offsetDirs[i * header_->numBones + j] = bone.offsetDir;
+        }
+    }
+    
+    poseTable_.angles = decoded->angles;
+    poseTable_.rotations = decoded->rotations;
+    poseTable_.offsetDirs = decoded->offsetDirs;
+    poseTable_.parentOffsets = decoded->parentOffsets;
+    poseTable_.owner = decoded;
+    poseTable_.resident = true;
+    poseTable_.decodeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    
+    printf("Pose table: %zu frames x %d bones, %zu KB, decoded in %.2f ms\n", frames_.size(), header_->numBones, bytes / 1024, poseTable_.decodeMs);
+}
+
+enum
+{
+    COOKED_MDS_SURFACES = 1,
+    COOKED_MDS_VERTICES,
+    COOKED_MDS_INDICES,
+    COOKED_MDS_BONES,
+    COOKED_MDS_POSE_ANGLES,
+    COOKED_MDS_POSE_ROTATIONS,
+    COOKED_MDS_POSE_OFFSET_DIRS,
+    COOKED_MDS_PARENT_OFFSETS,
+    COOKED_MDS_LODS
+};
+
+// Everything is used in place, only the bone lists of the surfaces are copied.
+bool MDSModel::loadCooked(const CookedFile &cooked)
+{
+    auto surfaces = cooked.section<CookedSurface>(COOKED_MDS_SURFACES);
+    auto vertices = cooked.section<Vertex2>(COOKED_MDS_VERTICES);
+    auto indices = cooked.section<uint16_t>(COOKED_MDS_INDICES);
+    auto bones = cooked.section<int>(COOKED_MDS_BONES);
+    auto lods = cooked.section<DrawCall::Lod>(COOKED_MDS_LODS);
+    
+    if ((int)surfaces.size() != header_->numSurfaces || lods.size() != surfaces.size() * kNumLods) return false;
+    
+    for (size_t i = 0; i < surfaces.size(); i++)
+    {
+        const CookedSurface &surface = surfaces[i];
+        
+        if ((uint64_t)surface.firstVertex + surface.numVertices > vertices.size() ||
+            (uint64_t)surface.firstIndex + surface.numIndices > indices.size() ||
+            (uint64_t)surface.firstBone + surface.numBones > bones.size())
+        {
+            return false;
+        }
+        
+        for (int lod = 0; lod < kNumLods; lod++)
+        {
+            if ((uint64_t)lods[i * kNumLods + lod].firstIndex + lods[i * kNumLods + lod].numIndices > surface.numIndices) return false;
+        }
+        
+        // The bones index the skeleton, the indices the vertices of the surface.
+        for (int bone : bones.subspan(surface.firstBone, surface.numBones))
+        {
+            if (bone < 0 || bone >= header_->numBones) return false;
+        }
+        
+        for (uint16_t index : indices.subspan(surface.firstIndex, surface.numIndices))
+        {
+            if (index >= surface.numVertices) return false;
+        }
+    }
+    
+    m_drawCallList.resize(surfaces.size());
+    
+    for (size_t i = 0; i < surfaces.size(); i++)
+    {
+        const CookedSurface &surface = surfaces[i];
+        DrawCall &drawCall = m_drawCallList[i];
+        
+        drawCall.name = std::string(surface.name, strnlen(surface.name, sizeof(surface.name)));
+        drawCall.firstVertex = surface.firstVertex;
+        drawCall.numVertices = surface.numVertices;
+        drawCall.firstIndex = surface.firstIndex;
+        drawCall.numIndices = surface.numIndices;
+        drawCall.bones.assign(bones.begin() + surface.firstBone, bones.begin() + surface.firstBone + surface.numBones);
+        drawCall.lods.assign(lods.begin() + i * kNumLods, lods.begin() + (i + 1) * kNumLods);
+    }
+    
+    vertexData_ = vertices;
+    indexData_ = indices;
+    
+    // The pose table is there unless it was over budget when cooked.
+    const size_t numFrameBones = frames_.size() * header_->numBones;
+    
+    poseTable_ = PoseTable();
+    poseTable_.bytes = numFrameBones * (sizeof(vec3) * 2 + sizeof(quat)) + frames_.size() * sizeof(vec3);
+    poseTable_.angles = cooked.section<vec3>(COOKED_MDS_POSE_ANGLES);
+    poseTable_.rotations = cooked.section<quat>(COOKED_MDS_POSE_ROTATIONS);
+    poseTable_.offsetDirs = cooked.section<vec3>(COOKED_MDS_POSE_OFFSET_DIRS);
+    poseTable_.parentOffsets = cooked.section<vec3>(COOKED_MDS_PARENT_OFFSETS);
+    
+    poseTable_.resident = poseTable_.bytes <= poseTableBudget &&
+                          poseTable_.angles.size() == numFrameBones && poseTable_.rotations.size() == numFrameBones &&
+                          poseTable_.offsetDirs.size() == numFrameBones && poseTable_.parentOffsets.size() == frames_.size();
+    
+    if (!poseTable_.resident)
+    {
+        buildPoseTable();
+    }
+    
+    return true;
+}
+
+void MDSModel::cook(const CookedCache::Key &key) const
+{
+    std::vector<CookedSurface> surfaces;
+    std::vector<int> bones;
+    std::vector<DrawCall::Lod> lods;
+    
+    for (const DrawCall &drawCall : m_drawCallList)
+    {
+        CookedSurface surface = {};
+        strncpy(surface.name, drawCall.name.c_str(), sizeof(surface.name) - 1);
+        surface.firstVertex = drawCall.firstVertex;
+        surface.numVertices = drawCall.numVertices;
+        surface.firstIndex = drawCall.firstIndex;
+        surface.numIndices = drawCall.numIndices;
+        surface.firstBone = (uint32_t)bones.size();
+        surface.numBones = (uint32_t)drawCall.bones.size();
+        
+        bones.insert(bones.end(), drawCall.bones.begin(), drawCall.bones.end());
+        lods.insert(lods.end(), drawCall.lods.begin(), drawCall.lods.end());
+        surfaces.push_back(surface);
+    }
+    
+    CookedWriter writer;
+    writer.add(COOKED_MDS_SURFACES, surfaces);
+    writer.add(COOKED_MDS_VERTICES, vertexData_);
+    writer.add(COOKED_MDS_INDICES, indexData_);
+    writer.add(COOKED_MDS_BONES, bones);
+    writer.add(COOKED_MDS_LODS, lods);
+    
+    if (poseTable_.resident)
+    {
+        writer.add(COOKED_MDS_POSE_ANGLES, poseTable_.angles);
+        writer.add(COOKED_MDS_POSE_ROTATIONS, poseTable_.rotations);
+        writer.add(COOKED_MDS_POSE_OFFSET_DIRS, poseTable_.offsetDirs);
+        writer.add(COOKED_MDS_PARENT_OFFSETS, poseTable_.parentOffsets);
+    }
+    
+    CookedCache::instance().store(key, std::move(writer));
+}
+
+MDSModel::Bone MDSModel::calculateBoneRaw(int boneIndex, const Skeleton &skeleton) const
+{
+    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
+    bool isTorso = false, fullTorso = false;
+    DecodedBone torsoBone;
+    
+    if (bi.torsoWeight)
+    {
+        torsoBone = decodedBone(skeleton.torsoFrame, boneIndex);
+        isTorso = true;
+        
         if (bi.torsoWeight == 1.0f)
         {
             fullTorso = true;
         }
     }
     
-    const mdsBoneFrameCompressed_t &compressedBone = skeleton.frame->bones[boneIndex];
+    const DecodedBone decoded = decodedBone(skeleton.frame, boneIndex);
     Bone bone;
     
     // we can assume the parent has already been uncompressed for this frame + lerp
     const Bone *parentBone = nullptr;
     
-    if (bi.parent >= 0)
+    if (bi.parent >= 0)
+    {
+        parentBone = &skeleton.bones[bi.parent];
+    }
+    
+    // rotation
+    vec3 angles;
+    
+    if (fullTorso)
+    {
+        angles = torsoBone.angles;
+    }
+    else
+    {
+        angles = decoded.angles;
+        
+        if (isTorso)
+        {
+            // blend the angles together
+            for (int i = 0; i < 3; i++)
+            {
+                float diff = torsoBone.angles[i] - angles[i];
+                
+                if (fabs(diff) > 180)
+                    diff = AngleNormalize180(diff);
+                
+                angles[i] = angles[i] + bi.torsoWeight * diff;
+            }
+        }
+    }
+    
+    bone.rotation = mat3(angles);
+    
+    // translation
+    if (parentBone)
+    {
+        vec3 vec;
+        
+        if (fullTorso)
+        {
+            vec = torsoBone.offsetDir;
+        }
+        else
+        {
+            vec = decoded.offsetDir;
+            
+            if (isTorso)
+            {
+                // blend the angles together
+                vec = vec3::lerp(vec, torsoBone.offsetDir, bi.torsoWeight);
+            }
+        }
+        
+        bone.translation = parentBone->translation + vec * bi.parentDist;
+    }
+    else // just use the frame position
+    {
+        bone.translation = parentOffset(skeleton.frame);
+    }
+    
+    return bone;
+}
+
+MDSModel::Bone MDSModel::calculateBoneLerp(int boneIndex, const Skeleton &skeleton) const
+{
+    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
+    const Bone *parentBone = nullptr;
+    
+    if (bi.parent >= 0)
+    {
+        parentBone = &skeleton.bones[bi.parent];
+    }
+    
+    bool isTorso = false, fullTorso = false;
+    DecodedBone torsoBone, oldTorsoBone;
+    
+    if (bi.torsoWeight)
+    {
+        torsoBone = decodedBone(skeleton.torsoFrame, boneIndex);
+        oldTorsoBone = decodedBone(skeleton.oldTorsoFrame, boneIndex);
+        isTorso = true;
+        
+        if (bi.torsoWeight == 1.0f)
+            fullTorso = true;
+    }
+    
+    const DecodedBone decoded = decodedBone(skeleton.frame, boneIndex);
+    const DecodedBone oldDecoded = decodedBone(skeleton.oldFrame, boneIndex);
+    Bone bone;
+    
+    // rotation (take into account 170 to -170 lerps, which need to take the shortest route)
+    vec3 angles;
+    
+    if (fullTorso)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            const float a1 = torsoBone.angles[i];
+            const float a2 = oldTorsoBone.angles[i];
+            const float diff = AngleNormalize180(a1 - a2);
+            angles[i] = a1 - skeleton.torsoBackLerp * diff;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            const float a1 = decoded.angles[i];
+            const float a2 = oldDecoded.angles[i];
+            const float diff = AngleNormalize180(a1 - a2);
+            angles[i] = a1 - skeleton.backLerp * diff;
+        }
+        
+        if (isTorso)
+        {
+            vec3 torsoAngles;
+            
+            for (int i = 0; i < 3; i++)
+            {
+                const float a1 = torsoBone.angles[i];
+                const float a2 = oldTorsoBone.angles[i];
+                const float diff = AngleNormalize180(a1 - a2);
+                torsoAngles[i] = a1 - skeleton.torsoBackLerp * diff;
+            }
+            
+            // blend the angles together
+            for (int j = 0; j < 3; j++)
+            {
+                float diff = torsoAngles[j] - angles[j];
+                
+                if (fabs(diff) > 180)
+                    diff = AngleNormalize180(diff);
+                
+                angles[j] = angles[j] + bi.torsoWeight * diff;
+            }
+        }
+    }
+    
+    bone.rotation = mat3(angles);
+    
+    if (parentBone)
+    {
+        // blend the offset directions together
+        vec3 dir;
+        
+        if (fullTorso)
+        {
+            dir = vec3::lerp(oldTorsoBone.offsetDir, torsoBone.offsetDir, skeleton.torsoFrontLerp);
+        }
+        else
+        {
+            dir = vec3::lerp(oldDecoded.offsetDir, decoded.offsetDir, skeleton.frontLerp);
+        }
+        
+        // translation
+        if (!fullTorso && isTorso)
+        {
+            // partial legs/torso, need to lerp according to torsoWeight
+            // calc the torso frame
+            vec3 v2 = vec3::lerp(oldTorsoBone.offsetDir, torsoBone.offsetDir, skeleton.torsoFrontLerp);
+            
+            // blend the torso/legs together
+            dir = vec3::lerp(dir, v2, bi.torsoWeight);
+        }
+        
+        bone.translation = parentBone->translation + dir * bi.parentDist;
+    }
+    else
+    {
+        // just interpolate the frame positions
+        const vec3 &offset = parentOffset(skeleton.frame), &oldOffset = parentOffset(skeleton.oldFrame);
+        bone.translation[0] = skeleton.frontLerp * offset[0] + skeleton.backLerp * oldOffset[0];
+        bone.translation[1] = skeleton.frontLerp * offset[1] + skeleton.backLerp * oldOffset[1];
+        bone.translation[2] = skeleton.frontLerp * offset[2] + skeleton.backLerp * oldOffset[2];
+    }
+    
+    return bone;
+}
+
+// Angles and offset direction of the bone, lerped between the frames when needed
+// and blended between legs and torso the way the bone class says.
+template<MDSModel::BoneClass Blend, bool Lerp>
+void MDSModel::blendBoneFrames(int boneIndex, const Skeleton &skeleton, vec3 &angles, vec3 &dir) const
+{
+    auto lerpFrames = [&](int frame, int oldFrame, float backLerp, float frontLerp, vec3 &outAngles, vec3 &outDir)
+    {
+        const DecodedBone decoded = decodedBone(frame, boneIndex);
+        
+        if constexpr (Lerp)
+        {
+            // take into account 170 to -170 lerps, which need to take the shortest route
+            const DecodedBone oldDecoded = decodedBone(oldFrame, boneIndex);
+            
+            for (int i = 0; i < 3; i++)
+                outAngles[i] = decoded.angles[i] - backLerp * AngleNormalize180(decoded.angles[i] - oldDecoded.angles[i]);
+            
+            outDir = vec3::lerp(oldDecoded.offsetDir, decoded.offsetDir, frontLerp);
+        }
+        else
+        {
+            outAngles = decoded.angles;
+            outDir = decoded.offsetDir;
+        }
+    };
+    
+    if constexpr (Blend == BoneClass::FullTorso)
+    {
+        lerpFrames(skeleton.torsoFrame, skeleton.oldTorsoFrame, skeleton.torsoBackLerp, skeleton.torsoFrontLerp, angles, dir);
+    }
+    else
+    {
+        lerpFrames(skeleton.frame, skeleton.oldFrame, skeleton.backLerp, skeleton.frontLerp, angles, dir);
+    }
+    
+    if constexpr (Blend == BoneClass::PartialTorso)
+    {
+        const float torsoWeight = boneInfo_[boneIndex].torsoWeight;
+        vec3 torsoAngles, torsoDir;
+        lerpFrames(skeleton.torsoFrame, skeleton.oldTorsoFrame, skeleton.torsoBackLerp, skeleton.torsoFrontLerp, torsoAngles, torsoDir);
+        
+        // blend the angles together
+        for (int i = 0; i < 3; i++)
+        {
+            float diff = torsoAngles[i] - angles[i];
+            
+            if (fabs(diff) > 180)
+                diff = AngleNormalize180(diff);
+            
+            angles[i] = angles[i] + torsoWeight * diff;
+        }
+        
+        dir = vec3::lerp(dir, torsoDir, torsoWeight);
+    }
+}
+
+// The same as blendBoneFrames, but the angles stay 16-bit and are lerped in fixed point.
+// A 16-bit difference wraps around by itself, so it is always the shortest route.
+template<MDSModel::BoneClass Blend, bool Lerp>
+void MDSModel::blendBoneFramesShort(int boneIndex, const Skeleton &skeleton, uint16_t angles[3], vec3 &dir) const
+{
+    auto lerpFrames = [&](int frame, int oldFrame, float backLerp, float frontLerp, uint16_t outAngles[3], vec3 &outDir)
+    {
+        const mdsBoneFrameCompressed_t &bone = frames_[frame]->bones[boneIndex];
+        const uint16_t ofsAngles[3] = { (uint16_t)bone.ofsAngles[0], (uint16_t)bone.ofsAngles[1], 0 };
+        vec3::shortAngleVectors(ofsAngles, &outDir);
+        
+        if constexpr (Lerp)
+        {
+            const mdsBoneFrameCompressed_t &oldBone = frames_[oldFrame]->bones[boneIndex];
+            const int back = (int)lrintf(backLerp * 32768);
+            
+            for (int i = 0; i < 3; i++)
+                outAngles[i] = (uint16_t)(bone.angles[i] - ((back * (int16_t)(bone.angles[i] - oldBone.angles[i])) >> 15));
+            
+            const uint16_t oldOfsAngles[3] = { (uint16_t)oldBone.ofsAngles[0], (uint16_t)oldBone.ofsAngles[1], 0 };
+            vec3 oldDir;
+            vec3::shortAngleVectors(oldOfsAngles, &oldDir);
+            outDir = vec3::lerp(oldDir, outDir, frontLerp);
+        }
+        else
+        {
+            for (int i = 0; i < 3; i++)
+                outAngles[i] = (uint16_t)bone.angles[i];
+        }
+    };
+    
+    if constexpr (Blend == BoneClass::FullTorso)
+    {
+        lerpFrames(skeleton.torsoFrame, skeleton.oldTorsoFrame, skeleton.torsoBackLerp, skeleton.torsoFrontLerp, angles, dir);
+    }
+    else
+    {
+        lerpFrames(skeleton.frame, skeleton.oldFrame, skeleton.backLerp, skeleton.frontLerp, angles, dir);
+    }
+    
+    if constexpr (Blend == BoneClass::PartialTorso)
+    {
+        const float torsoWeight = boneInfo_[boneIndex].torsoWeight;
+        const int weight = (int)lrintf(torsoWeight * 32768);
+        uint16_t torsoAngles[3];
+        vec3 torsoDir;
+        lerpFrames(skeleton.torsoFrame, skeleton.oldTorsoFrame, skeleton.torsoBackLerp, skeleton.torsoFrontLerp, torsoAngles, torsoDir);
+        
+        // blend the angles together
+        for (int i = 0; i < 3; i++)
+            angles[i] = (uint16_t)(angles[i] + ((weight * (int16_t)(torsoAngles[i] - angles[i])) >> 15));
+        
+        dir = vec3::lerp(dir, torsoDir, torsoWeight);
+    }
+}
+
+template<MDSModel::BoneClass Blend, bool Lerp, AnglePrecision Precision>
+void MDSModel::blendBone(int boneIndex, const Skeleton &skeleton, mat3 &rotation, vec3 &dir) const
+{
+    if constexpr (Precision == AnglePrecision::ShortLerp)
+    {
+        uint16_t angles[3];
+        blendBoneFramesShort<Blend, Lerp>(boneIndex, skeleton, angles, dir);
+        rotation = mat3::fromShortAngles(angles);
+    }
+    else
+    {
+        vec3 angles;
+        blendBoneFrames<Blend, Lerp>(boneIndex, skeleton, angles, dir);
+        
+        if constexpr (Precision == AnglePrecision::Table)
+        {
+            const uint16_t shortAngles[3] = { AngleToShort(angles[0]), AngleToShort(angles[1]), AngleToShort(angles[2]) };
+            rotation = mat3::fromShortAngles(shortAngles);
+        }
+        else
+        {
+            rotation = mat3(angles);
+        }
+    }
+}
+
+template<MDSModel::BoneClass Class, bool Lerp, AnglePrecision Precision>
+MDSModel::Bone MDSModel::evaluateBone(int boneIndex, const Skeleton &skeleton) const
+{
+    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
+    vec3 dir;
+    Bone bone;
+    
+    if constexpr (Class == BoneClass::Root)
+    {
+        // There is only one root per model, its torso weight isn't worth a specialisation.
+        if (bi.torsoWeight == 1.0f)
+            blendBone<BoneClass::FullTorso, Lerp, Precision>(boneIndex, skeleton, bone.rotation, dir);
+        else if (bi.torsoWeight)
+            blendBone<BoneClass::PartialTorso, Lerp, Precision>(boneIndex, skeleton, bone.rotation, dir);
+        else
+            blendBone<BoneClass::Legs, Lerp, Precision>(boneIndex, skeleton, bone.rotation, dir);
+        
+        if constexpr (Lerp)
+            bone.translation = parentOffset(skeleton.frame) * skeleton.frontLerp + parentOffset(skeleton.oldFrame) * skeleton.backLerp;
+        else
+            bone.translation = parentOffset(skeleton.frame);
+    }
+    else
+    {
+        blendBone<Class, Lerp, Precision>(boneIndex, skeleton, bone.rotation, dir);
+        bone.translation = skeleton.bones[bi.parent].translation + dir * bi.parentDist;
+    }
+    
+    return bone;
+}
+
+template<MDSModel::BoneClass Class, bool Lerp, AnglePrecision Precision>
+void MDSModel::evaluateBucket(const int *bones, int count, Skeleton &skeleton) const
+{
+    for (int i = 0; i < count; i++)
+    {
+        skeleton.bones[bones[i]] = evaluateBone<Class, Lerp, Precision>(bones[i], skeleton);
+    }
+}
+
+template<AnglePrecision Precision>
+void MDSModel::evaluateBuckets(const BoneRange &range, Skeleton &skeleton, bool lerp) const
+{
+    using Evaluator = void (MDSModel::*)(const int *, int, Skeleton &) const;
+    
+    static constexpr Evaluator evaluators[4][2] =
+    {
+        { &MDSModel::evaluateBucket<BoneClass::Root, false, Precision>, &MDSModel::evaluateBucket<BoneClass::Root, true, Precision> },
+        { &MDSModel::evaluateBucket<BoneClass::Legs, false, Precision>, &MDSModel::evaluateBucket<BoneClass::Legs, true, Precision> },
+        { &MDSModel::evaluateBucket<BoneClass::FullTorso, false, Precision>, &MDSModel::evaluateBucket<BoneClass::FullTorso, true, Precision> },
+        { &MDSModel::evaluateBucket<BoneClass::PartialTorso, false, Precision>, &MDSModel::evaluateBucket<BoneClass::PartialTorso, true, Precision> },
+    };
+    
+    for (int i = range.firstBucket; i < range.firstBucket + range.numBuckets; i++)
     {
-        parentBone = &skeleton.bones[bi.parent];
+        const BoneBucket &bucket = boneBuckets_[i];
+        (this->*evaluators[(int)bucket.evaluator][lerp])(&boneLists_[bucket.first], bucket.count, skeleton);
     }
-    
-    // rotation
-    vec3 angles;
-    
-    if (fullTorso)
+}
+
+void MDSModel::evaluateBuckets(const BoneRange &range, Skeleton &skeleton, bool lerp, AnglePrecision precision) const
+{
+    switch (precision)
     {
-        for (int i = 0; i < 3; i++)
-            angles[i] = SHORT2ANGLE(compressedTorsoBone->angles[i]);
+        case AnglePrecision::Table:
+            evaluateBuckets<AnglePrecision::Table>(range, skeleton, lerp);
+            break;
+            
+        case AnglePrecision::ShortLerp:
+            evaluateBuckets<AnglePrecision::ShortLerp>(range, skeleton, lerp);
+            break;
+            
+        default:
+            evaluateBuckets<AnglePrecision::Exact>(range, skeleton, lerp);
+            break;
     }
-    else
+}
+
+MDSModel::Bone MDSModel::calculateBoneQuat(int boneIndex, const Skeleton &skeleton, bool lerp, bool slerp) const
+{
+    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
+    
+    // Rotation and offset direction of the bone in a pair of frames.
+    auto blendFrames = [&](int frame, int oldFrame, float frontLerp, quat &rotation, vec3 &dir)
     {
-        for (int i = 0; i < 3; i++)
-            angles[i] = SHORT2ANGLE(compressedBone.angles[i]);
+        const quat q = decodedRotation(frame, boneIndex);
+        dir = decodedBone(frame, boneIndex).offsetDir;
         
-        if (isTorso)
+        if (!lerp)
         {
-            vec3 torsoAngles;
-            
-            for (int i = 0; i < 3; i++)
-                torsoAngles[i] = SHORT2ANGLE(compressedTorsoBone->angles[i]);
-            
-            // blend the angles together
-            for (int i = 0; i < 3; i++)
-            {
-                float diff = torsoAngles[i] - angles[i];
-                
-                if (fabs(diff) > 180)
-                    diff = AngleNormalize180(diff);
-                
-                angles[i] = angles[i] + bi.torsoWeight * diff;
-            }
+            rotation = q;
+            return;
         }
-    }
+        
+        const quat oldQ = decodedRotation(oldFrame, boneIndex);
+        rotation = slerp ? quat::slerp(oldQ, q, frontLerp) : quat::nlerp(oldQ, q, frontLerp);
+        dir = vec3::lerp(decodedBone(oldFrame, boneIndex).offsetDir, dir, frontLerp);
+    };
     
-    bone.rotation = mat3(angles);
+    quat rotation;
+    vec3 dir;
     
-    // translation
-    if (parentBone)
+    if (bi.torsoWeight != 1.0f)
     {
-        vec3 vec;
+        blendFrames(skeleton.frame, skeleton.oldFrame, skeleton.frontLerp, rotation, dir);
+    }
+    
+    if (bi.torsoWeight)
+    {
+        quat torsoRotation;
+        vec3 torsoDir;
+        blendFrames(skeleton.torsoFrame, skeleton.oldTorsoFrame, skeleton.torsoFrontLerp, torsoRotation, torsoDir);
         
-        if (fullTorso)
+        if (bi.torsoWeight == 1.0f)
         {
-            angles[0] = SHORT2ANGLE(compressedTorsoBone->ofsAngles[0]);
-            angles[1] = SHORT2ANGLE(compressedTorsoBone->ofsAngles[1]);
-            angles[2] = 0;
-            angles.toAngleVectors(&vec);
+            rotation = torsoRotation;
+            dir = torsoDir;
         }
         else
         {
-            angles[0] = SHORT2ANGLE(compressedBone.ofsAngles[0]);
-            angles[1] = SHORT2ANGLE(compressedBone.ofsAngles[1]);
-            angles[2] = 0;
-            angles.toAngleVectors(&vec);
-            
-            if (isTorso)
-            {
-                vec3 torsoAngles;
-                torsoAngles[0] = SHORT2ANGLE(compressedTorsoBone->ofsAngles[0]);
-                torsoAngles[1] = SHORT2ANGLE(compressedTorsoBone->ofsAngles[1]);
-                torsoAngles[2] = 0;
-                vec3 v2;
-                torsoAngles.toAngleVectors(&v2);
-                
-                // blend the angles together
-                vec = vec3::lerp(vec, v2, bi.torsoWeight);
-            }
+            // blend the torso/legs together
+            rotation = slerp ? quat::slerp(rotation, torsoRotation, bi.torsoWeight) : quat::nlerp(rotation, torsoRotation, bi.torsoWeight);
+            dir = vec3::lerp(dir, torsoDir, bi.torsoWeight);
         }
-        
-        bone.translation = parentBone->translation + vec * bi.parentDist;
     }
-    else // just use the frame position
+    
+    Bone bone;
+    bone.rotation = rotation.toMat3();
+    
+    if (bi.parent >= 0)
+    {
+        bone.translation = skeleton.bones[bi.parent].translation + dir * bi.parentDist;
+    }
+    else if (lerp)
+    {
+        bone.translation = parentOffset(skeleton.frame) * skeleton.frontLerp + parentOffset(skeleton.oldFrame) * skeleton.backLerp;
+    }
+    else
     {
-        bone.translation = frames_[entity.frame]->parentOffset;
+        bone.translation = parentOffset(skeleton.frame);
     }
     
     return bone;
 }
 
-MDSModel::Bone MDSModel::calculateBoneLerp(const MDSFrameInfo &entity, int boneIndex, const Skeleton &skeleton) const
+void MDSModel::calculateBonesBatched(Skeleton &skeleton, bool lerp) const
 {
-    const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
-    const Bone *parentBone = nullptr;
-    
-    if (bi.parent >= 0)
-    {
-        parentBone = &skeleton.bones[bi.parent];
-    }
+    static_assert(PoseBatch::kCapacity >= MDS_MAX_BONES + 8);
+    static thread_local PoseBatch batch;
     
-    bool isTorso = false, fullTorso = false;
-    const mdsBoneFrameCompressed_t *compressedTorsoBone = nullptr, *oldCompressedTorsoBone = nullptr;
+    const int width = poseKernelWidth();
     
-    if (bi.torsoWeight)
-    {
-        compressedTorsoBone = &skeleton.torsoFrame->bones[boneIndex];
-        oldCompressedTorsoBone = &skeleton.oldTorsoFrame->bones[boneIndex];
-        isTorso = true;
-        
-        if (bi.torsoWeight == 1.0f)
-            fullTorso = true;
-    }
+    // Without lerp the new frame is used as is: frontLerp is 1.
+    batch.frontLerp = skeleton.frontLerp;
+    batch.torsoFrontLerp = skeleton.torsoFrontLerp;
     
-    const mdsBoneFrameCompressed_t &compressedBone = skeleton.frame->bones[boneIndex];
-    const mdsBoneFrameCompressed_t &oldCompressedBone = skeleton.oldFrame->bones[boneIndex];
-    Bone bone;
+    const int oldFrame = lerp ? skeleton.oldFrame : skeleton.frame;
+    const int oldTorsoFrame = lerp ? skeleton.oldTorsoFrame : skeleton.torsoFrame;
+    const int frames[4] = { oldFrame, skeleton.frame, oldTorsoFrame, skeleton.torsoFrame };
     
-    // rotation (take into account 170 to -170 lerps, which need to take the shortest route)
-    vec3 angles;
+    // The gather into the lanes stays scalar: the pose table holds a quat and a vec3 per bone,
+    // transposed into the batch one bone at a time, and the pose benchmark includes that time.
+    // A resident table is read straight from the rows of the four input frames.
+    const quat *rotationRows[4] = {};
+    const vec3 *directionRows[4] = {};
     
-    if (fullTorso)
+    if (poseTable_.resident)
     {
-        for (int i = 0; i < 3; i++)
+        for (int f = 0; f < 4; f++)
         {
-            const float a1 = SHORT2ANGLE(compressedTorsoBone->angles[i]);
-            const float a2 = SHORT2ANGLE(oldCompressedTorsoBone->angles[i]);
-            const float diff = AngleNormalize180(a1 - a2);
-            angles[i] = a1 - skeleton.torsoBackLerp * diff;
+            rotationRows[f] = &poseTable_.rotations[(size_t)frames[f] * header_->numBones];
+            directionRows[f] = &poseTable_.offsetDirs[(size_t)frames[f] * header_->numBones];
         }
     }
-    else
+    
+    for (int level = 0; level + 1 < (int)levelStarts_.size(); level++)
     {
-        for (int i = 0; i < 3; i++)
-        {
-            const float a1 = SHORT2ANGLE(compressedBone.angles[i]);
-            const float a2 = SHORT2ANGLE(oldCompressedBone.angles[i]);
-            const float diff = AngleNormalize180(a1 - a2);
-            angles[i] = a1 - skeleton.backLerp * diff;
-        }
+        const int *bones = &boneLists_[levelStarts_[level]];
+        const int count = levelStarts_[level + 1] - levelStarts_[level];
+        const int paddedCount = (count + width - 1) / width * width;
         
-        if (isTorso)
+        for (int i = 0; i < paddedCount; i++)
         {
-            vec3 torsoAngles;
+            // Padding lanes repeat the first bone, their results are ignored.
+            const int boneIndex = bones[i < count ? i : 0];
+            const mdsBoneInfo_t &bi = boneInfo_[boneIndex];
             
-            for (int i = 0; i < 3; i++)
+            // Legs only bones don't read torso frames and full torso bones don't read the legs.
+            int inputs[4] = { PoseBatch::LegsOld, PoseBatch::LegsNew, PoseBatch::TorsoOld, PoseBatch::TorsoNew };
+            
+            if (bi.torsoWeight == 0)
             {
-                const float a1 = SHORT2ANGLE(compressedTorsoBone->angles[i]);
-                const float a2 = SHORT2ANGLE(oldCompressedTorsoBone->angles[i]);
-                const float diff = AngleNormalize180(a1 - a2);
-                torsoAngles[i] = a1 - skeleton.torsoBackLerp * diff;
+                inputs[PoseBatch::TorsoOld] = PoseBatch::LegsOld;
+                inputs[PoseBatch::TorsoNew] = PoseBatch::LegsNew;
+            }
+            else if (bi.torsoWeight == 1.0f)
+            {
+                inputs[PoseBatch::LegsOld] = PoseBatch::TorsoOld;
+                inputs[PoseBatch::LegsNew] = PoseBatch::TorsoNew;
             }
             
-            // blend the angles together
-            for (int j = 0; j < 3; j++)
+            for (int f = 0; f < 4; f++)
             {
-                float diff = torsoAngles[j] - angles[j];
+                quat q;
+                vec3 dir;
                 
-                if (fabs(diff) > 180)
-                    diff = AngleNormalize180(diff);
+                if (poseTable_.resident)
+                {
+                    q = rotationRows[inputs[f]][boneIndex];
+                    dir = directionRows[inputs[f]][boneIndex];
+                }
+                else
+                {
+                    const DecodedBone decoded = decodeBone(frames_[frames[inputs[f]]]->bones[boneIndex]);
+                    q = quat::fromMat3(mat3(decoded.angles));
+                    dir = decoded.offsetDir;
+                }
                 
-                angles[j] = angles[j] + bi.torsoWeight * diff;
+                batch.rotation[f][0][i] = q.x;
+                batch.rotation[f][1][i] = q.y;
+                batch.rotation[f][2][i] = q.z;
+                batch.rotation[f][3][i] = q.w;
+                
+                for (int k = 0; k < 3; k++)
+                    batch.direction[f][k][i] = dir[k];
             }
+            
+            vec3 base;
+            
+            if (bi.parent >= 0)
+            {
+                base = skeleton.bones[bi.parent].translation;
+                batch.parentDist[i] = bi.parentDist;
+            }
+            else
+            {
+                base = parentOffset(skeleton.frame) * skeleton.frontLerp + parentOffset(oldFrame) * skeleton.backLerp;
+                batch.parentDist[i] = 0;
+            }
+            
+            for (int k = 0; k < 3; k++)
+                batch.base[k][i] = base[k];
+            
+            batch.torsoWeight[i] = bi.torsoWeight;
         }
-    }
-    
-    bone.rotation = mat3(angles);
-    
-    if (parentBone)
-    {
-        const short *sh1, *sh2;
-        
-        if (fullTorso)
-        {
-            sh1 = compressedTorsoBone->ofsAngles;
-            sh2 = oldCompressedTorsoBone->ofsAngles;
-        }
-        else
-        {
-            sh1 = compressedBone.ofsAngles;
-            sh2 = oldCompressedBone.ofsAngles;
-        }
-        
-        angles[0] = SHORT2ANGLE(sh1[0]);
-        angles[1] = SHORT2ANGLE(sh1[1]);
-        angles[2] = 0;
-        vec3 v2;
-        angles.toAngleVectors(&v2); // new
         
-        angles[0] = SHORT2ANGLE(sh2[0]);
-        angles[1] = SHORT2ANGLE(sh2[1]);
-        angles[2] = 0;
-        vec3 vec;
-        angles.toAngleVectors(&vec); // old
-        
-        // blend the angles together
-        vec3 dir;
-        
-        if (fullTorso)
-        {
-            dir = vec3::lerp(vec, v2, skeleton.torsoFrontLerp);
-        }
-        else
-        {
-            dir = vec3::lerp(vec, v2, skeleton.frontLerp);
-        }
+        evaluatePoseBatch(batch, paddedCount);
         
-        // translation
-        if (!fullTorso && isTorso)
+        for (int i = 0; i < count; i++)
         {
-            // partial legs/torso, need to lerp according to torsoWeight
-            // calc the torso frame
-            angles[0] = SHORT2ANGLE(compressedTorsoBone->ofsAngles[0]);
-            angles[1] = SHORT2ANGLE(compressedTorsoBone->ofsAngles[1]);
-            angles[2] = 0;
-            vec3 v2;
-            angles.toAngleVectors(&v2); // new
-            
-            angles[0] = SHORT2ANGLE(oldCompressedTorsoBone->ofsAngles[0]);
-            angles[1] = SHORT2ANGLE(oldCompressedTorsoBone->ofsAngles[1]);
-            angles[2] = 0;
-            vec3 vec;
-            angles.toAngleVectors(&vec); // old
-            
-            // blend the angles together
-            v2 = vec3::lerp(vec, v2, skeleton.torsoFrontLerp);
+            Bone &bone = skeleton.bones[bones[i]];
             
-            // blend the torso/legs together
-            dir = vec3::lerp(dir, v2, bi.torsoWeight);
+            for (int j = 0; j < 3; j++)
+            {
+                bone.rotation[j] = vec3(batch.outRotation[j * 3][i], batch.outRotation[j * 3 + 1][i], batch.outRotation[j * 3 + 2][i]);
+                bone.translation[j] = batch.outTranslation[j][i];
+            }
         }
         
-        bone.translation = parentBone->translation + dir * bi.parentDist;
-    }
-    else
-    {
-        // just interpolate the frame positions
-        const mdsFrame_t *frame = frames_[entity.frame], *oldFrame = frames_[entity.oldFrame];
-        bone.translation[0] = skeleton.frontLerp * frame->parentOffset[0] + skeleton.backLerp * oldFrame->parentOffset[0];
-        bone.translation[1] = skeleton.frontLerp * frame->parentOffset[1] + skeleton.backLerp * oldFrame->parentOffset[1];
-        bone.translation[2] = skeleton.frontLerp * frame->parentOffset[2] + skeleton.backLerp * oldFrame->parentOffset[2];
+        skeleton.numBonesEvaluated += count;
     }
-    
-    return bone;
 }
 
-MDSModel::Bone MDSModel::calculateBone(const MDSFrameInfo &entity, int boneIndex, const Skeleton &skeleton, bool lerp) const
+MDSModel::Bone MDSModel::calculateBone(int boneIndex, const Skeleton &skeleton, bool lerp, PoseEvalMode mode) const
 {
-    return lerp ? calculateBoneLerp(entity, boneIndex, skeleton) : calculateBoneRaw(entity, boneIndex, skeleton);
+    if (mode != PoseEvalMode::Euler)
+    {
+        return calculateBoneQuat(boneIndex, skeleton, lerp, mode == PoseEvalMode::Slerp);
+    }
+    
+    return lerp ? calculateBoneLerp(boneIndex, skeleton) : calculateBoneRaw(boneIndex, skeleton);
 }
 
-MDSModel::Skeleton MDSModel::calculateSkeleton(const MDSFrameInfo &entity, int *boneList, int nBones) const
+void MDSModel::calculateSkeleton(const MDSFrameInfo &entity, const BoneRange &range, Skeleton &skeleton, PoseEvalMode mode, AnglePrecision precision, bool branching) const
 {
-    assert(boneList);
-    Skeleton skeleton;
+    const int *boneList = &boneLists_[range.first];
+    const int nBones = range.count;
+    skeleton.numBonesEvaluated = 0;
     
     if (entity.oldFrame == entity.frame)
     {
@@ -563,33 +1641,35 @@ MDSModel::Skeleton MDSModel::calculateSkeleton(const MDSFrameInfo &entity, int *
     }
     
     
-    skeleton.frame = frames_[entity.frame];
-    skeleton.oldFrame = frames_[entity.oldFrame];
-    skeleton.torsoFrame = entity.torsoFrame >= 0 && entity.torsoFrame < (int)frames_.size() ? frames_[entity.torsoFrame] : nullptr;
-    skeleton.oldTorsoFrame = entity.oldTorsoFrame >= 0 && entity.oldTorsoFrame < (int)frames_.size() ? frames_[entity.oldTorsoFrame] : nullptr;
+    skeleton.frame = entity.frame;
+    skeleton.oldFrame = entity.oldFrame;
+    skeleton.torsoFrame = entity.torsoFrame >= 0 && entity.torsoFrame < (int)frames_.size() ? entity.torsoFrame : -1;
+    skeleton.oldTorsoFrame = entity.oldTorsoFrame >= 0 && entity.oldTorsoFrame < (int)frames_.size() ? entity.oldTorsoFrame : -1;
     
-    // Lerp all the needed bones (torsoParent is always the first bone in the list).
-    int *boneRefs = boneList;
+    // Lerp all the needed bones, the list is ordered parents first.
+    const int *boneRefs = boneList;
     mat3 torsoRotation(entity.torsoRotation);
     torsoRotation.transpose();
     const bool lerp = skeleton.backLerp || skeleton.torsoBackLerp;
     
-    for (int i = 0; i < nBones; i++, boneRefs++)
+    if (mode == PoseEvalMode::NlerpSimd)
     {
-        if (skeleton.boneCalculated[*boneRefs])
-            continue;
-        
-        // find our parent, and make sure it has been calculated
-        const int parentBoneIndex = boneInfo_[*boneRefs].parent;
-        
-        if (parentBoneIndex >= 0 && !skeleton.boneCalculated[parentBoneIndex])
+        // The batched kernel always builds the full skeleton.
+        calculateBonesBatched(skeleton, lerp);
+    }
+    else if (mode == PoseEvalMode::Euler && !branching)
+    {
+        evaluateBuckets(range, skeleton, lerp, precision);
+        skeleton.numBonesEvaluated = nBones;
+    }
+    else
+    {
+        for (int i = 0; i < nBones; i++, boneRefs++)
         {
-            skeleton.bones[parentBoneIndex] = calculateBone(entity, parentBoneIndex, skeleton, lerp);
-            skeleton.boneCalculated[parentBoneIndex] = true;
+            skeleton.bones[*boneRefs] = calculateBone(*boneRefs, skeleton, lerp, mode);
         }
         
-        skeleton.bones[*boneRefs] = calculateBone(entity, *boneRefs, skeleton, lerp);
-        skeleton.boneCalculated[*boneRefs] = true;
+        skeleton.numBonesEvaluated = nBones;
     }
     
     // Get the torso parent.
@@ -660,25 +1740,149 @@ MDSModel::Skeleton MDSModel::calculateSkeleton(const MDSFrameInfo &entity, int *
             }
         }
     }
+}
+
+MDSModel::PoseBenchmark MDSModel::benchmarkPoseModes() const
+{
+    PoseBenchmark result;
+    
+    if (frames_.size() < 2) return result;
+    
+    auto reference = std::make_unique<Skeleton>();
+    auto skeleton = std::make_unique<Skeleton>();
+    
+    // Half way between every pair of neighbouring frames.
+    auto frameInfo = [](int frame)
+    {
+        MDSFrameInfo entity;
+        entity.oldFrame = entity.oldTorsoFrame = frame;
+        entity.frame = entity.torsoFrame = frame + 1;
+        entity.lerp = entity.torsoLerp = 0.5f;
+        return entity;
+    };
+    
+    const int numFrames = (int)frames_.size() - 1;
+    result.numPoses = numFrames;
+    
+    for (int m = 0; m < (int)PoseEvalMode::Count; m++)
+    {
+        const PoseEvalMode mode = (PoseEvalMode)m;
+        auto start = std::chrono::steady_clock::now();
+        
+        for (int i = 0; i < numFrames; i++)
+        {
+            calculateSkeleton(frameInfo(i), allBones_, *skeleton, mode);
+        }
+        
+        result.msPerPose[m] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / numFrames;
+        
+        for (int i = 0; i < numFrames; i++)
+        {
+            calculateSkeleton(frameInfo(i), allBones_, *reference, PoseEvalMode::Euler);
+            calculateSkeleton(frameInfo(i), allBones_, *skeleton, mode);
+            
+            for (int boneIndex = 0; boneIndex < header_->numBones; boneIndex++)
+            {
+                const Bone &a = reference->bones[boneIndex];
+                const Bone &b = skeleton->bones[boneIndex];
+                
+                for (int j = 0; j < 3; j++)
+                {
+                    result.maxTranslationError[m] = std::max(result.maxTranslationError[m], fabsf(a.translation[j] - b.translation[j]));
+                    
+                    for (int k = 0; k < 3; k++)
+                    {
+                        result.maxRotationError[m] = std::max(result.maxRotationError[m], fabsf(a.rotation[j][k] - b.rotation[j][k]));
+                    }
+                }
+            }
+        }
+    }
+    
+    // The Euler poses with every angle precision.
+    for (int p = 0; p < (int)AnglePrecision::Count; p++)
+    {
+        const AnglePrecision precision = (AnglePrecision)p;
+        auto start = std::chrono::steady_clock::now();
+        
+        for (int i = 0; i < numFrames; i++)
+        {
+            calculateSkeleton(frameInfo(i), allBones_, *skeleton, PoseEvalMode::Euler, precision);
+        }
+        
+        result.msPerPosePrecision[p] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / numFrames;
+        
+        for (int i = 0; i < numFrames; i++)
+        {
+            calculateSkeleton(frameInfo(i), allBones_, *reference, PoseEvalMode::Euler);
+            calculateSkeleton(frameInfo(i), allBones_, *skeleton, PoseEvalMode::Euler, precision);
+            
+            for (int boneIndex = 0; boneIndex < header_->numBones; boneIndex++)
+            {
+                const Bone &a = reference->bones[boneIndex];
+                const Bone &b = skeleton->bones[boneIndex];
+                
+                for (int j = 0; j < 3; j++)
+                {
+                    result.maxPrecisionTranslationError[p] = std::max(result.maxPrecisionTranslationError[p], fabsf(a.translation[j] - b.translation[j]));
+                    
+                    for (int k = 0; k < 3; k++)
+                    {
+                        result.maxPrecisionRotationError[p] = std::max(result.maxPrecisionRotationError[p], fabsf(a.rotation[j][k] - b.rotation[j][k]));
+                    }
+                }
+            }
+        }
+    }
+    
+    // The same Euler poses with the per bone branching evaluators.
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < numFrames; i++)
+    {
+        calculateSkeleton(frameInfo(i), allBones_, *skeleton, PoseEvalMode::Euler, AnglePrecision::Exact, true);
+    }
+    
+    result.msPerPoseBranching = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / numFrames;
+    
+    for (int i = 0; i < numFrames; i++)
+    {
+        calculateSkeleton(frameInfo(i), allBones_, *reference, PoseEvalMode::Euler);
+        calculateSkeleton(frameInfo(i), allBones_, *skeleton, PoseEvalMode::Euler, AnglePrecision::Exact, true);
+        
+        for (int boneIndex = 0; boneIndex < header_->numBones; boneIndex++)
+        {
+            const Bone &a = reference->bones[boneIndex];
+            const Bone &b = skeleton->bones[boneIndex];
+            
+            for (int j = 0; j < 3; j++)
+            {
+                result.maxBranchingError = std::max(result.maxBranchingError, fabsf(a.translation[j] - b.translation[j]));
+                
+                for (int k = 0; k < 3; k++)
+                {
+                    result.maxBranchingError = std::max(result.maxBranchingError, fabsf(a.rotation[j][k] - b.rotation[j][k]));
+                }
+            }
+        }
+    }
     
-    return skeleton;
+    return result;
 }
 
 int MDSModel::numSurfaces() const
 {
-    auto header = (mdsHeader_t *)data_.data();
-    return header->numSurfaces;
+    return header_->numSurfaces;
 }
 
 int MDSModel::surfaceNumVertices(int surfaceIndex) const
 {
-    auto header = (mdsHeader_t *)data_.data();
-    auto surface = (mdsSurface_t *)(data_.data() + header->ofsSurfaces);
+    auto surface = (const mdsSurface_t *)(file_.data() + header_->ofsSurfaces);
     
-    for (int i = 0; i < header->numSurfaces; i++)
+    for (int i = 0; i < header_->numSurfaces; i++)
     {
         if (i == surfaceIndex) return surface->numVerts;
-        surface = (mdsSurface_t *)((uint8_t *)surface + surface->ofsEnd);
+        surface = (const mdsSurface_t *)((const uint8_t *)surface + surface->ofsEnd);
     }
     
     return 0;
@@ -686,32 +1890,18 @@ int MDSModel::surfaceNumVertices(int surfaceIndex) const
 
 int MDSModel::surfaceNumTriangles(int surfaceIndex) const
 {
-    auto header = (mdsHeader_t *)data_.data();
-    auto surface = (mdsSurface_t *)(data_.data() + header->ofsSurfaces);
+    auto surface = (const mdsSurface_t *)(file_.data() + header_->ofsSurfaces);
     
-    for (int i = 0; i < header->numSurfaces; i++)
+    for (int i = 0; i < header_->numSurfaces; i++)
     {
         if (i == surfaceIndex) return surface->numTriangles;
-        surface = (mdsSurface_t *)((uint8_t *)surface + surface->ofsEnd);
+        surface = (const mdsSurface_t *)((const uint8_t *)surface + surface->ofsEnd);
     }
     
     return 0;
 }
 
-void MDSModel::recursiveBoneListAdd(int boneIndex, int *boneList, int *nBones) const
-{
-    assert(boneList);
-    assert(nBones);
-
-    if (boneInfo_[boneIndex].parent >= 0)
-    {
-        recursiveBoneListAdd(boneInfo_[boneIndex].parent, boneList, nBones);
-    }
-
-    boneList[(*nBones)++] = boneIndex;
-}
-
-int MDSModel::lerpTag(const char *name, const MDSFrameInfo &entity, int startIndex, Transform *transform) const
+int MDSModel::lerpTag(const char *name, const Skeleton &skeleton, int startIndex, Transform *transform) const
 {
     assert(transform);
     
@@ -721,15 +1911,7 @@ int MDSModel::lerpTag(const char *name, const MDSFrameInfo &entity, int startInd
         
         if (i >= startIndex && !strcmp(tags_[i].name, name))
         {
-            // Now build the list of bones we need to calc to get this tag's bone information.
-            int boneList[MDS_MAX_BONES];
-            int nBones = 0;
-            recursiveBoneListAdd(tags_[i].boneIndex, boneList, &nBones);
-            
-            // Calculate the skeleton.
-            Skeleton skeleton = calculateSkeleton(entity, boneList, nBones);
-            
-            // Now extract the transform for the bone that represents our tag.
+            // The pose already holds every bone, just extract the one that represents our tag.
             transform->position = skeleton.bones[tag.boneIndex].translation;
             transform->rotation = skeleton.bones[tag.boneIndex].rotation;
             return i;
@@ -741,13 +1923,11 @@ int MDSModel::lerpTag(const char *name, const MDSFrameInfo &entity, int startInd
 
 MDSModel::~MDSModel()
 {
-    for (const auto& [mesh, texture] : m_textures)
-    {
-        glDeleteTextures(1, &texture);
-    }
-    
     for (const auto& drawCall : m_drawCallList)
     {
+        // Never uploaded, e.g. loaded by the cooker without a GL context.
+        if (drawCall.vao == 0) continue;
+        
         glDeleteBuffers(1, &drawCall.ibo);
         glDeleteBuffers(1, &drawCall.vbo);
         glDeleteVertexArrays(1, &drawCall.vao);
@@ -14,8 +14,11 @@
 #include "MDSFile.h"
 #include "DrawCall.h"
 #include "Shader.h"
+#include "FileSystem.h"
+#include "CookedCache.h"
 
-struct SkinFile;
+struct SkinTextures;
+class UniformRingBuffer;
 
 struct MDSFrameInfo
 {
@@ -26,21 +29,26 @@ struct MDSFrameInfo
     mat3 torsoRotation;
 };
 
+enum class PoseEvalMode
+{
+    Euler,      // lerp the angles per component, like the game does
+    Nlerp,      // normalized lerp of quaternions
+    Slerp,      // spherical lerp of quaternions
+    NlerpSimd,  // normalized lerp, a whole hierarchy level per batch
+    Count
+};
+
+/// How the Euler evaluators turn the 16-bit angles of the file into rotations.
+enum class AnglePrecision
+{
+    Exact,      // float angles, libm trig
+    Table,      // float angles lerped, then quantized to 16 bits for the sin table
+    ShortLerp,  // fixed point lerp of the 16-bit angles, sin table, no pose table reads
+    Count
+};
+
 struct MDSModel
 {
-    void loadFromFile(const std::string& filename, const SkinFile &skin);
-    void render(const glm::mat4 &mvp, const MDSFrameInfo &entity);
-    int lerpTag(const char *name, const MDSFrameInfo &entity, int startIndex, Transform *transform) const;
-    
-    ~MDSModel();
-    
-private:
-    std::vector<uint8_t> data_;
-    const mdsHeader_t *header_;
-    const mdsBoneInfo_t *boneInfo_;
-    std::vector<const mdsFrame_t *> frames_;
-    const mdsTag_t *tags_;
-    
     struct Bone
     {
         mat3 rotation;
@@ -50,26 +58,241 @@ private:
     struct Skeleton
     {
         Bone bones[MDS_MAX_BONES];
-        bool boneCalculated[MDS_MAX_BONES] = { false };
-        const mdsFrame_t *frame, *oldFrame;
-        const mdsFrame_t *torsoFrame, *oldTorsoFrame;
+        int frame, oldFrame;
+        int torsoFrame, oldTorsoFrame;
         float frontLerp, backLerp;
         float torsoFrontLerp, torsoBackLerp;
+        
+        /// How many bones calculateSkeleton had to lerp to build this pose.
+        int numBonesEvaluated = 0;
+    };
+    
+    enum class BoneClass : uint8_t
+    {
+        Root,           // no parent, placed at the frame's parentOffset
+        Legs,           // follows the legs frames only
+        FullTorso,      // follows the torso frames only
+        PartialTorso,   // blend of legs and torso by torsoWeight
+        Tag
+    };
+    
+    /// A list of bones ordered parents first, indexes boneLists_.
+    /// The same bones are also split in runs of one evaluator class, see boneBuckets_.
+    struct BoneRange
+    {
+        int first = 0;
+        int count = 0;
+        int firstBucket = 0;
+        int numBuckets = 0;
+    };
+    
+    /// The CPU part of loading: file, pose data and vertices. Can run on any thread.
+    /// Textures aren't part of the model, they come with the skin, see SkinTextures.
+    void load(const std::string& filename);
+    
+    /// GL objects are created in small steps on the main thread once load is done.
+    /// Steps already done, by another character sharing the model, are skipped.
+    int numUploadSteps() const;
+    void uploadStep(int step);
+    
+    /// Evaluate every bone of the model once. Surfaces and tags read from the result.
+    void calculatePose(const MDSFrameInfo &entity, Skeleton &skeleton) const;
+    
+    /// Evaluate only the given bones, e.g. just what a surface or tag needs.
+    void calculatePose(const MDSFrameInfo &entity, const BoneRange &bones, Skeleton &skeleton) const;
+    
+    BoneRange surfaceBones(int surfaceIndex) const { return surfaceBones_[surfaceIndex]; }
+    BoneRange tagBones(const char *name) const;
+    BoneClass boneClass(int boneIndex) const { return boneClasses_[boneIndex]; }
+    
+    /// Size of the BonePalette uniform block in mds.glsl.
+    static constexpr size_t kBonePaletteSize = MDS_MAX_BONES * sizeof(glm::mat4);
+    
+    /// Stage the bone palette of every surface in the ring, offsets are used by render.
+    void writeBonePalettes(const Skeleton &skeleton, UniformRingBuffer &ring, std::vector<size_t> &offsets) const;
+    
+    void render(const glm::mat4 &mvp, const SkinTextures &skin, const UniformRingBuffer &ring, const std::vector<size_t> &offsets, int lod = 0);
+    int lerpTag(const char *name, const Skeleton &skeleton, int startIndex, Transform *transform) const;
+    
+    /// How calculatePose interpolates bone rotations.
+    static inline PoseEvalMode poseEvalMode = PoseEvalMode::Euler;
+    static inline AnglePrecision anglePrecision = AnglePrecision::Exact;
+    
+    struct PoseBenchmark
+    {
+        int numPoses = 0;
+        
+        // Indexed by PoseEvalMode, errors are measured against the Euler path.
+        float msPerPose[(int)PoseEvalMode::Count] = {};
+        float maxRotationError[(int)PoseEvalMode::Count] = {};
+        float maxTranslationError[(int)PoseEvalMode::Count] = {};
+        
+        // The Euler mode with each AnglePrecision, errors against Exact.
+        float msPerPosePrecision[(int)AnglePrecision::Count] = {};
+        float maxPrecisionRotationError[(int)AnglePrecision::Count] = {};
+        float maxPrecisionTranslationError[(int)AnglePrecision::Count] = {};
+        
+        // The Euler mode with the per bone branching evaluators, for comparison.
+        float msPerPoseBranching = 0;
+        float maxBranchingError = 0;
+    };
+    
+    /// Levels of detail built from the collapse maps at load, level 0 is the full mesh. A level
+    /// keeps a fraction of the vertices of every surface, like render_count in RB_SurfaceAnim,
+    /// but never less than the surface's minLod.
+    static constexpr int kNumLods = 4;
+    static constexpr float kLodFractions[kNumLods] = { 1.0f, 0.7f, 0.45f, 0.25f };
+    
+    /// r_lodscale and r_lodbias.
+    static inline float lodScale = 5.0f;
+    static inline float lodBias = 0.0f;
+    static inline bool useLods = true;
+    
+    /// Like RB_CalcMDSLod: the fraction of the vertices the game draws of a model whose
+    /// bounding sphere covers `projectedRadius` of the half screen height, 0 if it is behind.
+    float lodFraction(float projectedRadius) const;
+    
+    /// The coarsest level that still keeps lodFraction of the vertices.
+    int lodLevel(float projectedRadius) const;
+    
+    /// The bounding sphere of a frame.
+    void frameBounds(int frame, vec3 &origin, float &radius) const;
+    
+    int numLodTriangles(int lod) const;
+    
+    /// Evaluate a pose between every pair of frames with each mode.
+    PoseBenchmark benchmarkPoseModes() const;
+    
+    /// Pose tables bigger than this aren't kept, bones are decoded from the file every frame instead.
+    static inline size_t poseTableBudget = 64 * 1024 * 1024;
+    
+    size_t poseTableBytes() const { return poseTable_.bytes; }
+    bool poseTableResident() const { return poseTable_.resident; }
+    float poseTableDecodeMs() const { return poseTable_.decodeMs; }
+    
+    /// False if the file was missing or broken.
+    bool loaded() const { return loaded_; }
+    
+    size_t fileBytes() const { return file_.size(); }
+    bool fileMapped() const { return file_.mapped; }
+    float loadMs() const { return loadMs_; }
+    
+    /// Surfaces and pose table came from an up to date cooked file.
+    bool cooked() const { return !cooked_.empty(); }
+    
+    /// Growth of the process resident set while the model data was loaded.
+    size_t loadResidentBytes() const { return loadResidentBytes_; }
+    
+    ~MDSModel();
+    
+private:
+    FileData file_;
+    CookedFile cooked_;
+    bool loaded_ = false;
+    float loadMs_ = 0;
+    size_t loadResidentBytes_ = 0;
+    
+    const mdsHeader_t *header_ = nullptr;
+    const mdsBoneInfo_t *boneInfo_ = nullptr;
+    std::vector<const mdsFrame_t *> frames_;
+    const mdsTag_t *tags_ = nullptr;
+    
+    /// Bone lists computed at load. It starts with all the bones in evaluation order,
+    /// grouped by depth: level i is [levelStarts_[i], levelStarts_[i + 1]).
+    /// Surface and tag subsets follow, each one in evaluation order as well.
+    std::vector<int> boneLists_;
+    std::vector<int> levelStarts_;
+    BoneRange allBones_;
+    std::vector<BoneRange> surfaceBones_;
+    std::vector<BoneRange> tagBones_;
+    BoneClass boneClasses_[MDS_MAX_BONES];
+    
+    /// A run of bones evaluated by the same specialised evaluator.
+    /// The class is Root, Legs, FullTorso or PartialTorso, tags are evaluated like any other bone.
+    struct BoneBucket
+    {
+        BoneClass evaluator;
+        int first;
+        int count;
     };
     
-    void recursiveBoneListAdd(int boneIndex, int *boneList, int *nBones) const;
-    Bone calculateBoneRaw(const MDSFrameInfo &entity, int boneIndex, const Skeleton &skeleton) const;
-    Bone calculateBoneLerp(const MDSFrameInfo &entity, int boneIndex, const Skeleton &skeleton) const;
-    Bone calculateBone(const MDSFrameInfo &entity, int boneIndex, const Skeleton &skeleton, bool lerp) const;
-    Skeleton calculateSkeleton(const MDSFrameInfo &entity, int *boneList, int nBones) const;
+    std::vector<BoneBucket> boneBuckets_;
+    
+    bool surfacesInBounds() const;
+    void buildBoneHierarchy();
+    BoneClass evaluatorClass(int boneIndex) const;
+    
+    struct DecodedBone
+    {
+        vec3 angles;
+        vec3 offsetDir;         // direction from the parent bone
+    };
+    
+    /// Every bone of every frame decoded at load, indexed by frame * numBones + bone.
+    /// Points into the decoded buffers or straight into the cooked file.
+    struct PoseTable
+    {
+        std::span<const vec3> angles;
+        std::span<const quat> rotations;
+        std::span<const vec3> offsetDirs;
+        std::span<const vec3> parentOffsets;    // per frame
+        
+        std::shared_ptr<const void> owner;
+        
+        size_t bytes = 0;
+        float decodeMs = 0;
+        bool resident = false;
+    };
+    
+    PoseTable poseTable_;
+    
+    static DecodedBone decodeBone(const mdsBoneFrameCompressed_t &compressedBone);
+    DecodedBone decodedBone(int frame, int boneIndex) const;
+    quat decodedRotation(int frame, int boneIndex) const;
+    const vec3 &parentOffset(int frame) const;
+    void buildPoseTable();
+    
+    void buildSurfaces();
+    void buildLods(const mdsSurface_t *surface, DrawCall &drawCall);
+    bool loadCooked(const CookedFile &cooked);
+    void cook(const CookedCache::Key &key) const;
+    
+    Bone calculateBoneRaw(int boneIndex, const Skeleton &skeleton) const;
+    Bone calculateBoneLerp(int boneIndex, const Skeleton &skeleton) const;
+    
+    template<BoneClass Blend, bool Lerp>
+    void blendBoneFrames(int boneIndex, const Skeleton &skeleton, vec3 &angles, vec3 &dir) const;
+    template<BoneClass Blend, bool Lerp>
+    void blendBoneFramesShort(int boneIndex, const Skeleton &skeleton, uint16_t angles[3], vec3 &dir) const;
+    template<BoneClass Blend, bool Lerp, AnglePrecision Precision>
+    void blendBone(int boneIndex, const Skeleton &skeleton, mat3 &rotation, vec3 &dir) const;
+    template<BoneClass Class, bool Lerp, AnglePrecision Precision>
+    Bone evaluateBone(int boneIndex, const Skeleton &skeleton) const;
+    template<BoneClass Class, bool Lerp, AnglePrecision Precision>
+    void evaluateBucket(const int *bones, int count, Skeleton &skeleton) const;
+    template<AnglePrecision Precision>
+    void evaluateBuckets(const BoneRange &range, Skeleton &skeleton, bool lerp) const;
+    void evaluateBuckets(const BoneRange &range, Skeleton &skeleton, bool lerp, AnglePrecision precision) const;
+    
+    Bone calculateBoneQuat(int boneIndex, const Skeleton &skeleton, bool lerp, bool slerp) const;
+    Bone calculateBone(int boneIndex, const Skeleton &skeleton, bool lerp, PoseEvalMode mode) const;
+    void calculateBonesBatched(Skeleton &skeleton, bool lerp) const;
+    void calculateSkeleton(const MDSFrameInfo &entity, const BoneRange &range, Skeleton &skeleton, PoseEvalMode mode, AnglePrecision precision = AnglePrecision::Exact, bool branching = false) const;
     
     // Render stuff
 private:
-    std::unordered_map<std::string, unsigned int> m_textures;
-    std::vector<glm::mat4> m_transforms{MDS_MAX_BONES};
     Shader m_shader;
+    Shader::Uniform<glm::mat4> m_uMVP;
     DrawCallList m_drawCallList;
     
+    /// Vertices and indices of all the surfaces, in the cooked file or converted at load.
+    std::span<const Vertex2> vertexData_;
+    std::span<const uint16_t> indexData_;
+    std::vector<Vertex2> vertices_;
+    std::vector<uint16_t> indices_;
+    
+    void uploadSurface(DrawCall &drawCall);
+    
     int numSurfaces() const;
     int surfaceNumVertices(int surfaceIndex) const;
     int surfaceNumTriangles(int surfaceIndex) const;
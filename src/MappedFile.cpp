@@ -0,0 +1,148 @@
+//
+//  MappedFile.cpp
+//  wolfmv
+//
+
+#include "MappedFile.h"
+
+#include <cstdio>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator =(MappedFile&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        mapping_ = std::exchange(other.mapping_, nullptr);
+        fallback_ = std::move(other.fallback_);
+    }
+    
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& filename)
+{
+    close();
+    
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = nullptr;
+        
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        }
+        
+        // The view keeps the mapping alive.
+        if (mapping)
+        {
+            mapping_ = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        
+        CloseHandle(file);
+        
+        if (mapping_)
+        {
+            data_ = (const uint8_t *)mapping_;
+            size_ = (size_t)fileSize.QuadPart;
+            return true;
+        }
+    }
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    
+    if (fd != -1)
+    {
+        struct stat st;
+        
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            
+            if (ptr != MAP_FAILED)
+            {
+                mapping_ = ptr;
+                data_ = (const uint8_t *)ptr;
+                size_ = st.st_size;
+            }
+        }
+        
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+        
+        if (mapping_) return true;
+    }
+#endif
+    
+    FILE* fp = fopen(filename.c_str(), "rb");
+    
+    if (fp == nullptr)
+    {
+        printf("unable to open %s\n", filename.c_str());
+        return false;
+    }
+    
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    fallback_.resize(size > 0 ? size : 0);
+    
+    if (!fallback_.empty() && fread(fallback_.data(), fallback_.size(), 1, fp) != 1)
+    {
+        fallback_.clear();
+    }
+    
+    fclose(fp);
+    
+    data_ = fallback_.data();
+    size_ = fallback_.size();
+    
+    return size_ > 0;
+}
+
+void MappedFile::close()
+{
+    if (mapping_)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(mapping_);
+#else
+        munmap(mapping_, size_);
+#endif
+    }
+    
+    mapping_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+    fallback_ = std::vector<uint8_t>();
+}
@@ -0,0 +1,43 @@
+//
+//  MappedFile.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A read-only file mapped into memory. Models keep pointers straight into
+// the mapping, so their data costs page cache instead of a private heap copy.
+// Falls back to reading the file when it can't be mapped.
+
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator =(const MappedFile&) = delete;
+    
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator =(MappedFile&& other) noexcept;
+    
+    ~MappedFile();
+    
+    bool open(const std::string& filename);
+    void close();
+    
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool isMapped() const { return mapping_ != nullptr; }
+    
+private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    
+    void *mapping_ = nullptr;
+    std::vector<uint8_t> fallback_;
+};
@@ -58,6 +58,25 @@ namespace math {
         return fabs(a - b) < epsilon;
     }
     
+    /// sin of 16-bit angles, 65536 units per turn. The extra quarter turn gives cos without wrapping.
+    extern float shortSinTable[65536 + 16384];
+    
+    inline float SinShort(uint16_t angle)
+    {
+        return shortSinTable[angle];
+    }
+    
+    inline float CosShort(uint16_t angle)
+    {
+        return shortSinTable[angle + 16384];
+    }
+    
+    /// Quantize degrees to a 16-bit angle, wrapping around.
+    inline uint16_t AngleToShort(float angle)
+    {
+        return (uint16_t)((int)lrintf(angle * (65536 / 360.0f)) & 65535);
+    }
+    
     typedef union {
         float f;
         int i;
@@ -220,6 +239,9 @@ namespace math {
         
         vec3 toAngles() const;
         void toAngleVectors(vec3 *forward, vec3 *right = 0, vec3 *up = 0) const;
+        
+        /// toAngleVectors for 16-bit angles, uses the sin table instead of libm.
+        static void shortAngleVectors(const uint16_t angles[3], vec3 *forward, vec3 *right = 0, vec3 *up = 0);
         vec3 rotated(const vec3 &direction, float degrees) const;
         vec3 rotatedAroundDirection(vec3 direction, float degrees) const;
         vec3 inverse() const;
@@ -505,6 +527,7 @@ namespace math {
         static mat3 rotationX(float degrees);
         static mat3 rotationY(float degrees);
         static mat3 rotationZ(float degrees);
+        static mat3 fromShortAngles(const uint16_t angles[3]);
         
         static const mat3 identity;
         
@@ -565,6 +588,27 @@ namespace math {
         float e_[16];
     };
     
+    class quat
+    {
+    public:
+        quat() : x(0), y(0), z(0), w(1) {}
+        quat(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+        
+        /// Rotation of an axis matrix (rows are the forward, left and up axes).
+        static quat fromMat3(const mat3 &m);
+        mat3 toMat3() const;
+        
+        static float dotProduct(const quat &q1, const quat &q2);
+        
+        /// Normalized lerp along the shortest arc.
+        static quat nlerp(const quat &from, const quat &to, float fraction);
+        static quat slerp(const quat &from, const quat &to, float fraction);
+        
+        float normalize();
+        
+        float x, y, z, w;
+    };
+    
     struct Transform
     {
         vec3 position;
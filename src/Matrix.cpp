@@ -34,6 +34,17 @@ namespace math {
         rows_[1] = vec3::empty - right;
     }
     
+    mat3 mat3::fromShortAngles(const uint16_t angles[3])
+    {
+        mat3 m;
+        vec3 right;
+        
+        vec3::shortAngleVectors(angles, &m.rows_[0], &right, &m.rows_[2]);
+        m.rows_[1] = vec3::empty - right;
+        
+        return m;
+    }
+    
     mat3::mat3(const mat4 &m)
     {
         rows_[0] = vec3(m[0], m[1], m[2]);
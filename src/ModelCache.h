@@ -0,0 +1,61 @@
+//
+//  ModelCache.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "FileSystem.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Loaded models by canonical path, shared by every character that uses them.
+// A model stays alive while somebody holds it, so picking another skin of
+// the open character finds the body and head of the current one. Models
+// are loaded under the lock: two characters never parse the same file twice.
+// Only loaded models are kept, a file that failed is read again next time.
+
+template<typename Model>
+class ModelCache
+{
+public:
+    static ModelCache& instance()
+    {
+        static ModelCache cache;
+        return cache;
+    }
+    
+    /// The model, loaded on the CPU if it isn't alive yet. `reused` tells which one it was.
+    std::shared_ptr<Model> get(const std::string& filename, bool *reused = nullptr)
+    {
+        const std::string key = FileSystem::instance().canonicalPath(filename);
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        auto it = models_.find(key);
+        std::shared_ptr<Model> model = it != models_.end() ? it->second.lock() : nullptr;
+        
+        if (reused) *reused = model != nullptr;
+        
+        if (model) return model;
+        
+        // Forget the models nobody holds anymore.
+        std::erase_if(models_, [](const auto& entry) { return entry.second.expired(); });
+        
+        model = std::make_shared<Model>();
+        model->load(filename);
+        
+        if (model->loaded()) models_[key] = model;
+        
+        return model;
+    }
+    
+private:
+    ModelCache() = default;
+    
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<Model>> models_;
+};
@@ -0,0 +1,132 @@
+//
+//  PoseKernel.cpp
+//  wolfmv
+//
+
+#include "PoseKernelImpl.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define POSE_KERNEL_X86 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace {
+
+    struct ScalarLanes
+    {
+        static constexpr int width = 1;
+        float v;
+
+        static ScalarLanes load(const float *p) { return { *p }; }
+        static ScalarLanes set1(float f) { return { f }; }
+        void store(float *p) const { *p = v; }
+
+        static ScalarLanes sqrt(ScalarLanes a) { return { sqrtf(a.v) }; }
+        static ScalarLanes flipSign(ScalarLanes a, ScalarLanes b) { return { b.v < 0 ? -a.v : a.v }; }
+
+        ScalarLanes operator+(ScalarLanes b) const { return { v + b.v }; }
+        ScalarLanes operator-(ScalarLanes b) const { return { v - b.v }; }
+        ScalarLanes operator*(ScalarLanes b) const { return { v * b.v }; }
+        ScalarLanes operator/(ScalarLanes b) const { return { v / b.v }; }
+    };
+
+#ifdef POSE_KERNEL_X86
+    struct Sse2Lanes
+    {
+        static constexpr int width = 4;
+        __m128 v;
+
+        static Sse2Lanes load(const float *p) { return { _mm_load_ps(p) }; }
+        static Sse2Lanes set1(float f) { return { _mm_set1_ps(f) }; }
+        void store(float *p) const { _mm_store_ps(p, v); }
+
+        static Sse2Lanes sqrt(Sse2Lanes a) { return { _mm_sqrt_ps(a.v) }; }
+
+        static Sse2Lanes flipSign(Sse2Lanes a, Sse2Lanes b)
+        {
+            return { _mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f))) };
+        }
+
+        Sse2Lanes operator+(Sse2Lanes b) const { return { _mm_add_ps(v, b.v) }; }
+        Sse2Lanes operator-(Sse2Lanes b) const { return { _mm_sub_ps(v, b.v) }; }
+        Sse2Lanes operator*(Sse2Lanes b) const { return { _mm_mul_ps(v, b.v) }; }
+        Sse2Lanes operator/(Sse2Lanes b) const { return { _mm_div_ps(v, b.v) }; }
+    };
+#endif
+
+    using PoseKernelFn = void (*)(PoseBatch &, int);
+
+    struct PoseKernel
+    {
+        PoseKernelFn evaluate;
+        int width;
+        const char *name;
+    };
+
+    bool cpuSupportsAvx2()
+    {
+#if defined(POSE_KERNEL_AVX2) && (defined(__GNUC__) || defined(__clang__))
+        return __builtin_cpu_supports("avx2");
+#elif defined(POSE_KERNEL_AVX2) && defined(_MSC_VER)
+        int info[4];
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    PoseKernel selectKernel()
+    {
+        if (cpuSupportsAvx2())
+        {
+            return { evaluatePoseBatchAvx2, 8, "AVX2" };
+        }
+
+#ifdef POSE_KERNEL_X86
+        return { evaluatePoseBatchSse2, 4, "SSE2" };
+#else
+        return { evaluatePoseBatchScalar, 1, "scalar" };
+#endif
+    }
+
+    const PoseKernel &kernel()
+    {
+        static const PoseKernel selected = selectKernel();
+        return selected;
+    }
+}
+
+void evaluatePoseBatchScalar(PoseBatch &batch, int count)
+{
+    evaluatePoseLanes<ScalarLanes>(batch, count);
+}
+
+void evaluatePoseBatchSse2(PoseBatch &batch, int count)
+{
+#ifdef POSE_KERNEL_X86
+    evaluatePoseLanes<Sse2Lanes>(batch, count);
+#else
+    evaluatePoseBatchScalar(batch, count);
+#endif
+}
+
+int poseKernelWidth()
+{
+    return kernel().width;
+}
+
+const char *poseKernelName()
+{
+    return kernel().name;
+}
+
+void evaluatePoseBatch(PoseBatch &batch, int count)
+{
+    kernel().evaluate(batch, count);
+}
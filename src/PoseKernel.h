@@ -0,0 +1,44 @@
+//
+//  PoseKernel.h
+//  wolfmv
+//
+
+#pragma once
+
+// Batched bone evaluation from decoded pose data. All bones of a batch must
+// be independent of each other (one depth level of the hierarchy), their
+// parents are already evaluated and passed in as the base translation.
+//
+//   rotation    = nlerp(nlerp(legs), nlerp(torso), torsoWeight)
+//   translation = base + lerp(lerp(legs dir), lerp(torso dir), torsoWeight) * parentDist
+
+struct PoseBatch
+{
+    // Room for MDS_MAX_BONES plus padding up to the widest kernel.
+    static constexpr int kCapacity = 128 + 8;
+
+    enum { LegsOld, LegsNew, TorsoOld, TorsoNew };
+
+    alignas(32) float rotation[4][4][kCapacity];    // [frame][x, y, z, w][bone]
+    alignas(32) float direction[4][3][kCapacity];   // [frame][x, y, z][bone]
+    alignas(32) float base[3][kCapacity];
+    alignas(32) float parentDist[kCapacity];
+    alignas(32) float torsoWeight[kCapacity];
+
+    float frontLerp;
+    float torsoFrontLerp;
+
+    alignas(32) float outRotation[9][kCapacity];    // axis rows, like mat3
+    alignas(32) float outTranslation[3][kCapacity];
+};
+
+/// Lanes processed per iteration by the selected kernel, `count` must be padded to it.
+int poseKernelWidth();
+const char *poseKernelName();
+
+void evaluatePoseBatch(PoseBatch &batch, int count);
+
+// Per instruction set entry points, picked at runtime by evaluatePoseBatch.
+void evaluatePoseBatchScalar(PoseBatch &batch, int count);
+void evaluatePoseBatchSse2(PoseBatch &batch, int count);
+void evaluatePoseBatchAvx2(PoseBatch &batch, int count);
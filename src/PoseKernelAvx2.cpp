@@ -0,0 +1,50 @@
+//
+//  PoseKernelAvx2.cpp
+//  wolfmv
+//
+
+// Compiled with AVX2 enabled (see CMakeLists.txt), only called when the CPU supports it.
+
+#include "PoseKernelImpl.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+namespace {
+
+    struct Avx2Lanes
+    {
+        static constexpr int width = 8;
+        __m256 v;
+
+        static Avx2Lanes load(const float *p) { return { _mm256_load_ps(p) }; }
+        static Avx2Lanes set1(float f) { return { _mm256_set1_ps(f) }; }
+        void store(float *p) const { _mm256_store_ps(p, v); }
+
+        static Avx2Lanes sqrt(Avx2Lanes a) { return { _mm256_sqrt_ps(a.v) }; }
+
+        static Avx2Lanes flipSign(Avx2Lanes a, Avx2Lanes b)
+        {
+            return { _mm256_xor_ps(a.v, _mm256_and_ps(b.v, _mm256_set1_ps(-0.0f))) };
+        }
+
+        Avx2Lanes operator+(Avx2Lanes b) const { return { _mm256_add_ps(v, b.v) }; }
+        Avx2Lanes operator-(Avx2Lanes b) const { return { _mm256_sub_ps(v, b.v) }; }
+        Avx2Lanes operator*(Avx2Lanes b) const { return { _mm256_mul_ps(v, b.v) }; }
+        Avx2Lanes operator/(Avx2Lanes b) const { return { _mm256_div_ps(v, b.v) }; }
+    };
+}
+
+void evaluatePoseBatchAvx2(PoseBatch &batch, int count)
+{
+    evaluatePoseLanes<Avx2Lanes>(batch, count);
+}
+
+#else
+
+void evaluatePoseBatchAvx2(PoseBatch &batch, int count)
+{
+    evaluatePoseBatchSse2(batch, count);
+}
+
+#endif
@@ -0,0 +1,103 @@
+//
+//  PoseKernelImpl.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "PoseKernel.h"
+
+// The kernel body shared by every instruction set. `L` is a lane type with
+// a static `width`, load/store/set1, arithmetic operators, sqrt and
+// flipSign(a, b) which negates the lanes of a where b is negative.
+// Included only by the kernel translation units, each with its own flags.
+
+namespace {
+
+    template<typename L>
+    struct QuatLanes
+    {
+        L x, y, z, w;
+    };
+
+    template<typename L>
+    inline QuatLanes<L> loadQuat(const float (&q)[4][PoseBatch::kCapacity], int i)
+    {
+        return { L::load(&q[0][i]), L::load(&q[1][i]), L::load(&q[2][i]), L::load(&q[3][i]) };
+    }
+
+    template<typename L>
+    inline QuatLanes<L> nlerpLanes(const QuatLanes<L> &a, QuatLanes<L> b, const L &fraction)
+    {
+        // Take the shortest arc: flip b where the dot product is negative.
+        const L dot = a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+        b.x = L::flipSign(b.x, dot);
+        b.y = L::flipSign(b.y, dot);
+        b.z = L::flipSign(b.z, dot);
+        b.w = L::flipSign(b.w, dot);
+
+        QuatLanes<L> q;
+        q.x = a.x + (b.x - a.x) * fraction;
+        q.y = a.y + (b.y - a.y) * fraction;
+        q.z = a.z + (b.z - a.z) * fraction;
+        q.w = a.w + (b.w - a.w) * fraction;
+
+        const L invLength = L::set1(1.0f) / L::sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+        q.x = q.x * invLength;
+        q.y = q.y * invLength;
+        q.z = q.z * invLength;
+        q.w = q.w * invLength;
+
+        return q;
+    }
+
+    template<typename L>
+    inline L lerpLanes(const L &from, const L &to, const L &fraction)
+    {
+        return from + (to - from) * fraction;
+    }
+
+    template<typename L>
+    void evaluatePoseLanes(PoseBatch &b, int count)
+    {
+        const L one = L::set1(1.0f), two = L::set1(2.0f);
+        const L frontLerp = L::set1(b.frontLerp);
+        const L torsoFrontLerp = L::set1(b.torsoFrontLerp);
+
+        for (int i = 0; i < count; i += L::width)
+        {
+            const L torsoWeight = L::load(&b.torsoWeight[i]);
+
+            // rotation
+            const QuatLanes<L> legs = nlerpLanes(loadQuat<L>(b.rotation[PoseBatch::LegsOld], i), loadQuat<L>(b.rotation[PoseBatch::LegsNew], i), frontLerp);
+            const QuatLanes<L> torso = nlerpLanes(loadQuat<L>(b.rotation[PoseBatch::TorsoOld], i), loadQuat<L>(b.rotation[PoseBatch::TorsoNew], i), torsoFrontLerp);
+            const QuatLanes<L> q = nlerpLanes(legs, torso, torsoWeight);
+
+            const L xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+            const L xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+            const L wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+            (one - two * (yy + zz)).store(&b.outRotation[0][i]);
+            (two * (xy + wz)).store(&b.outRotation[1][i]);
+            (two * (xz - wy)).store(&b.outRotation[2][i]);
+            (two * (xy - wz)).store(&b.outRotation[3][i]);
+            (one - two * (xx + zz)).store(&b.outRotation[4][i]);
+            (two * (yz + wx)).store(&b.outRotation[5][i]);
+            (two * (xz + wy)).store(&b.outRotation[6][i]);
+            (two * (yz - wx)).store(&b.outRotation[7][i]);
+            (one - two * (xx + yy)).store(&b.outRotation[8][i]);
+
+            // translation
+            const L parentDist = L::load(&b.parentDist[i]);
+
+            for (int k = 0; k < 3; k++)
+            {
+                const L legsDir = lerpLanes(L::load(&b.direction[PoseBatch::LegsOld][k][i]), L::load(&b.direction[PoseBatch::LegsNew][k][i]), frontLerp);
+                const L torsoDir = lerpLanes(L::load(&b.direction[PoseBatch::TorsoOld][k][i]), L::load(&b.direction[PoseBatch::TorsoNew][k][i]), torsoFrontLerp);
+                const L dir = lerpLanes(legsDir, torsoDir, torsoWeight);
+
+                (L::load(&b.base[k][i]) + dir * parentDist).store(&b.outTranslation[k][i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,126 @@
+//
+//  Quaternion.cpp
+//  wolfmv
+//
+
+#include "Math.h"
+
+namespace math {
+    
+    quat quat::fromMat3(const mat3 &m)
+    {
+        // m holds the axes in rows, so the rotation matrix element (r, c) is m[c][r].
+        const float r00 = m[0][0], r01 = m[1][0], r02 = m[2][0];
+        const float r10 = m[0][1], r11 = m[1][1], r12 = m[2][1];
+        const float r20 = m[0][2], r21 = m[1][2], r22 = m[2][2];
+        
+        const float trace = r00 + r11 + r22;
+        quat q;
+        
+        if (trace > 0)
+        {
+            const float s = 0.5f / sqrtf(trace + 1.0f);
+            q.w = 0.25f / s;
+            q.x = (r21 - r12) * s;
+            q.y = (r02 - r20) * s;
+            q.z = (r10 - r01) * s;
+        }
+        else if (r00 > r11 && r00 > r22)
+        {
+            const float s = 2.0f * sqrtf(1.0f + r00 - r11 - r22);
+            q.w = (r21 - r12) / s;
+            q.x = 0.25f * s;
+            q.y = (r01 + r10) / s;
+            q.z = (r02 + r20) / s;
+        }
+        else if (r11 > r22)
+        {
+            const float s = 2.0f * sqrtf(1.0f + r11 - r00 - r22);
+            q.w = (r02 - r20) / s;
+            q.x = (r01 + r10) / s;
+            q.y = 0.25f * s;
+            q.z = (r12 + r21) / s;
+        }
+        else
+        {
+            const float s = 2.0f * sqrtf(1.0f + r22 - r00 - r11);
+            q.w = (r10 - r01) / s;
+            q.x = (r02 + r20) / s;
+            q.y = (r12 + r21) / s;
+            q.z = 0.25f * s;
+        }
+        
+        q.normalize();
+        return q;
+    }
+    
+    mat3 quat::toMat3() const
+    {
+        const float xx = x * x, yy = y * y, zz = z * z;
+        const float xy = x * y, xz = x * z, yz = y * z;
+        const float wx = w * x, wy = w * y, wz = w * z;
+        
+        mat3 m;
+        m[0] = vec3(1 - 2 * (yy + zz), 2 * (xy + wz), 2 * (xz - wy));
+        m[1] = vec3(2 * (xy - wz), 1 - 2 * (xx + zz), 2 * (yz + wx));
+        m[2] = vec3(2 * (xz + wy), 2 * (yz - wx), 1 - 2 * (xx + yy));
+        return m;
+    }
+    
+    float quat::dotProduct(const quat &q1, const quat &q2)
+    {
+        return q1.x * q2.x + q1.y * q2.y + q1.z * q2.z + q1.w * q2.w;
+    }
+    
+    quat quat::nlerp(const quat &from, const quat &to, float fraction)
+    {
+        // q and -q are the same rotation, take the one closer to from.
+        const float sign = dotProduct(from, to) < 0 ? -1.0f : 1.0f;
+        const float f1 = 1.0f - fraction, f2 = fraction * sign;
+        
+        quat q(from.x * f1 + to.x * f2, from.y * f1 + to.y * f2, from.z * f1 + to.z * f2, from.w * f1 + to.w * f2);
+        q.normalize();
+        return q;
+    }
+    
+    quat quat::slerp(const quat &from, const quat &to, float fraction)
+    {
+        float cosom = dotProduct(from, to);
+        float sign = 1.0f;
+        
+        if (cosom < 0)
+        {
+            cosom = -cosom;
+            sign = -1.0f;
+        }
+        
+        // Nearly the same rotation, sin(omega) is too small to divide by.
+        if (cosom > 0.9995f)
+        {
+            return nlerp(from, to, fraction);
+        }
+        
+        const float omega = acosf(cosom);
+        const float sinom = sinf(omega);
+        const float f1 = sinf((1.0f - fraction) * omega) / sinom;
+        const float f2 = sinf(fraction * omega) / sinom * sign;
+        
+        return quat(from.x * f1 + to.x * f2, from.y * f1 + to.y * f2, from.z * f1 + to.z * f2, from.w * f1 + to.w * f2);
+    }
+    
+    float quat::normalize()
+    {
+        const float l = sqrtf(x * x + y * y + z * z + w * w);
+        
+        if (l)
+        {
+            const float il = 1 / l;
+            x *= il;
+            y *= il;
+            z *= il;
+            w *= il;
+        }
+        
+        return l;
+    }
+}
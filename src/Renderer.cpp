@@ -16,19 +16,34 @@
 
 #include "Camera.h"
 #include "MainQueue.h"
+#include "FrameStats.h"
+#include "PoseKernel.h"
+#include "FrameKernel.h"
 #include "Utils.h"
+#include "FileSystem.h"
+#include "ThreadPool.h"
+#include "TextureCache.h"
+#include "CookedCache.h"
+#include "BlockCompression.h"
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "../deps/tinyfiledialogs.h"
 
 #include <imgui.h>
 
 #include <unordered_set>
+#include <chrono>
+#include <random>
 
 Renderer::Renderer()
 {
+    m_uniforms.init(64 * 1024, MDSModel::kBonePaletteSize);
+    m_vertices.init(16 * 1024);
+    
+    TextureCompression::detectSupport();
 }
 
 Renderer::~Renderer()
@@ -37,11 +52,17 @@ Renderer::~Renderer()
 
 void Renderer::update(float dt)
 {
+    FrameStats::instance().reset();
     MainQueue::instance().poll();
+    TextureCache::instance().update();
     
     if (m_pmodel) {
         m_pmodel->update(dt);
     }
+    
+    for (auto& character : m_crowd) {
+        character->update(dt);
+    }
 }
 
 void Renderer::draw(const Camera& camera)
@@ -55,26 +76,89 @@ void Renderer::draw(const Camera& camera)
     
     glm::mat4 mvp = camera.projection * camera.view * quakeToGL;
     
+    auto start = std::chrono::steady_clock::now();
+    
+    // The loaded character and the crowd spawned from it.
+    std::vector<WolfCharacter *> characters;
+    
     if (m_pmodel) {
-        m_pmodel->draw(mvp);
+        characters.push_back(m_pmodel.get());
     }
+    
+    for (auto& character : m_crowd) {
+        characters.push_back(character.get());
+    }
+    
+    // Bone palettes and animated vertices of everything in the frame go to the GPU in one upload each.
+    m_uniforms.beginFrame();
+    m_vertices.beginFrame();
+    
+    for (WolfCharacter *character : characters) {
+        character->prepare(m_uniforms, m_vertices);
+    }
+    
+    m_uniforms.upload();
+    m_vertices.upload();
+    FrameStats::instance().uniformBytesUploaded += m_uniforms.bytesUploaded();
+    FrameStats::instance().vertexBytesUploaded += m_vertices.bytesUploaded();
+    
+    m_gpuTimer.begin();
+    
+    for (WolfCharacter *character : characters) {
+        const glm::mat4 characterMvp = glm::translate(mvp, character->origin);
+        
+        character->selectLod(characterMvp, camera.projection[1][1]);
+        character->draw(characterMvp, m_uniforms, m_vertices);
+    }
+    
+    m_gpuTimer.end();
+    
+    m_uniforms.endFrame();
+    m_vertices.endFrame();
+    
+    FrameStats::instance().submitMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    FrameStats::instance().gpuMs = m_gpuTimer.lastMs();
 }
 
 std::vector<AnimationEntry> wolfanim;
 int seqIndex = 0;
 
+MDSModel::PoseBenchmark poseBenchmark;
+std::vector<TextureDecodeStats> textureBenchmark;
+
 namespace fs = std::filesystem;
 
 std::string selectedFolder;
 std::vector<std::string> skinNames;
+std::vector<std::string> playerFolders;
 std::string currentSelectedSkin;
 bool showMissingMdsMessage = false;
+bool showLodOverlay = true;
+int crowdSize = 100;
+float crowdSpacing = 64;
+
+// Mount the paks of the folder, returns false if there are none.
+bool ScanPakFolder(const std::string& folderPath)
+{
+    playerFolders.clear();
+    
+    if (FileSystem::instance().mount(folderPath) == 0) return false;
+    
+    for (const auto& name : FileSystem::instance().list("models/players"))
+    {
+        if (FileSystem::instance().exists("models/players/" + name + "/body.mds")) {
+            playerFolders.push_back("models/players/" + name);
+        }
+    }
+    
+    return true;
+}
 
 void ScanSkinFolder(const std::string& folderPath)
 {
     skinNames.clear();
     
-    bool folderHasBodyMds = fs::exists(folderPath + "/body.mds");
+    bool folderHasBodyMds = FileSystem::instance().exists(folderPath + "/body.mds");
     showMissingMdsMessage = !folderHasBodyMds;
     
     if (!folderHasBodyMds) return;
@@ -82,10 +166,7 @@ void ScanSkinFolder(const std::string& folderPath)
     std::unordered_set<std::string> bodySkins;
     std::unordered_set<std::string> headSkins;
     
-    for (const auto& entry : fs::directory_iterator(folderPath)) {
-        if (!entry.is_regular_file()) continue;
-        std::string filename = entry.path().filename().string();
-        
+    for (const auto& filename : FileSystem::instance().list(folderPath)) {
         if (filename.starts_with("body_") && filename.ends_with(".skin")) {
             std::string skin = filename.substr(5, filename.size() - 10); // 5 = strlen("body_"), 10 = strlen("body_") + strlen(".skin")
             bodySkins.insert(skin);
@@ -105,12 +186,63 @@ void ScanSkinFolder(const std::string& folderPath)
 
 void Renderer::LoadSkinPair(const std::string& folder, const std::string& skinName)
 {
-    std::string animPath = folder + "/wolfanim.cfg";
-    wolfanim = parseWolfAnimFile(animPath);
+    std::string name = (fs::path(folder).parent_path().filename() / skinName).string();
+    
+    // The current character stays on screen until the new one is uploaded.
+    m_loader.load(folder, skinName, [this, name](std::shared_ptr<WolfCharacter> character, std::vector<AnimationEntry> animations) {
+        wolfanim = std::move(animations);
+        seqIndex = 0;
+        poseBenchmark = MDSModel::PoseBenchmark();
+        textureBenchmark.clear();
+        
+        m_pmodel = std::move(character);
+        m_pmodel->m_name = name;
+        
+        // A crowd on screen is replaced by one of the new character.
+        if (!m_crowd.empty()) {
+            spawnCrowd(crowdSize, crowdSpacing);
+        }
+    });
+}
+
+void Renderer::spawnCrowd(int count, float spacing)
+{
+    m_crowd.clear();
+    
+    if (!m_pmodel) return;
+    
+    m_pmodel->origin = glm::vec3(0);
+    
+    std::vector<const AnimationEntry *> sequences;
+    
+    for (const auto& sequence : wolfanim) {
+        if (sequence.length > 0 && sequence.fps > 0) sequences.push_back(&sequence);
+    }
+    
+    if (count < 2 || sequences.empty()) return;
     
-    m_pmodel = std::make_unique<WolfCharacter>();
-    m_pmodel->m_name = (fs::path(folder).parent_path().filename() / skinName).string();
-    m_pmodel->init(folder, skinName);
+    // The same crowd every time, so runs can be compared.
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> phase(0.0f, 1.0f);
+    
+    // Rows go away from the camera, the loaded character is the first one of the front row.
+    const int columns = (int)ceilf(sqrtf((float)count));
+    
+    auto position = [&](int i) {
+        return glm::vec3(-(i / columns) * spacing, ((i % columns) - (columns - 1) * 0.5f) * spacing, 0);
+    };
+    
+    m_pmodel->origin = position(0);
+    
+    for (int i = 1; i < count; i++)
+    {
+        auto character = m_pmodel->spawn();
+        character->origin = position(i);
+        character->setAnimation(*sequences[random() % sequences.size()]);
+        character->setPhase(phase(random));
+        
+        m_crowd.push_back(std::move(character));
+    }
 }
 
 void selectFolder(std::function<void (std::string)> callback);
@@ -124,8 +256,13 @@ void Renderer::imgui_draw()
             if (ImGui::MenuItem("Open", "Ctrl+O"))
             {
                 selectFolder([this](std::string path) {
-                    selectedFolder = path;
-                    ScanSkinFolder(path);
+                    if (ScanPakFolder(path)) {
+                        selectedFolder.clear();
+                        skinNames.clear();
+                    } else {
+                        selectedFolder = path;
+                        ScanSkinFolder(path);
+                    }
                 });
             }
 
@@ -154,6 +291,23 @@ void Renderer::imgui_draw()
         ImGui::EndPopup();
     }
     
+    if (!playerFolders.empty())
+    {
+        if (ImGui::Begin("Players###players"))
+        {
+            for (const auto& folder : playerFolders)
+            {
+                if (ImGui::Selectable(folder.c_str(), selectedFolder == folder))
+                {
+                    selectedFolder = folder;
+                    ScanSkinFolder(folder);
+                }
+            }
+            
+            ImGui::End();
+        }
+    }
+    
     if (!selectedFolder.empty())
     {
         if (ImGui::Begin("Available skins###skins"))
@@ -167,6 +321,47 @@ void Renderer::imgui_draw()
                 }
             }
             
+            if (m_loader.isLoading())
+            {
+                ImGui::Separator();
+                ImGui::Text("Loading %s", m_loader.name().c_str());
+                ImGui::ProgressBar(m_loader.progress());
+            }
+            else if (!m_loader.error().empty())
+            {
+                ImGui::Separator();
+                ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "Failed to load %s", m_loader.name().c_str());
+                ImGui::TextWrapped("%s", m_loader.error().c_str());
+            }
+            
+            ImGui::End();
+        }
+    }
+    
+    const TextureCache::Stats textureMemory = TextureCache::instance().stats();
+    
+    if (textureMemory.textures > 0)
+    {
+        if (ImGui::Begin("Texture memory###texmem"))
+        {
+            int budgetMB = (int)(TextureCache::residentBudget / (1024 * 1024));
+            
+            if (ImGui::SliderInt("Budget, MB", &budgetMB, 1, 1024))
+            {
+                TextureCache::residentBudget = (size_t)budgetMB * 1024 * 1024;
+            }
+            
+            ImGui::Text("Uploaded: %zu KB of %zu KB, %d levels dropped", textureMemory.residentBytes / 1024,
+                        TextureCache::residentBudget / 1024, textureMemory.droppedLevels);
+            ImGui::Separator();
+            
+            for (const auto& texture : TextureCache::instance().residency())
+            {
+                ImGui::Text("%s", texture.path.c_str());
+                ImGui::Text("    %dx%d, %zu KB of %zu KB, -%d levels, %s", texture.width, texture.height, texture.residentBytes / 1024,
+                            texture.bytes / 1024, texture.droppedLevels, texture.framesUnused <= 1 ? "drawn" : texture.inUse ? "in use" : "unused");
+            }
+            
             ImGui::End();
         }
     }
@@ -209,8 +404,222 @@ void Renderer::imgui_draw()
         
         ImGui::PopItemWidth();
         
+        if (m_pmodel->numHeadFrames() > 1)
+        {
+            ImGui::Checkbox("Animate head", &m_pmodel->animateHead);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(w - spacing * 2.0f - button_sz * 2.0f);
+            ImGui::SliderFloat("##head frame", &m_pmodel->headFrame, 0, (float)(m_pmodel->numHeadFrames() - 1), "frame %.1f");
+            ImGui::PopItemWidth();
+        }
+        
+        const FrameStats& stats = FrameStats::instance();
+        
+        ImGui::Separator();
+        ImGui::Text("Bones evaluated: %d", stats.bonesEvaluated);
+        ImGui::Text("Pose time: %.3f ms", stats.poseMs);
+        
+        const MDSModel &body = m_pmodel->bodyModel();
+        
+        const FileSystem::CacheStats fileCache = FileSystem::instance().cacheStats();
+        
+        ImGui::Text("Paks: %d, %zu files, inflate cache %zu KB (%d hits, %d misses)", FileSystem::instance().numPaks(),
+                    FileSystem::instance().numEntries(), fileCache.bytes / 1024, fileCache.hits, fileCache.misses);
+        const TextureCache::Stats textureCache = TextureCache::instance().stats();
+        
+        ImGui::Text("Texture cache: %d textures (%d unused), %zu KB of %zu KB", textureCache.textures, textureCache.unused,
+                    textureCache.bytes / 1024, TextureCache::budget / 1024);
+        ImGui::Text("Texture cache: %d hits, %d by content, %d misses, %d evicted", textureCache.hits, textureCache.hashHits,
+                    textureCache.misses, textureCache.evictions);
+        ImGui::Text("Body file: %zu KB %s%s, loaded in %.2f ms, RSS +%zu KB", body.fileBytes() / 1024,
+                    body.fileMapped() ? "mapped" : "read", body.cooked() ? ", cooked" : "", body.loadMs(), body.loadResidentBytes() / 1024);
+        
+        const CookedCache::Stats cooked = CookedCache::instance().stats();
+        
+        bool cookedCacheEnabled = CookedCache::enabled;
+        
+        if (ImGui::Checkbox("Cooked cache", &cookedCacheEnabled))
+        {
+            CookedCache::enabled = cookedCacheEnabled;
+        }
+        
+        ImGui::SameLine();
+        ImGui::Text("%d hits, %d stale, %d missing, %d written", cooked.hits, cooked.stale, cooked.missing, cooked.written);
+        
+        if (body.poseTableResident()) {
+            ImGui::Text("Pose table: %zu KB, decoded in %.2f ms", body.poseTableBytes() / 1024, body.poseTableDecodeMs());
+        } else {
+            ImGui::Text("Pose table: decoded on demand");
+        }
+        
+        const char* poseModes[] = { "Euler", "Quaternion nlerp", "Quaternion slerp", "Quaternion nlerp (SIMD)" };
+        int poseMode = (int)MDSModel::poseEvalMode;
+        
+        if (ImGui::Combo("Pose mode", &poseMode, poseModes, IM_ARRAYSIZE(poseModes))) {
+            MDSModel::poseEvalMode = (PoseEvalMode)poseMode;
+        }
+        
+        const char* anglePrecisions[] = { "Exact", "Sin table", "Sin table, 16-bit lerp" };
+        int anglePrecision = (int)MDSModel::anglePrecision;
+        
+        if (ImGui::Combo("Euler angles", &anglePrecision, anglePrecisions, IM_ARRAYSIZE(anglePrecisions))) {
+            MDSModel::anglePrecision = (AnglePrecision)anglePrecision;
+        }
+        
+        ImGui::Text("Pose kernel: %s, scalar gather", poseKernelName());
+        
+        if (ImGui::Button("Benchmark pose modes")) {
+            poseBenchmark = body.benchmarkPoseModes();
+        }
+        
+        for (int i = 0; poseBenchmark.numPoses > 0 && i < IM_ARRAYSIZE(poseModes); ++i)
+        {
+            ImGui::Text("%s: %.4f ms/pose, max error rot %.5f pos %.4f", poseModes[i], poseBenchmark.msPerPose[i],
+                        poseBenchmark.maxRotationError[i], poseBenchmark.maxTranslationError[i]);
+        }
+        
+        for (int i = 0; poseBenchmark.numPoses > 0 && i < IM_ARRAYSIZE(anglePrecisions); ++i)
+        {
+            ImGui::Text("Euler, %s: %.4f ms/pose, max error rot %.5f pos %.4f", anglePrecisions[i], poseBenchmark.msPerPosePrecision[i],
+                        poseBenchmark.maxPrecisionRotationError[i], poseBenchmark.maxPrecisionTranslationError[i]);
+        }
+        
+        if (poseBenchmark.numPoses > 0)
+        {
+            ImGui::Text("Euler, branching evaluators: %.4f ms/pose, max diff %.6f", poseBenchmark.msPerPoseBranching, poseBenchmark.maxBranchingError);
+        }
+        ImGui::Text("Uniforms uploaded: %.1f KB", stats.uniformBytesUploaded / 1024.0f);
+        ImGui::Text("Vertices streamed: %.1f KB, %s frame kernel", stats.vertexBytesUploaded / 1024.0f, frameKernelName());
+        ImGui::Checkbox("Decode head frames on GPU", &MD3Model::decodeOnGpu);
+        ImGui::SameLine();
+        ImGui::Text("%zu KB compressed, %zu KB decoded", m_pmodel->headModel().packedFrameBytes() / 1024, m_pmodel->headModel().decodedFrameBytes() / 1024);
+        ImGui::Checkbox("Show head normals", &MD3Model::showNormals);
+        
+        ImGui::Separator();
+        
+        const WolfCharacter::LodInfo &lod = m_pmodel->lodInfo();
+        
+        ImGui::Checkbox("Levels of detail", &MDSModel::useLods);
+        ImGui::SameLine();
+        ImGui::Checkbox("Overlay", &showLodOverlay);
+        ImGui::SliderFloat("LOD scale", &MDSModel::lodScale, 0.5f, 20.0f, "%.1f");
+        ImGui::SliderFloat("LOD bias", &MDSModel::lodBias, -4.0f, 4.0f, "%.2f");
+        ImGui::Text("Triangles drawn: %d, body LOD %d: %d triangles, %.0f%% of the vertices wanted, projected radius %.2f",
+                    stats.trianglesDrawn, lod.level, lod.numTriangles, lod.fraction * 100.0f, lod.projectedRadius);
+        
+        ImGui::Separator();
+        
+        ImGui::SliderInt("Crowd size", &crowdSize, 2, 1024);
+        ImGui::SliderFloat("Crowd spacing", &crowdSpacing, 32.0f, 256.0f, "%.0f");
+        
+        if (ImGui::Button("Spawn crowd")) {
+            spawnCrowd(crowdSize, crowdSpacing);
+        }
+        
+        ImGui::SameLine();
+        
+        if (ImGui::Button("Clear crowd")) {
+            spawnCrowd(0, crowdSpacing);
+        }
+        
+        ImGui::Text("%d characters: pose %.2f ms, submit %.2f ms, GPU %.2f ms, %d draw calls", 1 + (int)m_crowd.size(),
+                    stats.poseMs, stats.submitMs, stats.gpuMs, stats.drawCalls);
+        
+        ImGui::Separator();
+        
+        ImGui::Text("Character loaded in %.2f ms, body %s, head %s", m_pmodel->loadMs(),
+                    m_pmodel->reusedBody() ? "reused" : "loaded", m_pmodel->reusedHead() ? "reused" : "loaded");
+        
+        const TextureDecodeStats* textureStats[] = { &m_pmodel->bodySkinTextures().decodeStats(), &m_pmodel->headSkinTextures().decodeStats() };
+        std::vector<std::string> textureFiles;
+        
+        bool compressTextures = TextureCompression::enabled;
+        
+        if (ImGui::Checkbox("Compress textures", &compressTextures))
+        {
+            TextureCompression::enabled = compressTextures;
+        }
+        
+        ImGui::SameLine();
+        ImGui::Text("BC1/BC3, %s encoder, %s", blockEncoderName(), TextureCompression::supported ? "uploaded compressed" : "no S3TC, decoded on upload");
+        
+        for (const TextureDecodeStats* decode : textureStats)
+        {
+            ImGui::Text("Textures: %zu decoded on %d threads in %.2f ms, %.2f ms serial", decode->textures.size(),
+                        decode->threads, decode->wallMs, decode->serialMs());
+            ImGui::Text("Texture memory: %zu KB, %zu KB uncompressed, saved %zu KB", decode->bytes() / 1024,
+                        decode->uncompressedBytes() / 1024, (decode->uncompressedBytes() - std::min(decode->bytes(), decode->uncompressedBytes())) / 1024);
+            
+            for (const auto& texture : decode->textures)
+            {
+                if (texture.cooked) {
+                    ImGui::BulletText("%s: cooked, mapped in %.2f ms", texture.filename.c_str(), texture.decodeMs);
+                } else {
+                    ImGui::BulletText("%s: decode %.2f ms, mips %.2f ms, compress %.2f ms", texture.filename.c_str(),
+                                      texture.decodeMs, texture.mipsMs, texture.compressMs);
+                }
+                
+                if (texture.psnr > 0)
+                {
+                    ImGui::SameLine();
+                    ImGui::Text("| %zu KB of %zu KB, PSNR %.1f dB", texture.bytes / 1024, texture.uncompressedBytes / 1024, texture.psnr);
+                }
+                textureFiles.push_back(texture.filename);
+            }
+        }
+        
+        if (ImGui::Button("Benchmark texture decoding"))
+        {
+            textureBenchmark.clear();
+            
+            for (int threads = 1; ; threads *= 2)
+            {
+                threads = std::min(threads, ThreadPool::instance().numThreads());
+                
+                textureBenchmark.emplace_back();
+                decodeTextures(textureFiles, threads, &textureBenchmark.back());
+                
+                if (threads == ThreadPool::instance().numThreads()) break;
+            }
+        }
+        
+        for (const auto& run : textureBenchmark)
+        {
+            ImGui::Text("%d threads: %.2f ms, speedup %.2fx", run.threads, run.wallMs, textureBenchmark[0].wallMs / run.wallMs);
+        }
+        
         ImGui::End();
     }
+    
+    if (showLodOverlay)
+    {
+        ImDrawList *overlay = ImGui::GetForegroundDrawList();
+        const ImVec2 size = ImGui::GetIO().DisplaySize;
+        const FrameStats& stats = FrameStats::instance();
+        char text[128];
+        
+        snprintf(text, sizeof(text), "%d triangles, %d draw calls", stats.trianglesDrawn, stats.drawCalls);
+        overlay->AddText(ImVec2(8, ImGui::GetFrameHeight() + 8), IM_COL32_WHITE, text);
+        
+        auto label = [&](const WolfCharacter &character)
+        {
+            const WolfCharacter::LodInfo &lod = character.lodInfo();
+            
+            // Next to the center of the character, if it is in front of the camera.
+            if (lod.clipCenter.w <= 0) return;
+            
+            const ImVec2 pos((lod.clipCenter.x / lod.clipCenter.w * 0.5f + 0.5f) * size.x, (0.5f - lod.clipCenter.y / lod.clipCenter.w * 0.5f) * size.y);
+            
+            snprintf(text, sizeof(text), "LOD %d, %d tris", lod.level, lod.numTriangles);
+            overlay->AddText(pos, IM_COL32(255, 255, 0, 255), text);
+        };
+        
+        label(*m_pmodel);
+        
+        for (const auto& character : m_crowd) {
+            label(*character);
+        }
+    }
 }
 
 void selectFolder(std::function<void (std::string)> callback)
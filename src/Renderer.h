@@ -11,6 +11,11 @@
 #include <vector>
 #include <glm/glm.hpp>
 
+#include "UniformRingBuffer.h"
+#include "VertexRingBuffer.h"
+#include "GpuTimer.h"
+#include "CharacterLoader.h"
+
 struct WolfCharacter;
 struct GLFWwindow;
 class Camera;
@@ -26,5 +31,14 @@ struct Renderer
     
 private:
     void LoadSkinPair(const std::string& folder, const std::string& skinName);
-    std::unique_ptr<WolfCharacter> m_pmodel;
+    
+    /// Copies of the character in a grid around it, sharing its models and textures.
+    void spawnCrowd(int count, float spacing);
+    
+    std::shared_ptr<WolfCharacter> m_pmodel;
+    std::vector<std::shared_ptr<WolfCharacter>> m_crowd;
+    CharacterLoader m_loader;
+    UniformRingBuffer m_uniforms;
+    VertexRingBuffer m_vertices;
+    GpuTimer m_gpuTimer;
 };
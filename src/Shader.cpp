@@ -19,19 +19,29 @@ Shader::Shader(Shader &&other) noexcept
 {
     program = other.program;
     other.program = 0;
+    
+    m_locations = std::move(other.m_locations);
+    m_missing = std::move(other.m_missing);
 }
 
 Shader &Shader::operator=(Shader &&other) noexcept
 {
+    if (this == &other) return *this;
+    
+    if (program != 0) glDeleteProgram(program);
+    
     program = other.program;
     other.program = 0;
+    
+    m_locations = std::move(other.m_locations);
+    m_missing = std::move(other.m_missing);
 
     return *this;
 }
 
 Shader::~Shader()
 {
-    glDeleteShader(program);
+    if (program != 0) glDeleteProgram(program);
 }
 
 unsigned int compile_shader(unsigned int type, const char* source);
@@ -50,6 +60,55 @@ void Shader::init(const char *vert, const char *frag)
 
     glDeleteShader(vs);
     glDeleteShader(fs);
+    
+    // Resolve all the uniform locations once, setters only look them up.
+    m_locations.clear();
+    m_missing.clear();
+    
+    GLint count = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    
+    for (GLint i = 0; i < count; ++i)
+    {
+        char name[256];
+        GLsizei length;
+        GLint size;
+        GLenum type;
+        
+        glGetActiveUniform(program, i, sizeof(name), &length, &size, &type, name);
+        
+        const GLint location = glGetUniformLocation(program, name);
+        
+        // Uniforms inside blocks have no location.
+        if (location == -1) continue;
+        
+        std::string key(name, length);
+        
+        // Arrays are reported as "name[0]", but set by their plain name.
+        if (key.ends_with("[0]"))
+        {
+            key.resize(key.size() - 3);
+        }
+        
+        m_locations[key] = location;
+    }
+}
+
+int Shader::location(const std::string& name) const
+{
+    auto it = m_locations.find(name);
+    
+    if (it != m_locations.end())
+    {
+        return it->second;
+    }
+    
+    if (m_missing.insert(name).second)
+    {
+        printf("Shader have no uniform %s\n", name.c_str());
+    }
+    
+    return -1;
 }
 
 void Shader::bind() const
@@ -154,93 +213,120 @@ void Shader::init(const char *filepath)
 
 void Shader::setUniform(const std::string& name, const glm::vec3& vector) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
 
-    if (location == -1)
-    {
-        printf("Shader have no uniform %s\n", name.c_str());
-        return;
-    }
+    if (location == -1) return;
 
     glUniform3fv(location, 1, (const float*) &vector);
 }
 
 void Shader::setUniform(const std::string& name, const glm::vec4& vector) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
 
-    if (location == -1)
-    {
-        printf("Shader have no uniform %s\n", name.c_str());
-        return;
-    }
+    if (location == -1) return;
 
     glUniform4fv(location, 1, (const float*) &vector);
 }
 
 void Shader::setUniform(const std::string &name, const glm::mat4& matrix) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
 
-    if (location == -1)
-    {
-        printf("Shader have no uniform %s\n", name.c_str());
-        return;
-    }
+    if (location == -1) return;
     
     glUniformMatrix4fv(location, 1, GL_FALSE, (const float*) &matrix);
 }
 
 void Shader::setUniform(const std::string &name, const std::vector<glm::vec3> &vectors) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
 
-    if (location == -1)
-    {
-        printf("Shader have no uniform %s\n", name.c_str());
-        return;
-    }
+    if (location == -1) return;
     
     glUniform3fv(location, (GLsizei)(vectors.size()), &(vectors[0][0]));
 }
 
 void Shader::setUniform(const std::string &name, const std::vector<glm::mat4> &matrices) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
 
-    if (location == -1)
-    {
-        printf("Shader have no uniform %s\n", name.c_str());
-        return;
-    }
+    if (location == -1) return;
     
     glUniformMatrix4fv(location, (GLsizei)(matrices.size()), GL_FALSE, &(matrices[0][0][0]));
 }
 
 void Shader::setUniform(const std::string& name, const std::vector<math::vec3>& vectors) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
     
-    if (location == -1)
-    {
-        printf("Shader have no uniform %s\n", name.c_str());
-        return;
-    }
+    if (location == -1) return;
     
     glUniform3fv(location, (GLsizei)(vectors.size()), &(vectors[0][0]));
 }
 
 void Shader::setUniform(const std::string& name, const std::vector<math::mat3>& matrices) const
 {
-    const GLint location = glGetUniformLocation(program, name.c_str());
+    const GLint location = this->location(name);
+    
+    if (location == -1) return;
+    
+    glUniformMatrix3fv(location, (GLsizei)(matrices.size()), GL_TRUE, &(matrices[0][0][0]));
+}
+
+void Shader::setUniform(Uniform<int> uniform, int value) const
+{
+    if (uniform.location == -1) return;
+    
+    glUniform1i(uniform.location, value);
+}
+
+void Shader::setUniform(Uniform<float> uniform, float value) const
+{
+    if (uniform.location == -1) return;
     
-    if (location == -1)
+    glUniform1f(uniform.location, value);
+}
+
+void Shader::setUniform(Uniform<glm::ivec4> uniform, const glm::ivec4& vector) const
+{
+    if (uniform.location == -1) return;
+    
+    glUniform4iv(uniform.location, 1, (const int*) &vector);
+}
+
+void Shader::setUniform(Uniform<glm::vec3> uniform, const glm::vec3& vector) const
+{
+    if (uniform.location == -1) return;
+    
+    glUniform3fv(uniform.location, 1, (const float*) &vector);
+}
+
+void Shader::setUniform(Uniform<glm::vec4> uniform, const glm::vec4& vector) const
+{
+    if (uniform.location == -1) return;
+    
+    glUniform4fv(uniform.location, 1, (const float*) &vector);
+}
+
+void Shader::setUniform(Uniform<glm::mat4> uniform, const glm::mat4& matrix) const
+{
+    if (uniform.location == -1) return;
+    
+    glUniformMatrix4fv(uniform.location, 1, GL_FALSE, (const float*) &matrix);
+}
+
+void Shader::bindUniformBlock(const std::string& name, unsigned int bindingPoint) const
+{
+    const GLuint index = glGetUniformBlockIndex(program, name.c_str());
+    
+    if (index == GL_INVALID_INDEX)
     {
-        printf("Shader have no uniform %s\n", name.c_str());
+        printf("Shader have no uniform block %s\n", name.c_str());
         return;
     }
     
-    glUniformMatrix3fv(location, (GLsizei)(matrices.size()), GL_TRUE, &(matrices[0][0][0]));
+    glUniformBlockBinding(program, index, bindingPoint);
 }
 
 unsigned int compile_shader(unsigned int type, const char* source)
@@ -6,6 +6,8 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <glm/glm.hpp>
 #include "Math.h"
@@ -24,12 +26,32 @@ public:
     ~Shader();
 
 public:
+    /// Location of a uniform resolved once after linking, typed by the value it accepts.
+    template<typename T>
+    struct Uniform
+    {
+        int location = -1;
+    };
+    
     void init(const char* filename);
     void init(const char* vert_src, const char* frag_src);
 
     void bind() const;
     void unbind() const;
 
+    template<typename T>
+    Uniform<T> uniform(const std::string& name) const
+    {
+        return Uniform<T>{ location(name) };
+    }
+    
+    void setUniform(Uniform<int> uniform, int value) const;
+    void setUniform(Uniform<float> uniform, float value) const;
+    void setUniform(Uniform<glm::ivec4> uniform, const glm::ivec4& vector) const;
+    void setUniform(Uniform<glm::vec3> uniform, const glm::vec3& vector) const;
+    void setUniform(Uniform<glm::vec4> uniform, const glm::vec4& vector) const;
+    void setUniform(Uniform<glm::mat4> uniform, const glm::mat4& matrix) const;
+    
     void setUniform(const std::string& name, const glm::vec3& vector) const;
     void setUniform(const std::string& name, const glm::vec4& vector) const;
     void setUniform(const std::string& name, const glm::mat4& matrix) const;
@@ -39,7 +61,16 @@ public:
     
     void setUniform(const std::string& name, const std::vector<math::vec3>& vectors) const;
     void setUniform(const std::string& name, const std::vector<math::mat3>& matrices) const;
+    
+    void bindUniformBlock(const std::string& name, unsigned int bindingPoint) const;
 
 //private:
     int program;
+    
+private:
+    /// Looks up the location table, a missing uniform is reported only once.
+    int location(const std::string& name) const;
+    
+    std::unordered_map<std::string, int> m_locations;
+    mutable std::unordered_set<std::string> m_missing;
 };
@@ -6,6 +6,7 @@
 //
 
 #include "Skin.h"
+#include "FileSystem.h"
 
 #include <iostream>
 #include <fstream>
@@ -29,13 +30,15 @@ SkinFile parseSkinFile(const std::string& filepath)
     auto folder = file_path.parent_path();
     
     SkinFile result;
-    std::ifstream file(filepath);
+    FileData data = FileSystem::instance().read(filepath);
     
-    if (!file) {
+    if (data.empty()) {
         std::cerr << "Cannot open file: " << filepath << std::endl;
         return result;
     }
     
+    std::istringstream file(std::string((const char *)data.data(), data.size()));
+    
     std::string line;
     
     while (std::getline(file, line))
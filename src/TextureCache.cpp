@@ -0,0 +1,446 @@
+//
+//  TextureCache.cpp
+//  wolfmv
+//
+
+#include "TextureCache.h"
+#include "FileSystem.h"
+#include "MainQueue.h"
+#include "Skin.h"
+#include "ThreadPool.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+
+static size_t levelBytes(const CachedTexture &texture, int level)
+{
+    return uploadedLevelBytes(texture.format, texture.width, texture.height, level);
+}
+
+static size_t levelsBytes(const CachedTexture &texture, int dropped)
+{
+    size_t bytes = 0;
+    
+    for (int level = dropped; level < texture.numLevels; ++level)
+    {
+        bytes += levelBytes(texture, level);
+    }
+    
+    return bytes;
+}
+
+TextureHandle TextureCache::find(const std::string& filename, Key &key)
+{
+    key = Key();
+    
+    const std::string resolved = resolvePath(filename, {".tga", ".jpg"});
+    
+    if (resolved.empty()) return nullptr;
+    
+    key.path = FileSystem::instance().canonicalPath(resolved);
+    key.filename = resolved;
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = byPath_.find(key.path);
+        
+        if (it != byPath_.end())
+        {
+            stats_.hits++;
+            key.hash = it->second->texture->hash;
+            return acquire(*it->second);
+        }
+    }
+    
+    key.file = FileSystem::instance().read(resolved);
+    
+    if (key.file.empty()) return nullptr;
+    
+    key.hash = hashBytes(key.file.data(), key.file.size());
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = byHash_.find(key.hash);
+    
+    if (it != byHash_.end())
+    {
+        // The same file under another name, remember this one too.
+        Entry &entry = *it->second;
+        entry.paths.push_back(key.path);
+        byPath_[key.path] = &entry;
+        
+        stats_.hashHits++;
+        return acquire(entry);
+    }
+    
+    stats_.misses++;
+    return nullptr;
+}
+
+TextureHandle TextureCache::insert(const Key &key, TextureImage image)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    auto it = byHash_.find(key.hash);
+    
+    if (it == byHash_.end())
+    {
+        auto entry = std::make_unique<Entry>();
+        entry->texture = std::make_shared<CachedTexture>();
+        entry->texture->path = key.path;
+        entry->texture->hash = key.hash;
+        entry->texture->filename = key.filename;
+        entry->texture->width = image.width;
+        entry->texture->height = image.height;
+        entry->texture->numLevels = (int)image.mips.size();
+        entry->texture->format = image.format;
+        entry->texture->bytes = levelsBytes(*entry->texture, 0);
+        entry->texture->image = std::move(image);
+        entry->unused = unused_.end();
+        
+        stats_.textures++;
+        stats_.bytes += entry->texture->bytes;
+        
+        it = byHash_.emplace(key.hash, std::move(entry)).first;
+    }
+    
+    Entry &entry = *it->second;
+    
+    if (!byPath_.contains(key.path))
+    {
+        entry.paths.push_back(key.path);
+        byPath_[key.path] = &entry;
+    }
+    
+    return acquire(entry);
+}
+
+std::vector<TextureHandle> TextureCache::load(const std::vector<std::string>& filenames, TextureDecodeStats *stats)
+{
+    std::vector<TextureHandle> handles(filenames.size());
+    std::vector<Key> keys;
+    std::vector<std::string> missing;
+    std::vector<FileData> files;
+    std::vector<size_t> missingIndices;
+    
+    for (size_t i = 0; i < filenames.size(); ++i)
+    {
+        Key key;
+        handles[i] = find(filenames[i], key);
+        
+        if (!handles[i] && key.hash != 0)
+        {
+            missing.push_back(key.filename);
+            files.push_back(std::move(key.file));
+            keys.push_back(key);
+            missingIndices.push_back(i);
+        }
+    }
+    
+    auto images = decodeTextures(missing, files, 0, stats);
+    
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        if (!images[i].empty())
+        {
+            handles[missingIndices[i]] = insert(keys[i], std::move(images[i]));
+        }
+    }
+    
+    return handles;
+}
+
+// Called with the mutex locked.
+TextureHandle TextureCache::acquire(Entry &entry)
+{
+    if (entry.refs++ == 0 && entry.unused != unused_.end())
+    {
+        unused_.erase(entry.unused);
+        entry.unused = unused_.end();
+        stats_.unused--;
+    }
+    
+    // A handle of its own, the deleter gives the reference back to the cache.
+    return TextureHandle(entry.texture.get(), [](CachedTexture *texture) {
+        TextureCache::instance().release(texture);
+    });
+}
+
+void TextureCache::release(CachedTexture *texture)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    Entry &entry = *byHash_.at(texture->hash);
+    
+    if (--entry.refs > 0) return;
+    
+    unused_.push_front(&entry);
+    entry.unused = unused_.begin();
+    stats_.unused++;
+    
+    trim();
+}
+
+void TextureCache::trim()
+{
+    while (stats_.bytes > budget && !unused_.empty())
+    {
+        Entry *entry = unused_.back();
+        unused_.pop_back();
+        
+        if (entry->texture->id != 0)
+        {
+            glDeleteTextures(1, &entry->texture->id);
+            stats_.residentBytes -= entry->texture->residentBytes;
+            stats_.droppedLevels -= entry->texture->droppedLevels;
+        }
+        
+        for (const auto& path : entry->paths)
+        {
+            byPath_.erase(path);
+        }
+        
+        stats_.bytes -= entry->texture->bytes;
+        stats_.textures--;
+        stats_.unused--;
+        stats_.evictions++;
+        
+        byHash_.erase(entry->texture->hash);
+    }
+}
+
+void TextureCache::upload(CachedTexture &texture)
+{
+    if (texture.id != 0) return;
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    // Everything at first, update() drops levels next frame if it doesn't fit.
+    texture.id = uploadTexture(texture.image);
+    texture.image = TextureImage();
+    texture.droppedLevels = 0;
+    texture.residentBytes = texture.bytes;
+    texture.lastUsedFrame = frame_;
+    
+    stats_.residentBytes += texture.residentBytes;
+}
+
+void TextureCache::setDroppedLevels(CachedTexture &texture, const TextureImage &image, int dropped)
+{
+    glDeleteTextures(1, &texture.id);
+    texture.id = uploadTexture(image, dropped);
+    
+    // Decoded again after TextureCompression::enabled changed.
+    if (image.format != texture.format)
+    {
+        stats_.bytes -= texture.bytes;
+        texture.format = image.format;
+        texture.bytes = levelsBytes(texture, 0);
+        stats_.bytes += texture.bytes;
+    }
+    
+    stats_.residentBytes -= texture.residentBytes;
+    stats_.droppedLevels += dropped - texture.droppedLevels;
+    
+    texture.droppedLevels = dropped;
+    texture.residentBytes = levelsBytes(texture, dropped);
+    stats_.residentBytes += texture.residentBytes;
+}
+
+void TextureCache::update()
+{
+    frame_++;
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    if (changingLevels_) return;
+    
+    struct Candidate
+    {
+        CachedTexture *texture;
+        int dropped;
+    };
+    
+    std::vector<Candidate> uploaded;
+    
+    for (const auto& [hash, entry] : byHash_)
+    {
+        if (entry->texture->id != 0) uploaded.push_back({ entry->texture.get(), entry->texture->droppedLevels });
+    }
+    
+    // Drawn least recently first, then the largest as planned so far.
+    auto dropsBefore = [](const Candidate &a, const Candidate &b) {
+        if (a.texture->lastUsedFrame != b.texture->lastUsedFrame) return a.texture->lastUsedFrame < b.texture->lastUsedFrame;
+        return levelsBytes(*a.texture, a.dropped) > levelsBytes(*b.texture, b.dropped);
+    };
+    
+    // Plan the levels first so that every texture is uploaded at most once.
+    size_t resident = stats_.residentBytes;
+    bool dropped = false;
+    
+    while (resident > residentBudget)
+    {
+        Candidate *victim = nullptr;
+        
+        for (Candidate &candidate : uploaded)
+        {
+            // The last level always stays.
+            if (candidate.dropped + 1 >= candidate.texture->numLevels) continue;
+            
+            if (!victim || dropsBefore(candidate, *victim)) victim = &candidate;
+        }
+        
+        if (!victim) break;
+        
+        resident -= levelBytes(*victim->texture, victim->dropped);
+        victim->dropped++;
+        dropped = true;
+    }
+    
+    // Give levels back in the reverse order while they fit.
+    while (!dropped)
+    {
+        Candidate *restore = nullptr;
+        
+        for (Candidate &candidate : uploaded)
+        {
+            if (candidate.dropped == 0) continue;
+            
+            if (resident + levelBytes(*candidate.texture, candidate.dropped - 1) > residentBudget) continue;
+            
+            if (!restore || dropsBefore(*restore, candidate)) restore = &candidate;
+        }
+        
+        if (!restore) break;
+        
+        restore->dropped--;
+        resident += levelBytes(*restore->texture, restore->dropped);
+    }
+    
+    auto changes = std::make_shared<std::vector<LevelChange>>();
+    
+    for (const Candidate &candidate : uploaded)
+    {
+        if (candidate.dropped != candidate.texture->droppedLevels)
+        {
+            changes->push_back({ candidate.texture->hash, candidate.texture->filename, candidate.dropped, TextureImage() });
+        }
+    }
+    
+    if (changes->empty()) return;
+    
+    // The pixels aren't kept after the upload, map them from the cooked cache or decode them
+    // again on the pool. The textures are looked up by hash once they're back, they may be
+    // gone by then.
+    changingLevels_ = true;
+    
+    ThreadPool::instance().async([changes]() {
+        std::vector<std::string> filenames;
+        
+        for (const LevelChange &change : *changes)
+        {
+            filenames.push_back(change.filename);
+        }
+        
+        auto images = decodeTextures(filenames);
+        
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            (*changes)[i].image = std::move(images[i]);
+        }
+        
+        MainQueue::instance().async([changes]() {
+            TextureCache::instance().applyLevelChanges(*changes);
+        });
+    });
+}
+
+void TextureCache::applyLevelChanges(const std::vector<LevelChange> &changes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    for (const LevelChange &change : changes)
+    {
+        auto it = byHash_.find(change.hash);
+        
+        if (it == byHash_.end() || it->second->texture->id == 0 || change.image.empty()) continue;
+        
+        setDroppedLevels(*it->second->texture, change.image, change.dropped);
+    }
+    
+    changingLevels_ = false;
+}
+
+TextureCache::Stats TextureCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+std::vector<TextureCache::Residency> TextureCache::residency() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    std::vector<Residency> result;
+    
+    for (const auto& [hash, entry] : byHash_)
+    {
+        const CachedTexture &texture = *entry->texture;
+        
+        if (texture.id == 0) continue;
+        
+        Residency r;
+        r.path = texture.path;
+        r.width = std::max(1, texture.width >> texture.droppedLevels);
+        r.height = std::max(1, texture.height >> texture.droppedLevels);
+        r.droppedLevels = texture.droppedLevels;
+        r.bytes = texture.bytes;
+        r.residentBytes = texture.residentBytes;
+        r.framesUnused = frame_ - texture.lastUsedFrame;
+        r.inUse = entry->refs > 0;
+        result.push_back(r);
+    }
+    
+    std::sort(result.begin(), result.end(), [](const Residency &a, const Residency &b) {
+        return a.residentBytes > b.residentBytes;
+    });
+    
+    return result;
+}
+
+void SkinTextures::load(const SkinFile &skin)
+{
+    std::vector<std::string> meshes, filenames;
+    
+    for (const auto& [mesh, filename] : skin.textures)
+    {
+        meshes.push_back(mesh);
+        filenames.push_back(filename);
+    }
+    
+    handles_ = TextureCache::instance().load(filenames, &decodeStats_);
+    
+    for (size_t i = 0; i < handles_.size(); ++i)
+    {
+        if (handles_[i])
+        {
+            textures_[meshes[i]] = handles_[i];
+        }
+    }
+}
+
+void SkinTextures::uploadStep(int step)
+{
+    // Shared textures are uploaded by whichever skin gets to them first.
+    if (handles_[step]) TextureCache::instance().upload(*handles_[step]);
+}
+
+unsigned int SkinTextures::texture(const std::string& surface) const
+{
+    auto it = textures_.find(surface);
+    
+    if (it == textures_.end()) return 0;
+    
+    it->second->lastUsedFrame = TextureCache::instance().frame();
+    return it->second->id;
+}
@@ -0,0 +1,199 @@
+//
+//  TextureCache.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "FileSystem.h"
+#include "Utils.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// A texture shared by every model that uses the same image.
+struct CachedTexture
+{
+    std::string path;
+    uint64_t hash = 0;
+    
+    /// The file it was decoded from, to map or decode it again when its levels change.
+    std::string filename;
+    
+    /// 0 until uploaded on the main thread.
+    unsigned int id = 0;
+    
+    /// Pixels of every level until the upload, released after it.
+    TextureImage image;
+    
+    int width = 0;
+    int height = 0;
+    int numLevels = 0;
+    TextureFormat format = TextureFormat::RGB;
+    
+    /// GL memory of all the levels.
+    size_t bytes = 0;
+    
+    /// Top levels left out of the GL texture to stay in TextureCache::residentBudget. Main thread only.
+    int droppedLevels = 0;
+    size_t residentBytes = 0;
+    uint64_t lastUsedFrame = 0;
+};
+
+/// Every copy of a handle holds a reference, the texture is unused when the last one is gone.
+using TextureHandle = std::shared_ptr<CachedTexture>;
+
+struct SkinFile;
+
+/// The textures of a skin bound to the surface names of a model. Switching
+/// skins replaces only this, the model itself is shared.
+struct SkinTextures
+{
+    /// Acquire or decode the textures, can run on any thread.
+    void load(const SkinFile &skin);
+    
+    /// Upload whatever isn't yet, main thread only.
+    int numUploadSteps() const { return (int)handles_.size(); }
+    void uploadStep(int step);
+    
+    /// GL texture of a surface, 0 if the skin has none.
+    unsigned int texture(const std::string& surface) const;
+    
+    /// Timings of the textures that weren't cached.
+    const TextureDecodeStats& decodeStats() const { return decodeStats_; }
+    
+private:
+    std::unordered_map<std::string, TextureHandle> textures_;
+    std::vector<TextureHandle> handles_;
+    TextureDecodeStats decodeStats_;
+};
+
+// Process wide textures, looked up by the canonical path and, for the same
+// image stored under another name, by a hash of the file. Unused textures
+// are kept in LRU order for the next skin and evicted only when the total
+// goes over the budget, textures in use are never evicted.
+//
+// Lookups and inserts can run on any thread. Handles must be released and
+// textures uploaded on the main thread, since both may touch GL objects.
+
+class TextureCache
+{
+public:
+    static TextureCache& instance()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+    
+    struct Key
+    {
+        std::string path;
+        std::string filename;
+        uint64_t hash = 0;
+        
+        /// The source read for the hash on a miss, decoded from without reading it again.
+        FileData file;
+    };
+    
+    /// A handle to the texture if it's cached, nullptr otherwise. `key` is filled for insert.
+    TextureHandle find(const std::string& filename, Key &key);
+    
+    /// Add a decoded image. If the same one got in meanwhile, that one is returned.
+    TextureHandle insert(const Key &key, TextureImage image);
+    
+    /// Handles to all the textures, decoding the ones that aren't cached in parallel.
+    /// nullptr for those that failed to load. Any thread.
+    std::vector<TextureHandle> load(const std::vector<std::string>& filenames, TextureDecodeStats *stats = nullptr);
+    
+    /// Create the GL texture if it isn't yet, main thread only.
+    void upload(CachedTexture &texture);
+    
+    /// Fit the uploaded textures in residentBudget, once a frame on the main thread. The pixels
+    /// are decoded again on the pool, the new levels are swapped in later through MainQueue.
+    void update();
+    
+    /// Drawing a texture marks it with the current frame, main thread only.
+    uint64_t frame() const { return frame_; }
+    
+    static inline size_t budget = 256 * 1024 * 1024;
+    
+    /// Texture memory of all the uploaded levels. Over it, the textures drawn least recently,
+    /// then the largest ones, drop their top levels. They get them back when it frees up.
+    static inline size_t residentBudget = 512 * 1024 * 1024;
+    
+    struct Stats
+    {
+        int hits = 0;
+        int hashHits = 0;   // found under another path
+        int misses = 0;
+        int evictions = 0;
+        int textures = 0;
+        int unused = 0;
+        size_t bytes = 0;
+        size_t residentBytes = 0;
+        int droppedLevels = 0;
+    };
+    
+    Stats stats() const;
+    
+    struct Residency
+    {
+        std::string path;
+        int width = 0;          // of the top level uploaded
+        int height = 0;
+        int droppedLevels = 0;
+        size_t bytes = 0;
+        size_t residentBytes = 0;
+        uint64_t framesUnused = 0;
+        bool inUse = false;
+    };
+    
+    /// Every uploaded texture, the largest in memory first.
+    std::vector<Residency> residency() const;
+    
+private:
+    TextureCache() = default;
+    
+    struct Entry
+    {
+        std::shared_ptr<CachedTexture> texture;
+        std::vector<std::string> paths;
+        int refs = 0;
+        std::list<Entry*>::iterator unused;
+    };
+    
+    TextureHandle acquire(Entry &entry);
+    void release(CachedTexture *texture);
+    
+    /// Evict unused textures over the budget, called with the mutex locked.
+    void trim();
+    
+    /// Upload the texture again from `image` without its `dropped` top levels, called with the mutex locked.
+    void setDroppedLevels(CachedTexture &texture, const TextureImage &image, int dropped);
+    
+    struct LevelChange
+    {
+        uint64_t hash = 0;
+        std::string filename;
+        int dropped = 0;
+        TextureImage image;
+    };
+    
+    /// Swap in the levels decoded for update(), main thread only.
+    void applyLevelChanges(const std::vector<LevelChange> &changes);
+    
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry*> byPath_;
+    std::unordered_map<uint64_t, std::unique_ptr<Entry>> byHash_;
+    std::list<Entry*> unused_;   // most recently released first
+    Stats stats_;
+    uint64_t frame_ = 0;
+    
+    /// A batch of level changes is being decoded, nothing else is planned until it's applied.
+    bool changingLevels_ = false;
+};
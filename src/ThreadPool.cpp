@@ -0,0 +1,111 @@
+//
+//  ThreadPool.cpp
+//  wolfmv
+//
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool()
+{
+    // The main thread keeps one core for itself.
+    const int numWorkers = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    
+    for (int i = 0; i < numWorkers; ++i)
+    {
+        workers_.emplace_back(&ThreadPool::run, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    
+    condition_.notify_all();
+    
+    for (auto& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::run()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            
+            if (stop_ && queue_.empty()) return;
+            
+            task = std::move(queue_.front());
+            queue_.pop();
+        }
+        
+        task();
+    }
+}
+
+void ThreadPool::async(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push(std::move(task));
+    }
+    
+    condition_.notify_one();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& fn, int maxThreads)
+{
+    if (count <= 0) return;
+    
+    if (maxThreads <= 0) maxThreads = numThreads();
+    
+    const int numHelpers = std::min(maxThreads, count) - 1;
+    
+    struct State
+    {
+        std::atomic<int> next = 0;
+        int finished = 0;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+    
+    auto state = std::make_shared<State>();
+    
+    // Items are claimed one by one, so the caller never waits for a helper that hasn't
+    // started: it finishes whatever is left itself. Late helpers find nothing to do.
+    auto work = [state, count, &fn]()
+    {
+        int i;
+        
+        while ((i = state->next++) < count)
+        {
+            fn(i);
+            
+            std::lock_guard<std::mutex> lock(state->mutex);
+            
+            if (++state->finished == count) state->condition.notify_all();
+        }
+    };
+    
+    for (int i = 0; i < numHelpers; ++i)
+    {
+        async(work);
+    }
+    
+    work();
+    
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->condition.wait(lock, [&]() { return state->finished == count; });
+}
@@ -0,0 +1,48 @@
+//
+//  ThreadPool.h
+//  wolfmv
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for CPU heavy jobs like texture decoding.
+// The workers are started on first use and live until the exit.
+
+class ThreadPool
+{
+public:
+    static ThreadPool& instance()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+    
+    /// Run a task on one of the workers.
+    void async(std::function<void()> task);
+    
+    /// Call `fn(i)` for every i in [0, count) on up to `maxThreads` threads, the
+    /// calling one included, and wait for all of them. 0 means every worker.
+    void parallelFor(int count, const std::function<void(int)>& fn, int maxThreads = 0);
+    
+    /// Workers plus the calling thread.
+    int numThreads() const { return (int)workers_.size() + 1; }
+    
+private:
+    ThreadPool();
+    ~ThreadPool();
+    
+    void run();
+    
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> queue_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stop_ = false;
+};
@@ -0,0 +1,33 @@
+//
+//  UniformRingBuffer.cpp
+//  wolfmv
+//
+
+#include "UniformRingBuffer.h"
+
+#include <glad/glad.h>
+
+UniformRingBuffer::UniformRingBuffer() : FencedRingBuffer(GL_UNIFORM_BUFFER)
+{
+}
+
+void UniformRingBuffer::init(size_t segmentSize, size_t maxRangeSize)
+{
+    GLint alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    
+    if (alignment > 0)
+    {
+        alignment_ = alignment;
+    }
+    
+    maxRangeSize_ = maxRangeSize;
+    
+    // Ranges are always bound with the full block size, even at the end of the last segment.
+    FencedRingBuffer::init(segmentSize, alignment_, maxRangeSize_);
+}
+
+void UniformRingBuffer::bindRange(unsigned int bindingPoint, size_t offset) const
+{
+    glBindBufferRange(GL_UNIFORM_BUFFER, bindingPoint, buffer(), segmentOffset() + offset, maxRangeSize_);
+}
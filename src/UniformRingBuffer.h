@@ -0,0 +1,29 @@
+//
+//  UniformRingBuffer.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "FencedRingBuffer.h"
+
+// Uniform blocks of everything drawn in a frame, see FencedRingBuffer.
+
+class UniformRingBuffer : public FencedRingBuffer
+{
+public:
+    UniformRingBuffer();
+    
+    /// `maxRangeSize` is the size of the largest uniform block bound from this buffer.
+    void init(size_t segmentSize, size_t maxRangeSize);
+    
+    /// Reserve `size` bytes in the staging area, returns the offset of the range.
+    size_t allocate(size_t size) { return allocateBytes(size, alignment_); }
+    uint8_t* data(size_t offset) { return staging_.data() + offset; }
+    
+    void bindRange(unsigned int bindingPoint, size_t offset) const;
+    
+private:
+    size_t maxRangeSize_ = 0;
+    size_t alignment_ = 256;
+};
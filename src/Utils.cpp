@@ -6,10 +6,24 @@
 //
 
 #include "Utils.h"
+#include "FileSystem.h"
+#include "ThreadPool.h"
+#include "CookedCache.h"
+#include "BlockCompression.h"
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <cstdio>
+#include <cstring>
 #include <glad/glad.h>
 
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "../deps/stb_image.h"
 
@@ -19,7 +33,7 @@ std::string resolvePath(const std::string& filename, const std::vector<std::stri
     
     fs::path originalPath(filename);
     
-    if (originalPath.has_extension() && fs::exists(originalPath)) return filename;
+    if (originalPath.has_extension() && FileSystem::instance().exists(filename)) return filename;
     
     fs::path basePath = originalPath;
     basePath.replace_extension();
@@ -29,34 +43,553 @@ std::string resolvePath(const std::string& filename, const std::vector<std::stri
         fs::path testPath = basePath;
         testPath.replace_extension(ext);
         
-        if (fs::exists(testPath)) return testPath.string();
+        if (FileSystem::instance().exists(testPath.string())) return testPath.string();
     }
     
     return "";
 }
 
-GLuint loadTexture(std::string filename)
+#define COOKED_TEXTURE_IDENT (('X'<<24)+('E'<<16)+('T'<<8)+'W')
+
+// Not in the core profile loader, the values come from GL_EXT_texture_compression_s3tc.
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+
+enum
+{
+    COOKED_TEXTURE_INFO = 1,
+    COOKED_TEXTURE_PIXELS
+};
+
+struct CookedTextureInfo
+{
+    int32_t width;
+    int32_t height;
+    int32_t numLevels;
+    int32_t format;
+    float psnr;
+    int32_t reserved;
+    uint64_t uncompressedBytes;
+};
+
+static int numMipLevels(int width, int height)
+{
+    int levels = 1;
+    
+    while (width > 1 || height > 1)
+    {
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        levels++;
+    }
+    
+    return levels;
+}
+
+static bool isCompressed(TextureFormat format)
+{
+    return format == TextureFormat::BC1 || format == TextureFormat::BC3;
+}
+
+static int numChannels(TextureFormat format)
+{
+    return format == TextureFormat::RGBA || format == TextureFormat::BC3 ? 4 : 3;
+}
+
+static size_t levelBytes(TextureFormat format, int width, int height)
+{
+    switch (format)
+    {
+        case TextureFormat::BC1: return bc1Bytes(width, height);
+        case TextureFormat::BC3: return bc3Bytes(width, height);
+        default: return (size_t)width * height * numChannels(format);
+    }
+}
+
+static size_t pyramidBytes(TextureFormat format, int width, int height)
+{
+    size_t bytes = 0;
+    
+    for (int level = 0; level < numMipLevels(width, height); ++level)
+    {
+        bytes += levelBytes(format, std::max(1, width >> level), std::max(1, height >> level));
+    }
+    
+    return bytes;
+}
+
+// Point the mips at a pyramid of `size` bytes, levels back to back. False if it doesn't fit.
+static bool setMips(TextureImage &image, const uint8_t *pyramid, size_t size)
+{
+    image.mips.clear();
+    
+    const int levels = numMipLevels(image.width, image.height);
+    size_t offset = 0;
+    
+    for (int level = 0; level < levels; ++level)
+    {
+        const size_t bytes = levelBytes(image.format, std::max(1, image.width >> level), std::max(1, image.height >> level));
+        
+        if (offset + bytes > size) return false;
+        
+        image.mips.emplace_back(pyramid + offset, bytes);
+        offset += bytes;
+    }
+    
+    return true;
+}
+
+// Box filter of every 2x2 block, odd sizes repeat the last row and column.
+static void buildMips(TextureImage &image)
+{
+    const int channels = numChannels(image.format);
+    
+    for (size_t level = 1; level < image.mips.size(); ++level)
+    {
+        const uint8_t *src = image.mips[level - 1].data();
+        uint8_t *mip = (uint8_t *)image.mips[level].data();
+        
+        const int width = std::max(1, image.width >> (level - 1));
+        const int height = std::max(1, image.height >> (level - 1));
+        const int mipWidth = std::max(1, width / 2);
+        const int mipHeight = std::max(1, height / 2);
+        
+        for (int y = 0; y < mipHeight; ++y)
+        {
+            const uint8_t *row0 = src + std::min(y * 2, height - 1) * width * channels;
+            const uint8_t *row1 = src + std::min(y * 2 + 1, height - 1) * width * channels;
+            
+            for (int x = 0; x < mipWidth; ++x)
+            {
+                const int x0 = std::min(x * 2, width - 1) * channels;
+                const int x1 = std::min(x * 2 + 1, width - 1) * channels;
+                
+                for (int c = 0; c < channels; ++c)
+                {
+                    mip[(y * mipWidth + x) * channels + c] = (uint8_t)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+                }
+            }
+        }
+    }
+}
+
+// Encode every level of an RGB or RGBA pyramid to BC1 or BC3. The work is split into
+// runs of block rows of all the levels and spread over the thread pool.
+static TextureImage compressTexture(const TextureImage &source, float *psnrOut)
+{
+    TextureImage image;
+    image.width = source.width;
+    image.height = source.height;
+    image.format = source.format == TextureFormat::RGBA ? TextureFormat::BC3 : TextureFormat::BC1;
+    
+    auto pyramid = std::make_shared<std::vector<uint8_t>>(pyramidBytes(image.format, image.width, image.height));
+    image.owner = pyramid;
+    setMips(image, pyramid->data(), pyramid->size());
+    
+    struct Run
+    {
+        int level;
+        int firstRow;
+        int numRows;
+    };
+    
+    const int rowsPerRun = 16;
+    std::vector<Run> runs;
+    
+    for (int level = 0; level < (int)image.mips.size(); ++level)
+    {
+        const int blockRows = (std::max(1, image.height >> level) + 3) / 4;
+        
+        for (int row = 0; row < blockRows; row += rowsPerRun)
+        {
+            runs.push_back({ level, row, std::min(rowsPerRun, blockRows - row) });
+        }
+    }
+    
+    ThreadPool::instance().parallelFor((int)runs.size(), [&](int i) {
+        const Run &run = runs[i];
+        const int width = std::max(1, image.width >> run.level);
+        const int height = std::max(1, image.height >> run.level);
+        uint8_t *blocks = (uint8_t *)image.mips[run.level].data();
+        
+        if (image.format == TextureFormat::BC3)
+            encodeBC3(source.mips[run.level].data(), width, height, blocks, run.firstRow, run.numRows);
+        else
+            encodeBC1(source.mips[run.level].data(), width, height, 3, blocks, run.firstRow, run.numRows);
+    });
+    
+    if (psnrOut)
+    {
+        const int channels = numChannels(source.format);
+        std::vector<uint8_t> decoded(source.mips[0].size());
+        
+        if (image.format == TextureFormat::BC3)
+            decodeBC3(image.mips[0].data(), image.width, image.height, channels, decoded.data());
+        else
+            decodeBC1(image.mips[0].data(), image.width, image.height, channels, decoded.data());
+        
+        *psnrOut = psnr(source.mips[0].data(), decoded.data(), decoded.size());
+    }
+    
+    return image;
+}
+
+static bool loadCookedTexture(const CookedFile &cooked, TextureImage &image, TextureDecodeStats::Texture *stats)
+{
+    auto info = cooked.section<CookedTextureInfo>(COOKED_TEXTURE_INFO);
+    auto pixels = cooked.section<uint8_t>(COOKED_TEXTURE_PIXELS);
+    
+    if (info.size() != 1 || info[0].width < 1 || info[0].height < 1) return false;
+    
+    const auto format = (TextureFormat)info[0].format;
+    
+    if (format < TextureFormat::RGB || format > TextureFormat::BC3) return false;
+    
+    // Cooked with the other compression setting, cook it again.
+    if (isCompressed(format) != TextureCompression::enabled) return false;
+    
+    image.width = info[0].width;
+    image.height = info[0].height;
+    image.format = format;
+    image.owner = cooked.file.owner;
+    
+    if (stats)
+    {
+        stats->psnr = info[0].psnr;
+        stats->uncompressedBytes = info[0].uncompressedBytes;
+    }
+    
+    return (int)info[0].numLevels == numMipLevels(image.width, image.height) && setMips(image, pixels.data(), pixels.size());
+}
+
+bool decodeTexture(std::string filename, TextureImage &image, TextureDecodeStats::Texture *stats)
 {
     filename = resolvePath(filename, {".tga", ".jpg"});
     
-    if (filename.empty()) return 0;
+    if (filename.empty()) return false;
+    
+    return decodeTexture(filename, FileSystem::instance().read(filename), image, stats);
+}
+
+bool decodeTexture(const std::string& filename, const FileData &file, TextureImage &image, TextureDecodeStats::Texture *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    if (file.empty()) return false;
+    
+    CookedCache::Key key;
+    CookedFile cooked = CookedCache::instance().open(filename, file, COOKED_TEXTURE_IDENT, key);
+    
+    if (!cooked.empty() && loadCookedTexture(cooked, image, stats))
+    {
+        if (stats)
+        {
+            stats->decodeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+            stats->bytes = pyramidBytes(image.format, image.width, image.height);
+            stats->cooked = true;
+        }
+        
+        return true;
+    }
+    
+    // Alpha is kept only where the source has it, everything else stays RGB.
+    int width = 0, height = 0, num_channels = 3;
+    stbi_info_from_memory(file.data(), (int)file.size(), &width, &height, &num_channels);
+    
+    const int channels = num_channels == 2 || num_channels == 4 ? 4 : 3;
+    unsigned char* pixels = stbi_load_from_memory(file.data(), (int)file.size(), &image.width, &image.height, &num_channels, channels);
+    
+    if (pixels == nullptr) return false;
+    
+    image.format = channels == 4 ? TextureFormat::RGBA : TextureFormat::RGB;
+    
+    // The whole pyramid in one buffer, laid out like in the cooked file.
+    auto pyramid = std::make_shared<std::vector<uint8_t>>(pyramidBytes(image.format, image.width, image.height));
+    memcpy(pyramid->data(), pixels, (size_t)image.width * image.height * channels);
+    stbi_image_free(pixels);
+    
+    image.owner = pyramid;
+    setMips(image, pyramid->data(), pyramid->size());
+    
+    auto decoded = std::chrono::steady_clock::now();
+    
+    buildMips(image);
+    
+    auto mipsBuilt = std::chrono::steady_clock::now();
+    
+    CookedTextureInfo info = {};
+    info.uncompressedBytes = pyramid->size();
+    
+    if (TextureCompression::enabled)
+    {
+        image = compressTexture(image, &info.psnr);
+    }
+    
+    // The levels are back to back in the buffer of the first one.
+    const std::span<const uint8_t> levels(image.mips[0].data(), pyramidBytes(image.format, image.width, image.height));
     
+    if (stats)
+    {
+        stats->decodeMs = std::chrono::duration<float, std::milli>(decoded - start).count();
+        stats->mipsMs = std::chrono::duration<float, std::milli>(mipsBuilt - decoded).count();
+        stats->compressMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - mipsBuilt).count();
+        stats->psnr = info.psnr;
+        stats->uncompressedBytes = info.uncompressedBytes;
+        stats->bytes = levels.size();
+    }
+    
+    info.width = image.width;
+    info.height = image.height;
+    info.numLevels = (int32_t)image.mips.size();
+    info.format = (int32_t)image.format;
+    
+    CookedWriter writer;
+    writer.add(COOKED_TEXTURE_INFO, &info, sizeof(info));
+    writer.add(COOKED_TEXTURE_PIXELS, levels);
+    CookedCache::instance().store(key, std::move(writer));
+    
+    return true;
+}
+
+// `files` is null when the sources aren't read yet.
+static std::vector<TextureImage> decodeTextures(const std::vector<std::string>& filenames, const std::vector<FileData> *files,
+                                                int maxThreads, TextureDecodeStats *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    std::vector<TextureImage> images(filenames.size());
+    std::vector<TextureDecodeStats::Texture> timings(filenames.size());
+    
+    ThreadPool::instance().parallelFor((int)filenames.size(), [&](int i) {
+        timings[i].filename = filenames[i];
+        
+        const bool decoded = files ? decodeTexture(filenames[i], (*files)[i], images[i], &timings[i])
+                                   : decodeTexture(filenames[i], images[i], &timings[i]);
+        
+        if (!decoded)
+        {
+            images[i] = TextureImage();
+        }
+    }, maxThreads);
+    
+    if (stats)
+    {
+        stats->textures = std::move(timings);
+        stats->threads = std::min(maxThreads > 0 ? maxThreads : ThreadPool::instance().numThreads(), std::max(1, (int)filenames.size()));
+        stats->wallMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    return images;
+}
+
+std::vector<TextureImage> decodeTextures(const std::vector<std::string>& filenames, int maxThreads, TextureDecodeStats *stats)
+{
+    return decodeTextures(filenames, nullptr, maxThreads, stats);
+}
+
+std::vector<TextureImage> decodeTextures(const std::vector<std::string>& filenames, const std::vector<FileData>& files,
+                                         int maxThreads, TextureDecodeStats *stats)
+{
+    return decodeTextures(filenames, &files, maxThreads, stats);
+}
+
+float TextureDecodeStats::serialMs() const
+{
+    float ms = 0;
+    
+    for (const auto& texture : textures)
+    {
+        ms += texture.decodeMs + texture.mipsMs + texture.compressMs;
+    }
+    
+    return ms;
+}
+
+size_t TextureDecodeStats::bytes() const
+{
+    size_t bytes = 0;
+    
+    for (const auto& texture : textures)
+    {
+        bytes += texture.bytes;
+    }
+    
+    return bytes;
+}
+
+size_t TextureDecodeStats::uncompressedBytes() const
+{
+    size_t bytes = 0;
+    
+    for (const auto& texture : textures)
+    {
+        bytes += texture.uncompressedBytes;
+    }
+    
+    return bytes;
+}
+
+GLuint uploadTexture(const TextureImage &image, int firstLevel)
+{
     GLuint id;
     glGenTextures(1, &id);
     
-    int width, height;
-    int num_channels = 3;
-    unsigned char* image = stbi_load(filename.c_str(), &width, &height, &num_channels, 3);
-    
     glBindTexture(GL_TEXTURE_2D, id);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (int)image.mips.size() - 1 - firstLevel);
     
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(image);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    const bool bc3 = image.format == TextureFormat::BC3;
+    const GLenum format = numChannels(image.format) == 4 ? GL_RGBA : GL_RGB;
+    std::vector<uint8_t> decoded;
+    
+    // The mips are built on the CPU with the rest of the decoding, here they are only copied.
+    for (int level = firstLevel; level < (int)image.mips.size(); ++level)
+    {
+        const int width = std::max(1, image.width >> level);
+        const int height = std::max(1, image.height >> level);
+        const uint8_t *pixels = image.mips[level].data();
+        
+        if (isCompressed(image.format) && TextureCompression::supported)
+        {
+            const GLenum internalFormat = bc3 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            glCompressedTexImage2D(GL_TEXTURE_2D, level - firstLevel, internalFormat, width, height, 0, (GLsizei)image.mips[level].size(), pixels);
+            continue;
+        }
+        
+        // No S3TC in the driver, decode the blocks back to pixels.
+        if (isCompressed(image.format))
+        {
+            decoded.resize((size_t)width * height * numChannels(image.format));
+            
+            if (bc3)
+                decodeBC3(pixels, width, height, 4, decoded.data());
+            else
+                decodeBC1(pixels, width, height, 3, decoded.data());
+            
+            pixels = decoded.data();
+        }
+        
+        glTexImage2D(GL_TEXTURE_2D, level - firstLevel, format, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+    }
     
     return id;
 }
+
+size_t uploadedLevelBytes(TextureFormat format, int width, int height, int level)
+{
+    width = std::max(1, width >> level);
+    height = std::max(1, height >> level);
+    
+    if (isCompressed(format) && !TextureCompression::supported)
+    {
+        return (size_t)width * height * numChannels(format);
+    }
+    
+    return levelBytes(format, width, height);
+}
+
+GLuint loadTexture(std::string filename)
+{
+    TextureImage image;
+    
+    if (!decodeTexture(filename, image)) return 0;
+    
+    return uploadTexture(image);
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// The finalizer of MurmurHash3, every input bit reaches every output bit.
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    
+    return k;
+}
+
+// A word is scrambled before it joins the hash, so bit flips in neighbouring words can't cancel.
+static uint64_t mixWord(uint64_t hash, uint64_t word)
+{
+    word *= 0x87c37b91114253d5ull;
+    word = rotl64(word, 31);
+    word *= 0x4cf5ad432745937full;
+    
+    hash ^= word;
+    
+    return rotl64(hash, 27) * 5 + 0x52dce729;
+}
+
+uint64_t hashBytes(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    
+    // A word at a time, the source models are a few megabytes. Read little endian,
+    // so the cooked files get the same names and hashes on every machine.
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word = 0;
+        
+        for (int b = 0; b < 8; ++b)
+        {
+            word |= (uint64_t)data[i + b] << (8 * b);
+        }
+        
+        hash = mixWord(hash, word);
+    }
+    
+    if (i < size)
+    {
+        uint64_t word = 0;
+        
+        for (int b = 0; i < size; ++i, ++b)
+        {
+            word |= (uint64_t)data[i] << (8 * b);
+        }
+        
+        hash = mixWord(hash, word);
+    }
+    
+    return fmix64(hash ^ size);
+}
+
+size_t residentMemoryBytes()
+{
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    
+    return info.resident_size;
+#elif defined(__linux__)
+    FILE* fp = fopen("/proc/self/statm", "r");
+    
+    if (fp == nullptr) return 0;
+    
+    long pages = 0, residentPages = 0;
+    
+    if (fscanf(fp, "%ld %ld", &pages, &residentPages) != 2)
+    {
+        residentPages = 0;
+    }
+    
+    fclose(fp);
+    
+    return (size_t)residentPages * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
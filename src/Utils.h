@@ -7,8 +7,92 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <string>
 #include <vector>
 
+enum class TextureFormat : int32_t
+{
+    RGB,
+    RGBA,
+    BC1,    // RGB in 4x4 blocks of 8 bytes
+    BC3     // RGBA in 4x4 blocks of 16 bytes
+};
+
+/// Texture pixels decoded on the CPU, waiting for a GL upload.
+struct TextureImage
+{
+    int width = 0;
+    int height = 0;
+    TextureFormat format = TextureFormat::RGB;
+    std::vector<std::span<const uint8_t>> mips;    // level 0 first
+    
+    /// Keeps the pixels alive: the decoded pyramid or the mapped cooked file.
+    std::shared_ptr<const void> owner;
+    
+    bool empty() const { return mips.empty(); }
+};
+
+/// Timings of a batch of textures decoded by decodeTextures.
+struct TextureDecodeStats
+{
+    struct Texture
+    {
+        std::string filename;
+        float decodeMs = 0;
+        float mipsMs = 0;
+        float compressMs = 0;
+        bool cooked = false;    // read from the cooked cache, nothing decoded
+        
+        size_t bytes = 0;                 // all the levels as uploaded
+        size_t uncompressedBytes = 0;     // all the levels as RGB or RGBA
+        float psnr = 0;                   // of level 0 after block compression, 0 if uncompressed
+    };
+    
+    std::vector<Texture> textures;
+    int threads = 0;
+    float wallMs = 0;
+    
+    /// The time the same work takes on one thread.
+    float serialMs() const;
+    
+    size_t bytes() const;
+    size_t uncompressedBytes() const;
+};
+
+struct FileData;
+
 std::string resolvePath(const std::string& filename, const std::vector<std::string>& extensions);
+
+/// Decode a texture and build its mip chain, can be called from any thread.
+/// With TextureCompression::enabled the levels are encoded to BC1, or BC3 if the source has alpha.
+/// Up to date pyramids are mapped from the cooked cache, new ones are cooked.
+bool decodeTexture(std::string filename, TextureImage &image, TextureDecodeStats::Texture *stats = nullptr);
+
+/// The same from the source already read, `filename` is the resolved path it was read from.
+bool decodeTexture(const std::string& filename, const FileData &file, TextureImage &image, TextureDecodeStats::Texture *stats = nullptr);
+
+/// Decode the textures concurrently on the thread pool, `maxThreads` 0 uses all of it.
+std::vector<TextureImage> decodeTextures(const std::vector<std::string>& filenames, int maxThreads = 0, TextureDecodeStats *stats = nullptr);
+
+/// The same from the sources already read, one per resolved filename.
+std::vector<TextureImage> decodeTextures(const std::vector<std::string>& filenames, const std::vector<FileData>& files,
+                                         int maxThreads = 0, TextureDecodeStats *stats = nullptr);
+
+/// Create a GL texture from the mips starting at `firstLevel`, main thread only.
+unsigned int uploadTexture(const TextureImage &image, int firstLevel = 0);
+
+/// GL memory of one level as uploadTexture creates it: blocks where the driver takes
+/// S3TC, RGB or RGBA pixels otherwise.
+size_t uploadedLevelBytes(TextureFormat format, int width, int height, int level);
+
 unsigned int loadTexture(std::string filename);
+
+/// MurmurHash3 style 64-bit hash over little endian 8 byte words, the length folded
+/// in before the final mix. For telling files apart rather than security.
+uint64_t hashBytes(const uint8_t *data, size_t size);
+
+/// Resident set size of the process in bytes, 0 where it isn't available.
+size_t residentMemoryBytes();
@@ -13,6 +13,16 @@ namespace math {
     const vec3 vec3::empty;
     const vec4 vec4::empty;
     
+    float shortSinTable[65536 + 16384];
+    
+    static const bool shortSinTableReady = []
+    {
+        for (int i = 0; i < 65536 + 16384; i++)
+            shortSinTable[i] = sin(i * (2.0 * M_PI / 65536));
+        
+        return true;
+    }();
+    
     float vec3::dotProduct(const vec3 &v1, const vec3 &v2)
     {
         return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
@@ -189,6 +199,34 @@ namespace math {
         }
     }
     
+    void vec3::shortAngleVectors(const uint16_t angles[3], vec3 *forward, vec3 *right, vec3 *up)
+    {
+        const float sy = SinShort(angles[YAW]), cy = CosShort(angles[YAW]);
+        const float sp = SinShort(angles[PITCH]), cp = CosShort(angles[PITCH]);
+        const float sr = SinShort(angles[ROLL]), cr = CosShort(angles[ROLL]);
+        
+        if (forward)
+        {
+            (*forward)[0] = cp*cy;
+            (*forward)[1] = cp*sy;
+            (*forward)[2] = -sp;
+        }
+        
+        if (right)
+        {
+            (*right)[0] = (-1*sr*sp*cy+-1*cr*-sy);
+            (*right)[1] = (-1*sr*sp*sy+-1*cr*cy);
+            (*right)[2] = -1*sr*cp;
+        }
+        
+        if (up)
+        {
+            (*up)[0] = (cr*sp*cy+-sr*-sy);
+            (*up)[1] = (cr*sp*sy+-sr*cy);
+            (*up)[2] = cr*cp;
+        }
+    }
+    
     vec3 vec3::rotated(const vec3 &direction, float degrees) const
     {
         float cos_ia = degrees * M_PI / 180.0f;
@@ -0,0 +1,18 @@
+//
+//  VertexRingBuffer.cpp
+//  wolfmv
+//
+
+#include "VertexRingBuffer.h"
+
+#include <glad/glad.h>
+
+VertexRingBuffer::VertexRingBuffer() : FencedRingBuffer(GL_ARRAY_BUFFER)
+{
+}
+
+void VertexRingBuffer::init(size_t segmentVertices)
+{
+    // Vertex attributes only need their offsets aligned to the float components.
+    FencedRingBuffer::init(segmentVertices * sizeof(math::vec3), alignof(math::vec3));
+}
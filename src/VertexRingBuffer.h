@@ -0,0 +1,27 @@
+//
+//  VertexRingBuffer.h
+//  wolfmv
+//
+
+#pragma once
+
+#include "FencedRingBuffer.h"
+#include "Math.h"
+
+// Vertex positions animated on the CPU for everything drawn in a frame, see
+// FencedRingBuffer. Draws read them with the offset returned by byteOffset.
+
+class VertexRingBuffer : public FencedRingBuffer
+{
+public:
+    VertexRingBuffer();
+    
+    void init(size_t segmentVertices);
+    
+    /// Reserve `count` positions in the staging area, returns the first one.
+    size_t allocate(size_t count) { return allocateBytes(count * sizeof(math::vec3), alignof(math::vec3)) / sizeof(math::vec3); }
+    math::vec3* data(size_t first) { return (math::vec3 *)staging_.data() + first; }
+    
+    /// Where a staged position is in the buffer after the upload.
+    size_t byteOffset(size_t first) const { return segmentOffset() + first * sizeof(math::vec3); }
+};
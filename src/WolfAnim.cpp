@@ -6,6 +6,7 @@
 //
 
 #include "WolfAnim.h"
+#include "FileSystem.h"
 
 #include <iostream>
 #include <fstream>
@@ -31,12 +32,14 @@ std::vector<std::string> tokenize(const std::string& line)
 
 std::vector<AnimationEntry> parseWolfAnimFile(const std::string& filename)
 {
-    std::ifstream file(filename);
-    if (!file.is_open())
+    FileData data = FileSystem::instance().read(filename);
+    if (data.empty())
     {
         throw std::runtime_error("Cannot open file: " + filename);
     }
     
+    std::istringstream file(std::string((const char *)data.data(), data.size()));
+    
     std::vector<AnimationEntry> animations;
     std::string line;
     bool parsingAnims = false;
@@ -10,34 +10,95 @@
 #include "WolfAnim.h"
 #include "Skin.h"
 #include "Utils.h"
+#include "FileSystem.h"
+#include "ModelCache.h"
 
-void WolfCharacter::init(const std::filesystem::path& dir, const std::string &skinName)
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+bool WolfCharacter::load(const std::filesystem::path& dir, const std::string &skinName, std::vector<AnimationEntry> &animations,
+                         std::string &error, const std::function<bool (float)> &report)
 {
+    auto start = std::chrono::steady_clock::now();
+    
+    try {
+        animations = parseWolfAnimFile((dir / "wolfanim.cfg").string());
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    
+    if (animations.empty())
+    {
+        error = "No animations in " + (dir / "wolfanim.cfg").string();
+        return false;
+    }
+    
     auto bodyMDSPath = dir / "body.mds";
     
+    body = ModelCache<MDSModel>::instance().get(bodyMDSPath.string(), &reusedBody_);
+    
+    if (!body->loaded())
+    {
+        error = "Cannot load " + bodyMDSPath.string();
+        return false;
+    }
+    
     auto bodySkinPath = dir / ("body_" + skinName + ".skin");
-    auto bodySkin = parseSkinFile(bodySkinPath.string());
+    auto bodySkinFile = parseSkinFile(bodySkinPath.string());
+    
+    bodySkin.load(bodySkinFile);
     
-    body.loadFromFile(bodyMDSPath.string(), bodySkin);
+    if (!report(0.7f)) return false;
     
     auto headSkinPath = dir / ("head_" + skinName + ".skin");
-    auto headSkin = parseSkinFile(headSkinPath.string());
+    auto headSkinFile = parseSkinFile(headSkinPath.string());
     
     auto headMD3path = dir / "head.mdc";
     
-    if (headSkin.attachments.contains("md3_part"))
+    if (headSkinFile.attachments.contains("md3_part"))
     {
-        headMD3path = dir / headSkin.attachments["md3_part"];
+        // In the game the part is a full path, loose folders often have just the name.
+        const std::string& part = headSkinFile.attachments["md3_part"];
+        headMD3path = FileSystem::instance().exists(part) ? std::filesystem::path(part) : dir / part;
     }
     
-    headMD3path = resolvePath(headMD3path.string(), {".mdc"});
+    const std::string headFile = resolvePath(headMD3path.string(), {".mdc", ".md3"});
+    
+    head = ModelCache<MD3Model>::instance().get(headFile, &reusedHead_);
+    
+    if (!head->loaded())
+    {
+        error = "Cannot load " + headMD3path.string();
+        return false;
+    }
+    
+    headSkin.load(headSkinFile);
+    
+    loadMs_ = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    
+    return report(1.0f);
+}
+
+int WolfCharacter::numUploadSteps() const
+{
+    return body->numUploadSteps() + bodySkin.numUploadSteps() + head->numUploadSteps() + headSkin.numUploadSteps();
+}
+
+void WolfCharacter::uploadStep(int step)
+{
+    // Steps of a model another character already uploaded cost nothing.
+    if (step < body->numUploadSteps()) return body->uploadStep(step);
+    step -= body->numUploadSteps();
+    
+    if (step < bodySkin.numUploadSteps()) return bodySkin.uploadStep(step);
+    step -= bodySkin.numUploadSteps();
     
-    head.loadFromFile(headMD3path.string(), headSkin);
+    if (step < head->numUploadSteps()) return head->uploadStep(step);
+    step -= head->numUploadSteps();
     
-//    for (auto& attachment : bodySkin.attachments)
-//    {
-//        attachment.
-//    }
+    headSkin.uploadStep(step);
 }
 
 void WolfCharacter::setAnimation(const AnimationEntry &sequence)
@@ -48,6 +109,32 @@ void WolfCharacter::setAnimation(const AnimationEntry &sequence)
     cur_frame = 0;
 }
 
+void WolfCharacter::setPhase(float phase)
+{
+    cur_frame_time = std::clamp(phase, 0.0f, 1.0f) * (float)numFrames / std::max(1, fps);
+}
+
+std::shared_ptr<WolfCharacter> WolfCharacter::spawn() const
+{
+    auto character = std::make_shared<WolfCharacter>();
+    
+    character->m_name = m_name;
+    character->body = body;
+    character->head = head;
+    character->bodySkin = bodySkin;
+    character->headSkin = headSkin;
+    character->reusedBody_ = true;
+    character->reusedHead_ = true;
+    
+    character->startFrame = startFrame;
+    character->numFrames = numFrames;
+    character->fps = fps;
+    character->animateHead = animateHead;
+    character->headFps = headFps;
+    
+    return character;
+}
+
 void WolfCharacter::update(float dt)
 {
     cur_anim_duration = (float)numFrames / fps;
@@ -62,6 +149,19 @@ void WolfCharacter::update(float dt)
     }
     
     cur_frame = (float)numFrames * (cur_frame_time / cur_anim_duration);
+    
+    const int numHeadFrames = std::max(1, head->numFrames());
+    
+    if (animateHead)
+    {
+        headFrame = fmodf(headFrame + dt * headFps, (float)numHeadFrames);
+    }
+    
+    headFrame = std::clamp(headFrame, 0.0f, (float)(numHeadFrames - 1) + (animateHead ? 0.999f : 0.0f));
+    
+    headPose.oldFrame = (int)headFrame;
+    headPose.frame = animateHead ? (headPose.oldFrame + 1) % numHeadFrames : std::min(headPose.oldFrame + 1, numHeadFrames - 1);
+    headPose.lerp = headFrame - (float)headPose.oldFrame;
 }
 
 void WolfCharacter::updatePose()
@@ -76,14 +176,39 @@ void WolfCharacter::updatePose()
     entity.oldTorsoFrame = startFrame + currIndex;
     entity.lerp = factor;
     entity.torsoLerp = factor;
+    
+    body->calculatePose(entity, skeleton);
+}
+
+void WolfCharacter::prepare(UniformRingBuffer &ring, VertexRingBuffer &vertices)
+{
+    body->writeBonePalettes(skeleton, ring, bonePalettes);
+    headVertices = head->writeVertices(headPose, vertices);
+}
+
+void WolfCharacter::selectLod(const glm::mat4 &mvp, float focalScale)
+{
+    vec3 origin;
+    float radius;
+    body->frameBounds(entity.frame, origin, radius);
+    
+    lodInfo_.clipCenter = mvp * glm::vec4(origin.x, origin.y, origin.z, 1.0f);
+    
+    // Like ProjectRadius: the radius on screen relative to the half height, 0 behind the camera.
+    const float dist = lodInfo_.clipCenter.w;
+    lodInfo_.projectedRadius = dist > 0 ? std::min(1.0f, radius * focalScale / dist) : 0.0f;
+    
+    lodInfo_.fraction = body->lodFraction(lodInfo_.projectedRadius);
+    lodInfo_.level = body->lodLevel(lodInfo_.projectedRadius);
+    lodInfo_.numTriangles = body->numLodTriangles(lodInfo_.level);
 }
 
-void WolfCharacter::draw(const glm::mat4 &mvp)
+void WolfCharacter::draw(const glm::mat4 &mvp, const UniformRingBuffer &ring, const VertexRingBuffer &vertices)
 {
-    body.render(mvp, entity);
+    body->render(mvp, bodySkin, ring, bonePalettes, lodInfo_.level);
 
     Transform headTransform;
-    body.lerpTag("tag_head", entity, 0, &headTransform);
+    body->lerpTag("tag_head", skeleton, 0, &headTransform);
     
     glm::mat4 model(1.0f);
     
@@ -104,5 +229,5 @@ void WolfCharacter::draw(const glm::mat4 &mvp)
     model[3][2] = headTransform.position.z;
     
     glm::mat4 headMatrix = mvp * model;
-    head.render(headMatrix);
+    head->render(headMatrix, headSkin, vertices, headVertices, headPose);
 }
@@ -9,25 +9,82 @@
 
 #include "MDSModel.h"
 #include "MD3Model.h"
+#include "TextureCache.h"
 
 #include <glm/glm.hpp>
 #include <filesystem>
+#include <functional>
 
 struct SkinFile;
+class VertexRingBuffer;
 struct AnimationEntry;
 
 // Combination of body.mds and other tags (head etc) according to selected skin
 
 struct WolfCharacter
 {
-    void init(const std::filesystem::path& dir, const std::string &skinName);
+    /// Load both models and the animations on the CPU, any thread. `report` gets the progress and returns
+    /// false to cancel. False when cancelled or when something failed to load, `error` then says what.
+    bool load(const std::filesystem::path& dir, const std::string &skinName, std::vector<AnimationEntry> &animations,
+              std::string &error, const std::function<bool (float progress)> &report);
+    
+    /// Create the GL objects on the main thread, a step at a time.
+    int numUploadSteps() const;
+    void uploadStep(int step);
+    
     void setAnimation(const AnimationEntry& sequence);
     
+    /// Jump to a point of the current sequence, 0 is its start and 1 its end.
+    void setPhase(float phase);
+    
+    /// Another character with the same models and skin textures, nothing is loaded again.
+    /// It starts with the current sequence and gets its own animation from there on.
+    /// Only loaded characters reach the renderer, so a crowd never shares a failed model.
+    std::shared_ptr<WolfCharacter> spawn() const;
+    
     void update(float dt);
-    void draw(const glm::mat4 &mvp);
+    void prepare(UniformRingBuffer &ring, VertexRingBuffer &vertices);
+    void draw(const glm::mat4 &mvp, const UniformRingBuffer &ring, const VertexRingBuffer &vertices);
+    
+    /// Pick the level of detail of the body from the size of its bounding sphere on screen.
+    /// `focalScale` is projection[1][1], half the screen height at a distance of 1.
+    void selectLod(const glm::mat4 &mvp, float focalScale);
+    
+    struct LodInfo
+    {
+        int level = 0;
+        float fraction = 1;
+        float projectedRadius = 0;
+        int numTriangles = 0;
+        
+        /// The center of the bounding sphere in clip space, for labels.
+        glm::vec4 clipCenter = {};
+    };
+    
+    const LodInfo &lodInfo() const { return lodInfo_; }
+    
+    int numHeadFrames() const { return head->numFrames(); }
+    
+    /// Head frames loop at headFps while animateHead is on, otherwise headFrame is shown.
+    bool animateHead = false;
+    float headFrame = 0;
+    int headFps = 15;
+    
+    const MDSModel &bodyModel() const { return *body; }
+    const MD3Model &headModel() const { return *head; }
+    const SkinTextures &bodySkinTextures() const { return bodySkin; }
+    const SkinTextures &headSkinTextures() const { return headSkin; }
+    
+    /// CPU load time, a skin of an open character only loads its textures.
+    float loadMs() const { return loadMs_; }
+    bool reusedBody() const { return reusedBody_; }
+    bool reusedHead() const { return reusedHead_; }
     
     std::string m_name;
     
+    /// Where the character stands, in model units.
+    glm::vec3 origin = { 0, 0, 0 };
+    
 private:
     float cur_frame = 0;
     float cur_frame_time = 0;
@@ -37,12 +94,26 @@ private:
     int numFrames = 1;
     int fps = 15;
     
-    MDSModel body;
-    MD3Model head;
+    // Models are shared between the characters, the skins are their own.
+    std::shared_ptr<MDSModel> body;
+    std::shared_ptr<MD3Model> head;
+    SkinTextures bodySkin;
+    SkinTextures headSkin;
+    
+    float loadMs_ = 0;
+    bool reusedBody_ = false;
+    bool reusedHead_ = false;
     
     std::unordered_map<std::string, MD3Model> attachments;
     
     MDSFrameInfo entity;
+    MDSModel::Skeleton skeleton;
+    std::vector<size_t> bonePalettes;
+    
+    MD3Model::Pose headPose;
+    size_t headVertices = 0;
+    
+    LodInfo lodInfo_;
     
     void updatePose();
 };
@@ -17,6 +17,9 @@
 #include "MDSModel.h"
 #include "Renderer.h"
 #include "Camera.h"
+#include "Cooker.h"
+
+#include <cstring>
 
 static void error_callback(int e, const char *d) { printf("Error %d: %s\n", e, d); }
 
@@ -30,8 +33,12 @@ ImVec4 clear_color = ImColor(114, 144, 154);
 
 void imgui_init(GLFWwindow* window);
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc >= 3 && strcmp(argv[1], "--cook") == 0) {
+        return cookAssets(argv[2]);
+    }
+    
 #ifdef __APPLE__
     sleep(1);
 #endif